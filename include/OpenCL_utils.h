@@ -20,6 +20,10 @@ double second();
 
 cl_int InitOpenCLEnvironment( char * device_type, cl_device_id * device, cl_context * context, cl_command_queue * cmdQueue );
 
+/* all devices of a type (cpu | gpu) on all platforms, the first one is
+ * the device chosen by InitOpenCLEnvironment */
+cl_int FindDevices( char * device_type, cl_device_id * devices, cl_uint maxdev, cl_uint * ndev );
+
 char * source2string( char * filename );
 
 const char * CLErrString(cl_int status);
@@ -36,4 +40,29 @@ void CheckSuccess (cl_int status, const int part);
 
 #define KArg(x) sizeof(x),&(x)
 
+/* Kernel and transfer profiling: with profiling enabled the clProf*
+ * wrappers of the clEnqueue* calls record the device time of each
+ * command, which needs queues created with CL_QUEUE_PROFILING_ENABLE */
+void ProfileEnable( int on );
+int ProfileEnabled();
+cl_int clProfEnqueueNDRangeKernel( cl_command_queue queue, cl_kernel kernel, cl_uint work_dim, const size_t * offset,
+                                   const size_t * global, const size_t * local,
+                                   cl_uint nwait, const cl_event * wait, cl_event * event );
+cl_int clProfEnqueueReadBuffer( cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset, size_t size,
+                                void * ptr, cl_uint nwait, const cl_event * wait, cl_event * event );
+cl_int clProfEnqueueWriteBuffer( cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset, size_t size,
+                                 const void * ptr, cl_uint nwait, const cl_event * wait, cl_event * event );
+cl_int clProfEnqueueCopyBuffer( cl_command_queue queue, cl_mem src, cl_mem dst, size_t src_offset, size_t dst_offset,
+                                size_t size, cl_uint nwait, const cl_event * wait, cl_event * event );
+void * clProfEnqueueMapBuffer( cl_command_queue queue, cl_mem buffer, cl_bool blocking, cl_map_flags flags, size_t offset,
+                               size_t size, cl_uint nwait, const cl_event * wait, cl_event * event, cl_int * status );
+void ProfileReport( FILE * fp );
+void ProfileReportJSON( FILE * fp );
+
+/* build a program for one device, reusing the binary kept in cachedir
+ * from an earlier build with the same device, driver, flags and source
+ * (no cache if cachedir is NULL) */
+cl_program BuildProgramCached( cl_context context, cl_device_id device, const char * source, const char * flags,
+                               const char * cachedir, cl_int * status );
+
 #endif
@@ -0,0 +1,71 @@
+#ifndef __LJMD__
+#define __LJMD__
+
+/* libljmd: the MD engine of ljmd_CL as a library (make lib). An engine
+ * keeps the OpenCL context, the built program, its kernels and the
+ * device buffers from ljmd_create to ljmd_destroy, so any number of
+ * systems can be loaded and run in one process without initializing
+ * OpenCL or building the kernels again.
+ *
+ *     ljmd_engine_t *e = ljmd_create( "gpu", 0, "force=cell" );
+ *
+ *     ljmd_load( e, "argon_2916.inp" );
+ *     ljmd_run( e, 1000 );
+ *     ljmd_query( e, &state );
+ *     ljmd_set( e, "thermostat", "langevin" );
+ *     ljmd_run( e, 1000 );
+ *     ljmd_checkpoint( e, "argon_2916.bin" );
+ *     ljmd_destroy( e );
+ *
+ * The engine runs one device with the soa layout and integrate=split.
+ * All functions but ljmd_create return 0 on success and -1 on errors,
+ * which are reported on stderr. */
+
+typedef struct _ljmd_engine ljmd_engine_t;
+
+/* state of the loaded system after the last step */
+struct _ljmd_state {
+    int natoms, nfi;
+    double box, temp, ekin, epot, etot;
+};
+typedef struct _ljmd_state ljmd_state_t;
+
+/* open a device (cpu | gpu) and build the kernels. nthreads is the
+ * global work size (0 = the default of the device type), options a
+ * blank separated list of keyword=value settings of ljmd_CL. pbc,
+ * wgsize, progcache and zerocopy are fixed from here on. Returns NULL
+ * if the device or the kernels are not available. */
+ljmd_engine_t * ljmd_create( const char * device, int nthreads, const char * options );
+
+/* release the device buffers, kernels and the OpenCL context */
+void ljmd_destroy( ljmd_engine_t * e );
+
+/* load the system of an input file in the format of ljmd_CL, with
+ * options after its mandatory lines as with ljmd_set. The device
+ * buffers of the previous system are reused if they are large enough.
+ * Energies and trajectory go to the files named by the input. */
+int ljmd_load( ljmd_engine_t * e, const char * input );
+
+/* change a setting of ljmd_CL, or of the loaded system one of dt,
+ * nsteps, nprint, mass, epsilon, sigma and rcut. Takes effect with
+ * the next ljmd_run, the system settings until the next ljmd_load.
+ * Returns -1 for an unknown key or a value that does not convert. */
+int ljmd_set( ljmd_engine_t * e, const char * key, const char * value );
+
+/* integrate nsteps steps (0 = the steps of the input) */
+int ljmd_run( ljmd_engine_t * e, int nsteps );
+
+/* energies, temperature and step of the loaded system */
+int ljmd_query( ljmd_engine_t * e, ljmd_state_t * state );
+
+/* copy positions or velocities of the natoms atoms to the host */
+int ljmd_get_positions( ljmd_engine_t * e, double * rx, double * ry, double * rz );
+int ljmd_get_velocities( ljmd_engine_t * e, double * vx, double * vy, double * vz );
+
+/* write a binary restart of the loaded system, which ljmd_restore and
+ * ljmd_CL read back, or replace its atoms by those of a restart and
+ * continue from its step */
+int ljmd_checkpoint( ljmd_engine_t * e, const char * file );
+int ljmd_restore( ljmd_engine_t * e, const char * file );
+
+#endif
@@ -0,0 +1,362 @@
+#ifndef __LJMD_CORE__
+#define __LJMD_CORE__
+
+/* the parts of ljmd_CL shared by the program (ljmd-cl.c) and libljmd
+ * (ljmd-engine.c), implemented in ljmd-core.c: the settings, the input
+ * and restart files, the force kernels, the on-device sums, the
+ * thermostats and the output. */
+
+#include "OpenCL_utils.h"
+
+#if defined(_USE_FLOAT) && defined(_USE_MIXED)
+#error "_USE_FLOAT and _USE_MIXED exclude each other"
+#endif
+
+/* PAIRTYPE is the type of the pair distances and forces in the force
+ * kernels, float in the mixed precision build (-D_USE_MIXED) where
+ * everything else is double. PRECISION names the build in the
+ * autotuner cache. */
+#ifdef _USE_FLOAT
+#define FPTYPE float
+#define PAIRTYPE float
+#define PRECISION "float"
+#define ZERO  0.0f
+#define HALF  0.5f
+#define TWO   2.0f
+#define THREE 3.0f
+#else
+#define FPTYPE double
+#ifdef _USE_MIXED
+#define PAIRTYPE float
+#define PRECISION "mixed"
+#else
+#define PAIRTYPE double
+#define PRECISION "double"
+#endif
+#define ZERO  0.0
+#define HALF  0.5
+#define TWO   2.0
+#define THREE 3.0
+#endif
+
+/* OpenCL build options of the precision */
+extern const char kernelflags[];
+
+/* generic file- or pathname buffer length */
+#define BLEN 200
+
+/* a few physical constants */
+extern const FPTYPE kboltz;           /* boltzman constant in kcal/mol/K */
+extern const FPTYPE mvsq2e;           /* m*v^2 in kcal/mol */
+
+/* structure to hold the complete information 
+ * about the MD system */
+struct _mdsys {
+    int natoms,nfi,nsteps;
+    FPTYPE dt, mass, epsilon, sigma, box, rcut;
+    FPTYPE ekin, epot, temp;
+    FPTYPE *rx, *ry, *rz;
+    FPTYPE *vx, *vy, *vz;
+    FPTYPE *fx, *fy, *fz;
+};
+typedef struct _mdsys mdsys_t;
+
+/* structure to hold the complete information 
+ * about the MD system on a OpenCL device*/
+struct _cl_mdsys {
+    int natoms,nfi,nsteps;
+    FPTYPE dt, mass, epsilon, sigma, box, rcut;
+    FPTYPE ekin, epot, temp;
+    cl_mem rx, ry, rz;
+    cl_mem vx, vy, vz;
+    cl_mem fx, fy, fz;
+    int zerocopy;
+    cl_mem perm;
+    /* packed layout: r4, v4 and f4 take the place of the arrays above */
+    int layout;
+    cl_mem r4, v4, f4;
+};
+typedef struct _cl_mdsys cl_mdsys_t;
+
+/* force kernel variants, selected with the "force" option */
+#define FORCE_BRUTE 0
+#define FORCE_CELL  1
+#define FORCE_NLIST 2
+#define FORCE_NEWTON 3
+#define FORCE_TILED 4
+extern const char * forcemode_names[];
+extern const char * force_kernels[];
+extern const char * force_kernels4[];
+extern const char * force_kernels_inner[];
+extern const char * force_kernels_table[];
+
+/* pair potential of the tabulated force kernels, selected with the
+ * "potential" option: plain, shifted to zero energy at rcut or with
+ * the force switched off towards rcut */
+#define POT_LJ      0
+#define POT_SHIFT   1
+#define POT_FSWITCH 2
+extern const char * potential_names[];
+
+/* thermostat, selected with the "thermostat" option, with the target
+ * temperature temp (default that of the start), the coupling time tau
+ * in fs and the seed of the Langevin noise */
+#define THERMO_NONE       0
+#define THERMO_BERENDSEN  1
+#define THERMO_LANGEVIN   2
+#define THERMO_NOSEHOOVER 3
+extern const char * thermostat_names[];
+#define DEFAULT_TAU 100.0
+#define DEFAULT_SEED 12345
+
+/* on-the-fly analysis: default and largest number of g(r) bins */
+#define DEFAULT_RDFBINS 200
+#define MAX_RDFBINS 4096
+
+/* minimum image form, selected with the "pbc" option */
+#define PBC_LOOP 0
+#define PBC_RINT 1
+extern const char * pbc_names[];
+
+extern const char * onoff_names[];
+
+/* host mapped buffers, selected with the "zerocopy" option: auto uses
+ * them on devices that share the host memory (cpus, integrated gpus) */
+#define ZEROCOPY_AUTO 2
+extern const char * zerocopy_names[];
+
+/* memory layout of the atoms, selected with the "layout" option:
+ * separate x, y and z arrays or one FPTYPE4 (x, y, z, 0) per atom */
+#define LAYOUT_SOA  0
+#define LAYOUT_VEC4 1
+extern const char * layout_names[];
+
+/* integration scheme, selected with the "integrate" option: separate
+ * verlet kernels or verlet_second(n) + verlet_first(n+1) in one kernel */
+#define INTEGRATE_SPLIT 0
+#define INTEGRATE_FUSED 1
+extern const char * integrate_names[];
+
+/* trajectory file format, selected with the "trajformat" option */
+#define TRAJ_XYZ  0
+#define TRAJ_BIN  1
+#define TRAJ_NONE 2
+extern const char * trajformat_names[];
+
+/* start of a binary trajectory, followed by int natoms, float box
+ * and then for each frame int nfi and float rx[], ry[], rz[] */
+extern const char trajmagic[8];
+
+/* header of a binary restart file. It is followed by the rx, ry,
+ * rz, vx, vy and vz blocks of natoms values of the given precision
+ * (sizeof float or double). step counts the MD steps of all runs. */
+struct _resthead {
+    char magic[8];
+    int natoms, precision, step, pad;
+    double box;
+};
+typedef struct _resthead resthead_t;
+extern const char restmagic[8];
+
+/* generated initial configuration: the restart "fcc [temp [seed]]" in
+ * the input puts the atoms on the sites of an fcc lattice of the least
+ * number of cells that hold natoms in the box, with Maxwell-Boltzmann
+ * velocities at temp K without net momentum (see opencl_fcc) */
+#define FCC_TEMP 80.0
+#define FCC_SEED 12345
+struct _fcc {
+    int ncell;
+    FPTYPE a, temp;
+    cl_uint seed;
+};
+typedef struct _fcc fcc_t;
+
+/* default number of frames on their way to the output files */
+#define DEFAULT_NFRAMES 4
+
+/* work-group size of the tiled kernel if none is given */
+#define DEFAULT_WGSIZE 64
+
+/* autotuner: largest local size tried, timed force calls per
+ * candidate and the file caching the results */
+#define TUNE_MAXLOCAL 256
+#define TUNE_REPS 3
+#define DEFAULT_TUNECACHE "ljmd_tune.dat"
+
+/* directory of the compiled program binaries */
+#define DEFAULT_PROGCACHE "."
+
+/* r-RESPA: default inner cutoff and width of the switching region
+ * below it (also that of potential=fswitch), as fractions of rcut */
+#define RESPA_RINNER 0.7
+#define RESPA_RSWITCH 0.15
+
+/* tabulated potential: default number of intervals, the shortest
+ * distance covered in sigma and the one its errors are reported from */
+#define DEFAULT_TABLE 1024
+#define TABLE_RMIN 0.8
+#define TABLE_RCHECK 0.85
+
+/* steps between new splits of the atoms over several devices */
+#define DEFAULT_REBALANCE 100
+
+/* largest work-group size used for the on-device sums */
+#define REDUCE_WGSIZE 256
+
+/* largest number of devices used by the multi-device mode */
+#define MAXDEV 16
+
+/* force kernels working on a (full or half) neighbor list */
+#define USES_NLIST(mode) ((mode) == FORCE_NLIST || (mode) == FORCE_NEWTON)
+
+/* force kernels binning the atoms into a cell list */
+#define USES_CELLS(mode) ((mode) == FORCE_CELL || USES_NLIST(mode))
+
+/* structure to hold the kernels, buffers and constants
+ * needed to compute the forces on a OpenCL device */
+struct _cl_force {
+    int mode, layout;
+    cl_kernel force, azzero;
+    cl_mem epot;
+    PAIRTYPE c12, c6, rcsq;
+    FPTYPE boxby2, box, boxinv;
+    /* forces are computed for the atoms ifirst..ilast-1 */
+    int ifirst, ilast;
+    /* cell list */
+    cl_kernel cell_clear, cell_bin;
+    int ncell, ncells, cellmax;
+    FPTYPE cellinv;
+    cl_mem cell_count, cell_atoms, cell_overflow;
+    /* neighbor list, rebuild[0] is the rebuild flag, rebuild[1] counts them */
+    cl_kernel nlist_check, nlist_build, nlist_done;
+    int nlistmax, half;
+    FPTYPE halfskinsq, rlsq;
+    cl_mem rebuild, nlist_count, nlist, nlist_overflow;
+    cl_mem rx0, ry0, rz0;
+    /* host copies of cell_overflow and nlist_overflow */
+    int overflow[2];
+    /* tabulated potential, see lj_table */
+    cl_mem table;
+    int ntable;
+    PAIRTYPE tmin, tinv;
+};
+typedef struct _cl_force cl_force_t;
+
+/* on-device sum of per-thread partial results: a first pass
+ * leaves one value per work-group in partial, a second pass
+ * with a single work-group adds those up */
+struct _cl_reduce {
+    cl_kernel kernel;
+    size_t wgsize, ngroups;
+    cl_mem partial;
+};
+typedef struct _cl_reduce cl_reduce_t;
+
+/* thermostat kernels (see opencl_berendsen): update sets the scale
+ * factor in state from the sum of v^2, scale applies it. The Langevin
+ * thermostat is the scale kernel alone, with the step as argument 7. */
+struct _cl_thermo {
+    int kind;
+    cl_kernel update, scale;
+    cl_mem state;
+};
+typedef struct _cl_thermo cl_thermo_t;
+
+/* optional run time settings. They can be appended to the input
+ * file as "keyword value" lines or passed as keyword=value
+ * arguments on the command line, which take precedence. */
+struct _mdopts {
+    int forcemode;
+    int cellmax;
+    int nlistmax;
+    FPTYPE skin;
+    int wgsize;
+    int pbc;
+    int integrate;
+    int trajformat;
+    int nframes;
+    char restout[BLEN];
+    int restfreq;
+    char profile[BLEN];
+    int tune;
+    char tunecache[BLEN];
+    int ndevices;
+    int rebalance;
+    int jit;
+    char progcache[BLEN];
+    int batch;
+    int zerocopy;
+    int replicas;
+    char ensemble[BLEN];
+    int reorder;
+    int layout;
+    int respa;
+    FPTYPE rinner, rswitch;
+    int table;
+    int potential;
+    int thermostat;
+    FPTYPE temp, tau;
+    unsigned int seed;
+    int rdf, rdfbins, msd;
+    FPTYPE rdfmax;
+};
+typedef struct _mdopts mdopts_t;
+
+/* defaults of the settings */
+extern const mdopts_t default_opts;
+
+/* input files and settings */
+int read_input(FILE *in, mdsys_t *sys, char *restfile, char *trajfile, char *ergfile, int *nprint);
+int find_name(const char **names, const char *val);
+int get_count(const char *val, int *n);
+int get_real(const char *val, FPTYPE *x);
+int set_option(mdopts_t *opts, const char *key, const char *val);
+int read_options(FILE *fp, mdopts_t *opts);
+
+/* program build flags, setup and launch of the force kernels */
+const char *progcache_dir(mdopts_t *opts);
+void kernel_build_flags(char *flags, int len, mdsys_t *sys, mdopts_t *opts, int wgsize);
+int force_nargs(int mode);
+void table_pair(int potential, double r, double rc, double ron, double c12, double c6, double *e, double *ffac);
+void build_table(mdsys_t *sys, mdopts_t *opts, PAIRTYPE *tab, double *tmin, double *tinv);
+cl_int init_force(cl_context context, cl_command_queue queue, cl_program program, cl_force_t *f,
+                  mdsys_t *sys, mdopts_t *opts, cl_mem epot);
+cl_int read_overflow(cl_command_queue queue, cl_force_t *f, cl_bool blocking);
+int report_overflow(cl_force_t *f);
+cl_int bind_force(cl_mdsys_t *sys, cl_force_t *f, size_t *localWorkSize);
+cl_int bind_range(cl_force_t *f);
+cl_int compute_force(cl_command_queue queue, cl_force_t *f, size_t *globalWorkSize, size_t *localWorkSize,
+                     cl_event *event);
+
+/* atom buffers: zero-copy flags, mapping and the vec4 layout */
+#ifndef _USE_MPI
+int host_unified(cl_device_id device);
+#endif
+cl_mem_flags atom_mem_flags(int zerocopy);
+cl_int map_system(cl_command_queue queue, cl_mdsys_t *sys, cl_map_flags flags, FPTYPE **ptr);
+cl_int unmap_system(cl_command_queue queue, cl_mdsys_t *sys, FPTYPE **ptr);
+void unpack4(const FPTYPE *q, FPTYPE *x, FPTYPE *y, FPTYPE *z, int n);
+
+/* on-device sums and thermostats */
+cl_int init_reduce(cl_context context, cl_device_id device, cl_program program, cl_reduce_t *r, int n);
+cl_int reduce_sum(cl_command_queue queue, cl_reduce_t *r, cl_mem in, int n, cl_mem out, int offset, cl_event *event);
+cl_int init_thermo(cl_context context, cl_program program, cl_thermo_t *t, cl_mdsys_t *sys, mdsys_t *md, mdopts_t *opts);
+cl_int thermostat(cl_command_queue queue, cl_thermo_t *t, cl_kernel ekin, cl_reduce_t *r, cl_mem ekin_buffer,
+                  int nthreads, int step, size_t *globalWorkSize, size_t *localWorkSize);
+
+/* energy and trajectory output */
+void write_traj_header(mdsys_t *sys, FILE *traj);
+void write_energy(FILE *fp, mdsys_t *sys);
+void output_energy(mdsys_t *sys, FILE *erg);
+void output_traj(mdsys_t *sys, FILE *traj, int trajformat);
+void output(mdsys_t *sys, FILE *erg, FILE *traj, int trajformat);
+
+/* generated fcc lattices and restart files */
+int parse_fcc(const char *spec, int natoms, FPTYPE box, fcc_t *g);
+FPTYPE fcc_width(const fcc_t *g, const cl_mdsys_t *sys);
+void fcc_correction(const fcc_t *g, const cl_mdsys_t *sys, const double *sum, FPTYPE *c, FPTYPE *scale);
+void fcc_velocities(const fcc_t *g, const cl_mdsys_t *sys, FPTYPE **buffers);
+int read_restart(const char *file, cl_command_queue queue, cl_mdsys_t *sys, FPTYPE **buffers, int *step);
+int write_restart(const char *file, cl_command_queue queue, cl_mdsys_t *sys, FPTYPE **buffers, int step);
+
+#endif
@@ -4,6 +4,7 @@
 
 #include <string.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 
 #define Warning(...)    fprintf(stderr, __VA_ARGS__)
@@ -287,6 +288,37 @@ cl_int InitOpenCLEnvironment( char * device_type, cl_device_id * device, cl_cont
 }
 
 
+/* list the devices of the given type (cpu | gpu) on all platforms,
+ * in the order of the platforms. At most maxdev are returned. */
+cl_int FindDevices( char * device_type, cl_device_id * devices, cl_uint maxdev, cl_uint * ndev ) {
+
+  cl_int status;
+  cl_uint numPlatforms, numDevices, i;
+  cl_device_type device_kind;
+  cl_platform_id * platforms_list;
+
+  device_kind = strcmp( device_type, "gpu" ) ? CL_DEVICE_TYPE_CPU : CL_DEVICE_TYPE_GPU;
+
+  if ( ( status = clGetPlatformIDs( 0, NULL, &numPlatforms ) ) != CL_SUCCESS ) return status;
+  platforms_list = (cl_platform_id *) malloc( sizeof(cl_platform_id) * numPlatforms );
+  if ( ( status = clGetPlatformIDs( numPlatforms, platforms_list, NULL ) ) != CL_SUCCESS ) {
+    free( platforms_list );
+    return status;
+  }
+
+  (* ndev) = 0;
+  for ( i = 0; i < numPlatforms && (* ndev) < maxdev; ++i ) {
+    if ( !PlatformHasDeviceType( platforms_list[i], device_kind ) ) continue;
+    if ( clGetDeviceIDs( platforms_list[i], device_kind, maxdev - (* ndev), devices + (* ndev), &numDevices ) != CL_SUCCESS )
+      continue;
+    (* ndev) += ( numDevices < maxdev - (* ndev) ) ? numDevices : maxdev - (* ndev);
+  }
+
+  free( platforms_list );
+  return (* ndev) ? CL_SUCCESS : CL_DEVICE_NOT_FOUND;
+}
+
+
 char * source2string( char * filename ){
 
   char line_buffer[STRINGSIZE];
@@ -377,3 +409,323 @@ double second()
     sec = tmp.tv_sec + ((double)tmp.tv_usec)/1000000.0;
     return sec;
 }
+
+
+/* This section contains the kernel and transfer profiling.
+ * Once ProfileEnable( 1 ) has been called the clProf* wrappers attach
+ * an event to each command (the queues need CL_QUEUE_PROFILING_ENABLE)
+ * and keep it until its device time is collected, which happens when
+ * PROF_MAXPENDING events are pending and at ProfileReport. */
+
+#define PROF_MAXENTRIES 64
+#define PROF_MAXPENDING 256
+#define PROF_NAMELEN 64
+
+typedef struct {
+    char name[PROF_NAMELEN];
+    int transfer;
+    long count;
+    double total, max;     /* device time in seconds */
+    double bytes;
+} ProfEntry;
+
+typedef struct {
+    cl_command_queue queue;
+    cl_event event;
+    int entry;
+} ProfPending;
+
+static int prof_on = 0;
+static int prof_nentries = 0, prof_npending = 0;
+static ProfEntry prof_entries[PROF_MAXENTRIES];
+static ProfPending prof_pending[PROF_MAXPENDING];
+
+void ProfileEnable( int on ) {
+    prof_on = on;
+}
+
+int ProfileEnabled() {
+    return prof_on;
+}
+
+/* wait for the pending events and add up their device times */
+static void ProfCollect() {
+    cl_ulong start, end;
+    ProfEntry * e;
+    int i;
+
+    for( i = 0; i < prof_npending; i++ ) clFlush( prof_pending[i].queue );
+    for( i = 0; i < prof_npending; i++ ) {
+        e = &prof_entries[prof_pending[i].entry];
+        if( clWaitForEvents( 1, &prof_pending[i].event ) == CL_SUCCESS
+            && clGetEventProfilingInfo( prof_pending[i].event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL ) == CL_SUCCESS
+            && clGetEventProfilingInfo( prof_pending[i].event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL ) == CL_SUCCESS ) {
+            double t = ( end - start ) * 1.0e-9;
+            e->total += t;
+            if( t > e->max ) e->max = t;
+        }
+        clReleaseEvent( prof_pending[i].event );
+    }
+    prof_npending = 0;
+}
+
+/* remember the event of a command, optionally handing it also to the caller */
+static void ProfAdd( cl_command_queue queue, const char * name, int transfer, size_t bytes, cl_event ev, cl_event * event ) {
+    int i;
+
+    for( i = 0; i < prof_nentries; i++ )
+        if( !strcmp( prof_entries[i].name, name ) ) break;
+    if( i == prof_nentries ) {
+        if( prof_nentries == PROF_MAXENTRIES ) {
+            if( event ) (* event) = ev;
+            else clReleaseEvent( ev );
+            return;
+        }
+        memset( &prof_entries[i], 0, sizeof(ProfEntry) );
+        strncpy( prof_entries[i].name, name, PROF_NAMELEN - 1 );
+        prof_entries[i].transfer = transfer;
+        prof_nentries++;
+    }
+    prof_entries[i].count++;
+    prof_entries[i].bytes += bytes;
+
+    if( event ) {
+        clRetainEvent( ev );
+        (* event) = ev;
+    }
+    if( prof_npending == PROF_MAXPENDING ) ProfCollect();
+    prof_pending[prof_npending].queue = queue;
+    prof_pending[prof_npending].event = ev;
+    prof_pending[prof_npending].entry = i;
+    prof_npending++;
+}
+
+cl_int clProfEnqueueNDRangeKernel( cl_command_queue queue, cl_kernel kernel, cl_uint work_dim, const size_t * offset,
+                                   const size_t * global, const size_t * local,
+                                   cl_uint nwait, const cl_event * wait, cl_event * event ) {
+    char name[PROF_NAMELEN];
+    cl_event ev;
+    cl_int status;
+
+    if( !prof_on ) return clEnqueueNDRangeKernel( queue, kernel, work_dim, offset, global, local, nwait, wait, event );
+
+    status = clEnqueueNDRangeKernel( queue, kernel, work_dim, offset, global, local, nwait, wait, &ev );
+    if( status != CL_SUCCESS ) return status;
+    if( clGetKernelInfo( kernel, CL_KERNEL_FUNCTION_NAME, sizeof(name), name, NULL ) != CL_SUCCESS )
+        strcpy( name, "unknown kernel" );
+    ProfAdd( queue, name, 0, 0, ev, event );
+    return status;
+}
+
+cl_int clProfEnqueueReadBuffer( cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset, size_t size,
+                                void * ptr, cl_uint nwait, const cl_event * wait, cl_event * event ) {
+    cl_event ev;
+    cl_int status;
+
+    if( !prof_on ) return clEnqueueReadBuffer( queue, buffer, blocking, offset, size, ptr, nwait, wait, event );
+
+    status = clEnqueueReadBuffer( queue, buffer, blocking, offset, size, ptr, nwait, wait, &ev );
+    if( status == CL_SUCCESS ) ProfAdd( queue, "read (device to host)", 1, size, ev, event );
+    return status;
+}
+
+cl_int clProfEnqueueWriteBuffer( cl_command_queue queue, cl_mem buffer, cl_bool blocking, size_t offset, size_t size,
+                                 const void * ptr, cl_uint nwait, const cl_event * wait, cl_event * event ) {
+    cl_event ev;
+    cl_int status;
+
+    if( !prof_on ) return clEnqueueWriteBuffer( queue, buffer, blocking, offset, size, ptr, nwait, wait, event );
+
+    status = clEnqueueWriteBuffer( queue, buffer, blocking, offset, size, ptr, nwait, wait, &ev );
+    if( status == CL_SUCCESS ) ProfAdd( queue, "write (host to device)", 1, size, ev, event );
+    return status;
+}
+
+cl_int clProfEnqueueCopyBuffer( cl_command_queue queue, cl_mem src, cl_mem dst, size_t src_offset, size_t dst_offset,
+                                size_t size, cl_uint nwait, const cl_event * wait, cl_event * event ) {
+    cl_event ev;
+    cl_int status;
+
+    if( !prof_on ) return clEnqueueCopyBuffer( queue, src, dst, src_offset, dst_offset, size, nwait, wait, event );
+
+    status = clEnqueueCopyBuffer( queue, src, dst, src_offset, dst_offset, size, nwait, wait, &ev );
+    if( status == CL_SUCCESS ) ProfAdd( queue, "copy (device to device)", 1, size, ev, event );
+    return status;
+}
+
+void * clProfEnqueueMapBuffer( cl_command_queue queue, cl_mem buffer, cl_bool blocking, cl_map_flags flags, size_t offset,
+                               size_t size, cl_uint nwait, const cl_event * wait, cl_event * event, cl_int * status ) {
+    cl_event ev;
+    void * ptr;
+
+    if( !prof_on ) return clEnqueueMapBuffer( queue, buffer, blocking, flags, offset, size, nwait, wait, event, status );
+
+    ptr = clEnqueueMapBuffer( queue, buffer, blocking, flags, offset, size, nwait, wait, &ev, status );
+    if( *status == CL_SUCCESS ) ProfAdd( queue, "map (zero-copy)", 1, size, ev, event );
+    return ptr;
+}
+
+/* print the collected times as a table */
+void ProfileReport( FILE * fp ) {
+    ProfEntry * e;
+    int i;
+
+    ProfCollect();
+    fprintf( fp, "\n%-28s %8s %12s %12s %12s %12s %10s\n",
+             "kernel / transfer", "count", "total (ms)", "mean (us)", "max (us)", "MBytes", "GB/s" );
+    for( i = 0; i < prof_nentries; i++ ) {
+        e = &prof_entries[i];
+        fprintf( fp, "%-28s %8ld %12.3f %12.3f %12.3f", e->name, e->count,
+                 1.0e3 * e->total, 1.0e6 * e->total / e->count, 1.0e6 * e->max );
+        if( e->transfer )
+            fprintf( fp, " %12.3f %10.3f\n", 1.0e-6 * e->bytes, e->total > 0.0 ? 1.0e-9 * e->bytes / e->total : 0.0 );
+        else
+            fprintf( fp, " %12s %10s\n", "-", "-" );
+    }
+}
+
+/* write the collected times as JSON */
+void ProfileReportJSON( FILE * fp ) {
+    ProfEntry * e;
+    int i, kind, first;
+
+    ProfCollect();
+    fprintf( fp, "{\n" );
+    for( kind = 0; kind < 2; kind++ ) {
+        fprintf( fp, "  \"%s\": [", kind ? "transfers" : "kernels" );
+        first = 1;
+        for( i = 0; i < prof_nentries; i++ ) {
+            e = &prof_entries[i];
+            if( e->transfer != kind ) continue;
+            fprintf( fp, "%s\n    { \"name\": \"%s\", \"count\": %ld, \"total_ms\": %.6f, \"mean_us\": %.6f, \"max_us\": %.6f",
+                     first ? "" : ",", e->name, e->count, 1.0e3 * e->total, 1.0e6 * e->total / e->count, 1.0e6 * e->max );
+            if( kind ) fprintf( fp, ", \"bytes\": %.0f", e->bytes );
+            fprintf( fp, " }" );
+            first = 0;
+        }
+        fprintf( fp, "\n  ]%s\n", kind ? "" : "," );
+    }
+    fprintf( fp, "}\n" );
+}
+
+
+/* This section contains the program binary cache. A program built for
+ * a device is stored as cachedir/ljmd_<hash>.clbin, where the 64 bit
+ * FNV-1a hash covers the device name, driver version, build flags and
+ * source. The file starts with the magic "LJMDBIN1", the hash and the
+ * size of the binary, which follows. */
+
+static const char cache_magic[8] = "LJMDBIN1";
+
+static unsigned long long CacheHash( unsigned long long h, const char * s, size_t n ) {
+    size_t i;
+
+    for( i = 0; i < n; i++ ) {
+        h ^= (unsigned char) s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+/* load the cached binary, returns NULL if there is none */
+static cl_program CacheLoad( cl_context context, cl_device_id device, const char * path, unsigned long long hash ) {
+    char magic[8];
+    unsigned long long h, size;
+    unsigned char * binary;
+    const unsigned char * bin;
+    size_t len;
+    cl_int status, binstatus;
+    cl_program program = NULL;
+    FILE * fp = fopen( path, "rb" );
+
+    if( !fp ) return NULL;
+    if( fread( magic, 1, 8, fp ) != 8 || memcmp( magic, cache_magic, 8 )
+        || fread( &h, sizeof(h), 1, fp ) != 1 || h != hash
+        || fread( &size, sizeof(size), 1, fp ) != 1 || size == 0 ) {
+        fclose( fp );
+        return NULL;
+    }
+    binary = (unsigned char *) malloc( size );
+    if( binary && fread( binary, 1, size, fp ) == size ) {
+        len = size;
+        bin = binary;
+        program = clCreateProgramWithBinary( context, 1, &device, &len, &bin, &binstatus, &status );
+        if( status != CL_SUCCESS || binstatus != CL_SUCCESS ) {
+            if( program ) clReleaseProgram( program );
+            program = NULL;
+        }
+    }
+    free( binary );
+    fclose( fp );
+    return program;
+}
+
+/* store the binary of a built program, through a temporary file so
+ * that concurrent runs never see a partial one */
+static void CacheStore( cl_program program, const char * path, unsigned long long hash ) {
+    size_t tmplen = strlen( path ) + 24;
+    char * tmp;
+    unsigned long long size;
+    unsigned char * binary;
+    size_t len;
+    FILE * fp;
+
+    if( clGetProgramInfo( program, CL_PROGRAM_BINARY_SIZES, sizeof(len), &len, NULL ) != CL_SUCCESS || len == 0 ) return;
+    binary = (unsigned char *) malloc( len );
+    tmp = (char *) malloc( tmplen );
+    if( binary && tmp && clGetProgramInfo( program, CL_PROGRAM_BINARIES, sizeof(binary), &binary, NULL ) == CL_SUCCESS
+        && snprintf( tmp, tmplen, "%s.%ld", path, (long) getpid() ) < (int) tmplen ) {
+        size = len;
+        fp = fopen( tmp, "wb" );
+        if( fp ) {
+            int ok = fwrite( cache_magic, 1, 8, fp ) == 8 && fwrite( &hash, sizeof(hash), 1, fp ) == 1
+                && fwrite( &size, sizeof(size), 1, fp ) == 1 && fwrite( binary, 1, len, fp ) == len;
+
+            /* close in any case, keep the file only if all of it was written */
+            if( fclose( fp ) == 0 && ok )
+                rename( tmp, path );
+            else
+                remove( tmp );
+        }
+    }
+    free( tmp );
+    free( binary );
+}
+
+/* build the program for one device, from the cached binary if there
+ * is one that the device accepts, otherwise from the source, and then
+ * cache its binary. cachedir NULL builds from the source only. */
+cl_program BuildProgramCached( cl_context context, cl_device_id device, const char * source, const char * flags,
+                               const char * cachedir, cl_int * status ) {
+    char name[STRINGSIZE], driver[STRINGSIZE], path[STRINGSIZE];
+    unsigned long long hash = 14695981039346656037ULL;
+    cl_program program;
+
+    if( cachedir ) {
+        if( clGetDeviceInfo( device, CL_DEVICE_NAME, sizeof(name), name, NULL ) != CL_SUCCESS ) strcpy( name, "unknown" );
+        if( clGetDeviceInfo( device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL ) != CL_SUCCESS ) strcpy( driver, "unknown" );
+        hash = CacheHash( hash, name, strlen( name ) + 1 );
+        hash = CacheHash( hash, driver, strlen( driver ) + 1 );
+        hash = CacheHash( hash, flags, strlen( flags ) + 1 );
+        hash = CacheHash( hash, source, strlen( source ) );
+        /* a truncated path could name another binary, skip the cache */
+        if( snprintf( path, sizeof(path), "%s/ljmd_%016llx.clbin", cachedir, hash ) >= (int) sizeof(path) ) {
+            Warning( "Program cache directory %s is too long, building from source.\n", cachedir );
+            cachedir = NULL;
+        }
+    }
+    if( cachedir ) {
+        program = CacheLoad( context, device, path, hash );
+        if( program ) {
+            if( ( *status = clBuildProgram( program, 1, &device, flags, NULL, NULL ) ) == CL_SUCCESS ) return program;
+            Warning( "Cached program %s was rejected (%s), building from source.\n", path, CLErrString( *status ) );
+            clReleaseProgram( program );
+        }
+    }
+
+    program = clCreateProgramWithSource( context, 1, &source, NULL, status );
+    if( *status != CL_SUCCESS ) return program;
+    *status = clBuildProgram( program, 1, &device, flags, NULL, NULL );
+    if( *status == CL_SUCCESS && cachedir ) CacheStore( program, path, hash );
+    return program;
+}
@@ -4,6 +4,7 @@
  *
  * OpenCL parallel baseline version.
  * optimization 1: apply serial improvements except newtons 3rd law
+ * (newtons 3rd law is used by the half neighbor list kernel, force=newton)
  */
 
 #include <stdio.h>
@@ -11,108 +12,2037 @@
 #include <ctype.h>
 #include <stdlib.h>
 #include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#ifdef _USE_MPI
+#include <mpi.h>
+#endif
 
-#include "OpenCL_utils.h"
+#include "ljmd_core.h"
+
+/* on-the-fly analysis (see opencl_rdf) every rdffreq and msdfreq steps:
+ * the g(r) counts of a sample in hist and their sums over the nrdf
+ * samples in acc, the positions of the last MSD sample in p, the
+ * displacements since the start in d and the MSD of sample k in msdval[k] */
+struct _cl_analysis {
+    int rdffreq, msdfreq;
+    cl_kernel rdf, rdf_add, msd;
+    int nbins, nrdf, nmsd;
+    FPTYPE rmax;
+    cl_mem hist, acc, p[3], d[3], sums, msdval;
+};
+typedef struct _cl_analysis cl_analysis_t;
+
+/* reordering of the atoms along a Morton curve of their cells (see
+ * opencl_reorder_key): the sorted indices are kept in idx, the arrays
+ * are gathered through tmp and itmp. The perm buffer of the system
+ * then holds the original index of each atom, which the output and
+ * the restarts restore. n2 is the sort length, a power of two. */
+struct _cl_reorder {
+    cl_kernel key, sort, gather, gather_int, scatter;
+    cl_mem keys, idx, tmp, itmp;
+    int n2, ncell;
+    FPTYPE cellinv;
+};
+typedef struct _cl_reorder cl_reorder_t;
+
+/* multi-device mode: the atoms are split in contiguous ranges, one per
+ * device. The first device holds the complete system and integrates
+ * it as in the single device mode, the others keep a copy of all
+ * positions in their own context and compute the forces of their
+ * range only. After every update the positions are sent to them and
+ * their forces (and at output steps their potential energy) are
+ * collected on the first device. btime is the force kernel time since
+ * the last split, weight the atoms per second the split was made for. */
+struct _cl_part {
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    cl_mdsys_t sys;
+    cl_force_t force;
+    cl_reduce_t reduce;
+    cl_mem energy;
+    cl_event event;
+    double ftime, btime, weight;
+};
+typedef struct _cl_part cl_part_t;
+
+/* all devices with the host copies of positions and forces used for
+ * the exchange. The epot buffer of the first device has one slot more
+ * than work-items, at index nthreads, for the energy of the others. */
+struct _cl_multi {
+    int npart, nthreads, ncalls, nsplits;
+    cl_part_t part[MAXDEV];
+    FPTYPE *rx, *ry, *rz, *fx, *fy, *fz;
+};
+typedef struct _cl_multi cl_multi_t;
 
+#ifdef _USE_MPI
 #ifdef _USE_FLOAT
-#define FPTYPE float
-#define ZERO  0.0f
-#define HALF  0.5f
-#define TWO   2.0f
-#define THREE 3.0f
-static const char kernelflags[] = "-D_USE_FLOAT -cl-denorms-are-zero -cl-unsafe-math-optimizations";
+#define MPI_FPTYPE MPI_FLOAT
+#else
+#define MPI_FPTYPE MPI_DOUBLE
+#endif
+
+/* MPI build: the ranks form a periodic 3d grid of blocks of the box
+ * and each owns the atoms whose positions, wrapped into the box, lie
+ * in its block. Atoms within rghost of a face are sent as ghosts to
+ * the neighbor behind it, one dimension after the other. The device
+ * of a rank holds the nlocal own atoms followed by the nghost ghosts
+ * and computes the forces of the own atoms only. Positions are not
+ * shifted, the minimum image is left to the kernels, so each atom
+ * must be a ghost at most once on a rank. After every verlet_first
+ * the own atoms are downloaded, those that left the block migrate and
+ * the ghosts are rebuilt. */
+struct _mpi_dom {
+    MPI_Comm comm;
+    int rank, nranks, dims[3], coords[3], lo_rank[3], hi_rank[3];
+    FPTYPE lo[3], hi[3], box, rghost;
+    int nlocal, nghost, cap;
+    int *id, *order;
+    FPTYPE *r[3], *v[3];
+    char *sbuf[2], *rbuf;
+    size_t sbufcap[2], rbufcap;
+    /* device side, with capacity cap */
+    cl_context context;
+    cl_command_queue queue;
+    cl_mdsys_t sys;
+    cl_force_t *force;
+    cl_reduce_t *reduce;
+    cl_kernel kernel_ekin;
+    cl_mem ekin, energy;
+    size_t *global, *local;
+    int nthreads;
+};
+typedef struct _mpi_dom mpi_dom_t;
+
+/* an atom moving to another rank */
+struct _mpi_atom {
+    FPTYPE r[3], v[3];
+    int id;
+};
+typedef struct _mpi_atom mpi_atom_t;
+
+/* length of an atom line of the xyz trajectory, the fixed size lets
+ * every rank write its lines at the place given by the atom index */
+#define XYZ_LINE 67
+#endif
+
+/* a frame on its way to the output files: the positions are copied
+ * to the snapshot buffers on the compute queue, then downloaded
+ * without blocking on the transfer queue once ready has completed,
+ * and finally written by the writer thread. With zerocopy the
+ * snapshot buffers are mapped instead and rx, ry, rz point into them
+ * until the frame is unmapped for reuse. */
+struct _cl_frame {
+    int nfi, pending;
+    FPTYPE *rx, *ry, *rz;
+    FPTYPE energy[2];
+    cl_mem snap_rx, snap_ry, snap_rz;
+    cl_event ready, done;
+    int zerocopy;
+};
+typedef struct _cl_frame cl_frame_t;
+
+/* the writer thread takes the frames of a ring in order and writes
+ * them out, the main loop waits only when the ring is full. A frame
+ * is held back until the cell and list capacities have been checked
+ * up to its step (checked), so that no frame computed with an
+ * overflowing list reaches the files. */
+struct _writer {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    cl_frame_t *frames;
+    int nframes, next, stop, checked;
+    mdsys_t sys;
+    FILE *erg, *traj;
+    int trajformat;
+};
+typedef struct _writer writer_t;
+
+/* ensemble mode: the replicas are packed into one set of buffers and
+ * integrated together, replica r owns the atoms first .. first+natoms-1
+ * and writes its own output files. Copy k > 0 of the input system
+ * draws new velocities from seed. par holds the constants of each
+ * replica in the ENS_* layout of opencl_kernels.cl. */
+#define ENS_NPAR 8
+struct _ens_rep {
+    mdsys_t sys;
+    char restfile[BLEN], trajfile[BLEN], ergfile[BLEN];
+    FILE *erg, *traj;
+    int first, copy;
+    cl_uint seed;
+};
+typedef struct _ens_rep ens_rep_t;
+
+struct _ens {
+    int nrep, ntotal;
+    ens_rep_t *reps;
+    cl_mdsys_t all;
+    cl_kernel force, verlet_first, verlet_second, ekin, reduce;
+    cl_mem rep, first, count, par, epot, ekin_buf, energy;
+    size_t global, *local, rwgsize;
+    FPTYPE *pos[3], *energies;
+};
+typedef struct _ens ens_t;
+
+void PrintUsageAndExit() {
+    fprintf( stderr, "\nError. Run the program as follow: ");
+    fprintf( stderr, "\n./ljmd-cl.x device [thread-number] [keyword=value ...] < input ");
+    fprintf( stderr, "\ndevice = cpu | gpu | hybrid (gpu and cpu together)" );
+    fprintf( stderr, "\nkeywords: force = brute | cell | nlist | newton | tiled, cellmax = atoms per cell," );
+    fprintf( stderr, "\n          skin = neighbor list skin, nlistmax = neighbors per atom," );
+    fprintf( stderr, "\n          wgsize = local work-group size, pbc = loop | rint," );
+    fprintf( stderr, "\n          integrate = split | fused, trajformat = xyz | bin | none," );
+    fprintf( stderr, "\n          nframes = frames buffered for output, restout = binary restart file," );
+    fprintf( stderr, "\n          restfreq = steps between restarts, profile = JSON file of kernel times," );
+    fprintf( stderr, "\n          tune = on | off, tunecache = file of tuned work sizes," );
+    fprintf( stderr, "\n          devices = number of devices to use (0 = all)," );
+    fprintf( stderr, "\n          rebalance = steps between new splits over the devices (0 = never)," );
+    fprintf( stderr, "\n          jit = on | off (system constants built into the kernels)," );
+    fprintf( stderr, "\n          progcache = directory of compiled kernels | off," );
+    fprintf( stderr, "\n          batch = steps queued between host checks (0 = nprint)," );
+    fprintf( stderr, "\n          zerocopy = off | on | auto (host mapped buffers)," );
+    fprintf( stderr, "\n          replicas = copies of the system run together (no thermostat)," );
+    fprintf( stderr, "\n          ensemble = file listing the inputs of further replicas," );
+    fprintf( stderr, "\n          reorder = steps between Morton reorderings of the atoms (0 = never)," );
+    fprintf( stderr, "\n          layout = soa | vec4 (separate or packed coordinates)," );
+    fprintf( stderr, "\n          respa = inner steps per step (1 = plain verlet)," );
+    fprintf( stderr, "\n          rinner = inner cutoff, rswitch = width of its switching region," );
+    fprintf( stderr, "\n          table = intervals of the tabulated potential (0 = analytic)," );
+    fprintf( stderr, "\n          potential = lj | shift | fswitch (tabulated pair potential)," );
+    fprintf( stderr, "\n          thermostat = none | berendsen | langevin | nosehoover," );
+    fprintf( stderr, "\n          temp = its temperature (default the initial one), tau = its time in fs," );
+    fprintf( stderr, "\n          seed = seed of the langevin noise," );
+    fprintf( stderr, "\n          rdf, msd = steps between g(r) and MSD samples (0 = none)," );
+    fprintf( stderr, "\n          rdfbins = g(r) bins, rdfmax = largest g(r) distance (default rcut)\n\n" );
+    exit(1);
+}
+
+/* print the largest errors of the interpolated energy and force at the
+ * middle and the quarters of the intervals from TABLE_RCHECK sigma on */
+static void table_report(mdsys_t *sys, mdopts_t *opts)
+{
+    double c12 = 4.0 * sys->epsilon * pow(sys->sigma, 12.0);
+    double c6 = 4.0 * sys->epsilon * pow(sys->sigma, 6.0);
+    double rc = sys->rcut, ron = rc - opts->rswitch, tmin, tinv, de = 0.0, df = 0.0;
+    PAIRTYPE *tab = (PAIRTYPE *) malloc( 4 * opts->table * sizeof(PAIRTYPE) );
+    int k, q;
+
+    build_table( sys, opts, tab, &tmin, &tinv );
+    for (k = 0; k < opts->table; k++)
+        for (q = 1; q < 4; q++) {
+            double x = 0.25 * q, rsq = tmin + (k + x) / tinv, r = sqrt(rsq), e, ffac;
+
+            if (r < TABLE_RCHECK * sys->sigma) continue;
+            table_pair(opts->potential, r, rc, ron, c12, c6, &e, &ffac);
+            e = fabs(tab[4*k] + x * tab[4*k+1] - e);
+            ffac = fabs(tab[4*k+2] + x * tab[4*k+3] - ffac) * r;
+            if (e > de) de = e;
+            if (ffac > df) df = ffac;
+        }
+    free( tab );
+    printf( "\nTabulated %s potential with %d intervals, largest errors from %g sigma on:\n"
+            "energy %.3g kcal/mol, force %.3g kcal/mol/A.\n",
+            potential_names[opts->potential], opts->table, TABLE_RCHECK, de, df );
+}
+
+/* stop if the last read_overflow found a cell or list too small */
+static void check_overflow(cl_force_t *f)
+{
+    if (report_overflow(f)) exit(1);
+}
+
+/* abort if a cell or neighbor list received more atoms than it can hold */
+static void check_cells(cl_command_queue queue, cl_force_t *f)
+{
+    CheckSuccess( read_overflow( queue, f, CL_TRUE ), 7 );
+    check_overflow( f );
+}
+
+/* mark the end of a batch of steps in the queue */
+static cl_int enqueue_marker(cl_command_queue queue, cl_event *event)
+{
+#ifdef CL_VERSION_1_2
+    return clEnqueueMarkerWithWaitList( queue, 0, NULL, event );
 #else
-#define FPTYPE double
-#define ZERO  0.0
-#define HALF  0.5
-#define TWO   2.0
-#define THREE 3.0
-static const char kernelflags[] = "-cl-unsafe-math-optimizations";
+    return clEnqueueMarker( queue, event );
 #endif
+}
 
-/* generic file- or pathname buffer length */
-#define BLEN 200
+/* set up the inner force of r-RESPA: the force kernel of the same mode
+ * at the cutoff rinner, with its own cell or neighbor list, switched off
+ * over rswitch below rinner. The switch arguments follow those set by
+ * bind_force and are set once here. */
+static cl_int init_inner(cl_context context, cl_command_queue queue, cl_program program, cl_force_t *f,
+                         mdsys_t *sys, mdopts_t *opts, cl_mem epot)
+{
+    mdsys_t inner = *sys;
+    mdopts_t o = *opts;
+    PAIRTYPE ron, swinv;
+    cl_int status;
+
+    /* the inner force is the analytic one */
+    inner.rcut = opts->rinner;
+    o.table = 0;
+    status = init_force( context, queue, program, f, &inner, &o, epot );
+    if( status != CL_SUCCESS ) return status;
+    clReleaseKernel( f->force );
+    f->force = clCreateKernel( program, force_kernels_inner[f->mode], &status );
+    if( status != CL_SUCCESS ) return status;
+
+    ron = opts->rinner - opts->rswitch;
+    swinv = 1.0 / opts->rswitch;
+    return clSetMultKernelArgs( f->force, force_nargs(f->mode), 2, KArg(ron), KArg(swinv) );
+}
 
-/* a few physical constants */
-const FPTYPE kboltz=0.0019872067;     /* boltzman constant in kcal/mol/K */
-const FPTYPE mvsq2e=2390.05736153349; /* m*v^2 in kcal/mol */
+/* first part of a r-RESPA step: half kick with the outer forces, then
+ * nsub verlet steps of dt / nsub with the inner forces. The step ends
+ * with the full force, of which the kick kernel takes the outer part
+ * as full minus inner forces, and another half kick. */
+static cl_int respa_inner(cl_command_queue queue, cl_kernel kick, cl_kernel first, cl_kernel second,
+                          cl_force_t *inner, int nsub, size_t *globalWorkSize, size_t *localWorkSize)
+{
+    cl_int status;
+    int s;
+
+    status = clProfEnqueueNDRangeKernel( queue, kick, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+    for (s = 0; s < nsub; s++) {
+        status |= clProfEnqueueNDRangeKernel( queue, first, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+        status |= compute_force( queue, inner, globalWorkSize, localWorkSize, NULL );
+        status |= clProfEnqueueNDRangeKernel( queue, second, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+    }
+    return status;
+}
+
+/* create the analysis kernels and buffers. The g(r) pairs come from
+ * the cell or neighbor list of the force kernel when there is one,
+ * which then must reach rmax, and the MSD starts at the positions of
+ * step 0. */
+static cl_int init_analysis(cl_context context, cl_command_queue queue, cl_program program, cl_analysis_t *a,
+                            cl_mdsys_t *sys, mdsys_t *md, cl_force_t *f, mdopts_t *opts, int nthreads)
+{
+    size_t size = sys->natoms * sizeof(FPTYPE);
+    cl_int status = CL_SUCCESS;
+    int i, nargs = 12;
+
+    a->rdffreq = opts->rdf;
+    a->msdfreq = opts->msd;
+    a->nrdf = a->nmsd = 0;
+    if (a->rdffreq > 0) {
+        FPTYPE rmaxsq, binv;
+        FPTYPE *zero;
+        int weight = f->half ? 2 : 1;
+
+        a->nbins = opts->rdfbins;
+        a->rmax = opts->rdfmax > 0.0 ? opts->rdfmax : md->rcut;
+        rmaxsq = a->rmax * a->rmax;
+        binv = a->nbins / a->rmax;
+        zero = (FPTYPE *) calloc( a->nbins, sizeof(FPTYPE) );
+        a->hist = clCreateBuffer( context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, a->nbins * sizeof(int), zero, &status );
+        a->acc = clCreateBuffer( context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, a->nbins * sizeof(FPTYPE), zero, &status );
+        free(zero);
+        if (USES_NLIST(f->mode)) a->rdf = clCreateKernel( program, "opencl_rdf_nlist", &status );
+        else if (f->mode == FORCE_CELL) a->rdf = clCreateKernel( program, "opencl_rdf_cell", &status );
+        else a->rdf = clCreateKernel( program, "opencl_rdf", &status );
+        a->rdf_add = clCreateKernel( program, "opencl_rdf_add", &status );
+        if (status != CL_SUCCESS) return status;
+
+        status = clSetMultKernelArgs( a->rdf, 0, 11, KArg(sys->rx), KArg(sys->ry), KArg(sys->rz), KArg(sys->natoms),
+                                      KArg(f->boxby2), KArg(f->box), KArg(f->boxinv), KArg(a->hist), KArg(a->nbins),
+                                      KArg(rmaxsq), KArg(binv) );
+        status |= clSetKernelArg( a->rdf, 11, a->nbins * sizeof(int), NULL );
+        if (USES_NLIST(f->mode))
+            status |= clSetMultKernelArgs( a->rdf, nargs, 3, KArg(f->nlist_count), KArg(f->nlist), KArg(weight) );
+        else if (f->mode == FORCE_CELL)
+            status |= clSetMultKernelArgs( a->rdf, nargs, 5, KArg(f->cell_count), KArg(f->cell_atoms), KArg(f->cellmax),
+                                           KArg(f->ncell), KArg(f->cellinv) );
+        status |= clSetMultKernelArgs( a->rdf_add, 0, 3, KArg(a->hist), KArg(a->nbins), KArg(a->acc) );
+    }
+
+    if (a->msdfreq > 0) {
+        int nval = md->nsteps / a->msdfreq + 1;
+        FPTYPE *zero = (FPTYPE *) calloc( nval > sys->natoms ? nval : sys->natoms, sizeof(FPTYPE) );
+        cl_mem *r[3] = { &sys->rx, &sys->ry, &sys->rz };
+
+        a->msd = clCreateKernel( program, "opencl_msd", &status );
+        for (i = 0; i < 3; i++) {
+            a->p[i] = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+            a->d[i] = clCreateBuffer( context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, size, zero, &status );
+        }
+        a->msdval = clCreateBuffer( context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, nval * sizeof(FPTYPE), zero, &status );
+        free(zero);
+        a->sums = clCreateBuffer( context, CL_MEM_READ_WRITE, nthreads * sizeof(FPTYPE), NULL, &status );
+        if (status != CL_SUCCESS) return status;
+
+        for (i = 0; i < 3; i++)
+            status |= clProfEnqueueCopyBuffer( queue, *r[i], a->p[i], 0, 0, size, 0, NULL, NULL );
+        status |= clSetMultKernelArgs( a->msd, 0, 14, KArg(sys->rx), KArg(sys->ry), KArg(sys->rz), KArg(a->p[0]),
+                                       KArg(a->p[1]), KArg(a->p[2]), KArg(a->d[0]), KArg(a->d[1]), KArg(a->d[2]),
+                                       KArg(sys->natoms), KArg(f->boxby2), KArg(f->box), KArg(f->boxinv), KArg(a->sums) );
+    }
+    return status;
+}
+
+/* enqueue the samples of a step after its forces, when the cell or
+ * neighbor list is that of the current positions */
+static cl_int analysis_step(cl_command_queue queue, cl_analysis_t *a, cl_reduce_t *r, int step, int nthreads,
+                            size_t *globalWorkSize, size_t *localWorkSize)
+{
+    cl_int status = CL_SUCCESS;
+
+    if (a->rdffreq > 0 && (step % a->rdffreq) == 0) {
+        status |= clProfEnqueueNDRangeKernel( queue, a->rdf, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+        status |= clProfEnqueueNDRangeKernel( queue, a->rdf_add, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+        a->nrdf++;
+    }
+    if (a->msdfreq > 0 && (step % a->msdfreq) == 0) {
+        status |= clProfEnqueueNDRangeKernel( queue, a->msd, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+        status |= reduce_sum( queue, r, a->sums, nthreads, a->msdval, ++a->nmsd, NULL );
+    }
+    return status;
+}
+
+/* write the averages of the analysis next to the energy file, which
+ * gives its name with the extension .rdf (r, g(r) and the number of
+ * neighbors within r) and .msd (time in fs and MSD in A^2) */
+static void write_analysis(cl_command_queue queue, cl_analysis_t *a, mdsys_t *sys, const char *ergfile)
+{
+    const char *dot = strrchr(ergfile, '.'), *slash = strrchr(ergfile, '/');
+    char name[BLEN];
+    FPTYPE *val;
+    FILE *fp;
+    int i, n;
+
+    if (!dot || (slash && dot < slash)) dot = ergfile + strlen(ergfile);
+    if (a->nrdf > 0) {
+        double rho = sys->natoms / ( sys->box * sys->box * sys->box ), dr = a->rmax / a->nbins, sum = 0.0;
+
+        val = (FPTYPE *) malloc( a->nbins * sizeof(FPTYPE) );
+        clProfEnqueueReadBuffer( queue, a->acc, CL_TRUE, 0, a->nbins * sizeof(FPTYPE), val, 0, NULL, NULL );
+        snprintf( name, BLEN, "%.*s.rdf", (int) (dot - ergfile), ergfile );
+        fp = fopen( name, "w" );
+        if (fp) {
+            for (i = 0; i < a->nbins; i++) {
+                double r1 = i * dr, r2 = r1 + dr;
+                double shell = 4.0 / 3.0 * M_PI * ( r2 * r2 * r2 - r1 * r1 * r1 );
+                double norm = (double) a->nrdf * sys->natoms;
+
+                sum += val[i];
+                fprintf( fp, "%12.6f %14.8f %14.8f\n", r1 + 0.5 * dr, val[i] / ( norm * rho * shell ), sum / norm );
+            }
+            fclose( fp );
+            printf( "g(r) of %d samples in %s\n", a->nrdf, name );
+        } else perror( "cannot write the g(r)" );
+        free( val );
+    }
+    if (a->nmsd > 0) {
+        n = a->nmsd + 1;
+        val = (FPTYPE *) malloc( n * sizeof(FPTYPE) );
+        clProfEnqueueReadBuffer( queue, a->msdval, CL_TRUE, 0, n * sizeof(FPTYPE), val, 0, NULL, NULL );
+        snprintf( name, BLEN, "%.*s.msd", (int) (dot - ergfile), ergfile );
+        fp = fopen( name, "w" );
+        if (fp) {
+            for (i = 0; i < n; i++)
+                fprintf( fp, "%12.4f %16.8f\n", (double) i * a->msdfreq * sys->dt, val[i] / sys->natoms );
+            fclose( fp );
+            printf( "MSD of %d samples in %s\n", a->nmsd, name );
+        } else perror( "cannot write the MSD" );
+        free( val );
+    }
+}
+
+/* set up the reordering of the atoms. The Morton keys are taken on
+ * the cell grid of the force kernel, or on cells of the cutoff size
+ * for the all-pairs kernels, with at most 1024 cells per axis. */
+static cl_int init_reorder(cl_context context, cl_command_queue queue, cl_program program, cl_reorder_t *o,
+                           cl_mdsys_t *sys, cl_force_t *f, FPTYPE rcut)
+{
+    cl_int status;
+    int i, *perm;
+
+    for (o->n2 = 1; o->n2 < sys->natoms; o->n2 *= 2);
+    if (USES_CELLS(f->mode)) o->ncell = f->ncell;
+    else o->ncell = (int) floor( sys->box / rcut );
+    if (o->ncell < 1) o->ncell = 1;
+    if (o->ncell > 1024) o->ncell = 1024;
+    o->cellinv = o->ncell / sys->box;
+
+    o->key = clCreateKernel( program, "opencl_reorder_key", &status );
+    o->sort = clCreateKernel( program, "opencl_reorder_sort", &status );
+    o->gather = clCreateKernel( program, "opencl_reorder_gather", &status );
+    o->gather_int = clCreateKernel( program, "opencl_reorder_gather_int", &status );
+    o->scatter = clCreateKernel( program, "opencl_reorder_scatter", &status );
+    o->keys = clCreateBuffer( context, CL_MEM_READ_WRITE, o->n2 * sizeof(cl_uint), NULL, &status );
+    o->idx = clCreateBuffer( context, CL_MEM_READ_WRITE, o->n2 * sizeof(int), NULL, &status );
+    o->tmp = clCreateBuffer( context, CL_MEM_READ_WRITE, sys->natoms * sizeof(FPTYPE), NULL, &status );
+    o->itmp = clCreateBuffer( context, CL_MEM_READ_WRITE, sys->natoms * sizeof(int), NULL, &status );
+    sys->perm = clCreateBuffer( context, CL_MEM_READ_WRITE, sys->natoms * sizeof(int), NULL, &status );
+    if (status != CL_SUCCESS) return status;
+
+    perm = (int *) malloc( sys->natoms * sizeof(int) );
+    for (i = 0; i < sys->natoms; i++) perm[i] = i;
+    status = clProfEnqueueWriteBuffer( queue, sys->perm, CL_TRUE, 0, sys->natoms * sizeof(int), perm, 0, NULL, NULL );
+    free(perm);
+
+    status |= clSetMultKernelArgs( o->key, 0, 10, KArg(sys->rx), KArg(sys->ry), KArg(sys->rz), KArg(sys->natoms),
+                                   KArg(sys->box), KArg(o->cellinv), KArg(o->ncell), KArg(o->keys), KArg(o->idx), KArg(o->n2) );
+    status |= clSetMultKernelArgs( o->sort, 0, 2, KArg(o->keys), KArg(o->idx) );
+    status |= clSetKernelArg( o->sort, 4, sizeof(o->n2), &o->n2 );
+    status |= clSetMultKernelArgs( o->gather, 1, 3, KArg(o->idx), KArg(sys->natoms), KArg(o->tmp) );
+    status |= clSetMultKernelArgs( o->gather_int, 0, 4, KArg(sys->perm), KArg(o->idx), KArg(sys->natoms), KArg(o->itmp) );
+    status |= clSetMultKernelArgs( o->scatter, 0, 5, KArg(sys->rx), KArg(sys->ry), KArg(sys->rz), KArg(sys->perm), KArg(sys->natoms) );
+    return status;
+}
+
+/* sort the atoms by the Morton key of their cell and gather all per
+ * atom arrays in that order. The neighbor lists of the devices refer
+ * to the old order and are rebuilt. */
+static cl_int reorder_atoms(cl_command_queue queue, cl_reorder_t *o, cl_mdsys_t *sys, cl_multi_t *m,
+                            size_t *globalWorkSize, size_t *localWorkSize)
+{
+    static const int one = 1;
+    cl_mem arrays[9] = { sys->rx, sys->ry, sys->rz, sys->vx, sys->vy, sys->vz, sys->fx, sys->fy, sys->fz };
+    size_t size = sys->natoms * sizeof(FPTYPE);
+    cl_int status;
+    int j, k, d;
+
+    status = clProfEnqueueNDRangeKernel( queue, o->key, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+    for (k = 2; k <= o->n2; k *= 2)
+        for (j = k / 2; j > 0; j /= 2) {
+            status |= clSetMultKernelArgs( o->sort, 2, 2, KArg(j), KArg(k) );
+            status |= clProfEnqueueNDRangeKernel( queue, o->sort, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+        }
+
+    for (k = 0; k < 9; k++) {
+        status |= clSetKernelArg( o->gather, 0, sizeof(cl_mem), &arrays[k] );
+        status |= clProfEnqueueNDRangeKernel( queue, o->gather, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+        status |= clProfEnqueueCopyBuffer( queue, o->tmp, arrays[k], 0, 0, size, 0, NULL, NULL );
+    }
+    status |= clProfEnqueueNDRangeKernel( queue, o->gather_int, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+    status |= clProfEnqueueCopyBuffer( queue, o->itmp, sys->perm, 0, 0, sys->natoms * sizeof(int), 0, NULL, NULL );
+
+    for (d = 0; d < m->npart; d++)
+        if (USES_NLIST(m->part[d].force.mode))
+            status |= clProfEnqueueWriteBuffer( m->part[d].queue, m->part[d].force.rebuild, CL_FALSE, 0, sizeof(int), &one, 0, NULL, NULL );
+    return status;
+}
+
+/* key of the autotuner cache: system size, force kernel and layout, precision and device */
+static void tune_key(cl_device_id device, int natoms, int forcemode, int layout, char *key, int len)
+{
+    char name[BLEN], driver[BLEN];
+
+    if (clGetDeviceInfo( device, CL_DEVICE_NAME, sizeof(name), name, NULL ) != CL_SUCCESS) strcpy(name, "unknown");
+    if (clGetDeviceInfo( device, CL_DRIVER_VERSION, sizeof(driver), driver, NULL ) != CL_SUCCESS) strcpy(driver, "unknown");
+    snprintf(key, len, "%d %s%s %s %s / %s", natoms, forcemode_names[forcemode],
+             layout == LAYOUT_VEC4 ? "/vec4" : "", PRECISION, name, driver);
+}
+
+/* look up the work sizes of a key, the cache has one
+ * "global local key" line per tuned setup */
+static int tune_lookup(const char *file, const char *key, size_t *global, size_t *local)
+{
+    char line[3*BLEN];
+    unsigned long g, l;
+    int n, found = 0;
+    FILE *fp;
+
+    fp = fopen(file, "r");
+    if (!fp) return 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "%lu %lu %n", &g, &l, &n) >= 2 && !strcmp(line + n, key)) {
+            *global = g;
+            *local = l;
+            found = 1;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static void tune_store(const char *file, const char *key, size_t global, size_t local)
+{
+    FILE *fp = fopen(file, "a");
+
+    if (!fp) {
+        perror("cannot write the autotuner cache");
+        return;
+    }
+    fprintf(fp, "%lu %lu %s\n", (unsigned long) global, (unsigned long) local, key);
+    fclose(fp);
+}
+
+/* largest global size the autotuner may choose */
+static size_t tune_maxglobal(cl_device_id device, int natoms)
+{
+    cl_uint cu = 1;
+    size_t a = natoms + TUNE_MAXLOCAL;
+
+    clGetDeviceInfo( device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cu), &cu, NULL );
+    return ( cu * TUNE_MAXLOCAL > a ) ? cu * TUNE_MAXLOCAL : a;
+}
+
+/* time the force computation with the given work sizes */
+static double time_force(cl_command_queue queue, cl_mdsys_t *sys, cl_force_t *f, size_t global, size_t local)
+{
+    double t0;
+    int i;
+
+    CheckSuccess( bind_force( sys, f, &local ), 10 );
+    CheckSuccess( compute_force( queue, f, &global, &local, NULL ), 10 );
+    clFinish( queue );
+    t0 = second();
+    for( i = 0; i < TUNE_REPS; i++ )
+        CheckSuccess( compute_force( queue, f, &global, &local, NULL ), 10 );
+    clFinish( queue );
+    return ( second() - t0 ) / TUNE_REPS;
+}
+
+/* try local sizes from the preferred multiple of the force kernel up to
+ * its maximum (or only wgsize if given) with 1, 2, 4 and 8 work-groups
+ * per compute unit, as long as there are atoms for all work-items.
+ * Returns the time per force call of the fastest one. */
+static double autotune(cl_device_id device, cl_command_queue queue, cl_mdsys_t *sys, cl_force_t *f,
+                       size_t wgsize, size_t *global, size_t *local)
+{
+    cl_uint cu = 1;
+    size_t pref = 1, kmax = TUNE_MAXLOCAL, dmax = TUNE_MAXLOCAL, maxl, l, g, m;
+    double t, best = -1.0;
+
+    clGetDeviceInfo( device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cu), &cu, NULL );
+    clGetDeviceInfo( device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(dmax), &dmax, NULL );
+    clGetKernelWorkGroupInfo( f->force, device, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, sizeof(pref), &pref, NULL );
+    clGetKernelWorkGroupInfo( f->force, device, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kmax), &kmax, NULL );
+
+    maxl = TUNE_MAXLOCAL;
+    if( kmax < maxl ) maxl = kmax;
+    if( dmax < maxl ) maxl = dmax;
+    if( pref < 1 ) pref = 1;
+    if( pref > maxl ) pref = maxl;
+    if( wgsize > 0 ) pref = maxl = wgsize;
+
+    for( l = pref; l <= maxl; l *= 2 ) {
+        size_t gmax = ( ( sys->natoms + l - 1 ) / l ) * l;
+
+        for( m = 1; m <= 8; m *= 2 ) {
+            g = cu * l * m;
+            if( m > 1 && g > gmax ) break;
+            t = time_force( queue, sys, f, g, l );
+            if( best < 0.0 || t < best ) {
+                best = t;
+                *global = g;
+                *local = l;
+            }
+        }
+    }
+    return best;
+}
+
+/* set up a further device of the multi-device mode with its own context,
+ * queue and program, a copy of the positions and the force computation
+ * with nthreads work-items and the local size of the first device */
+static cl_int init_part(cl_part_t *p, cl_device_id device, const char *source, const char *flags,
+                        mdsys_t *sys, mdopts_t *opts, int nthreads, size_t *localWorkSize)
+{
+    cl_program program;
+    cl_mem epot;
+    cl_int status;
+    size_t size = sys->natoms * sizeof(FPTYPE);
+
+    p->device = device;
+    p->event = NULL;
+    p->ftime = p->btime = 0.0;
+    p->context = clCreateContext( NULL, 1, &device, NULL, NULL, &status );
+    if( status != CL_SUCCESS ) return status;
+    p->queue = clCreateCommandQueue( p->context, device, CL_QUEUE_PROFILING_ENABLE, &status );
+    if( status != CL_SUCCESS ) return status;
+
+    program = BuildProgramCached( p->context, device, source, flags, progcache_dir( opts ), &status );
+    if( status != CL_SUCCESS ) return status;
+
+    p->sys.natoms = sys->natoms;
+    p->sys.box = sys->box;
+    p->sys.zerocopy = 0;
+    p->sys.perm = NULL;
+    p->sys.layout = LAYOUT_SOA;
+    p->sys.rx = clCreateBuffer( p->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    p->sys.ry = clCreateBuffer( p->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    p->sys.rz = clCreateBuffer( p->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    p->sys.fx = clCreateBuffer( p->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    p->sys.fy = clCreateBuffer( p->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    p->sys.fz = clCreateBuffer( p->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    p->sys.vx = p->sys.vy = p->sys.vz = NULL;
+
+    epot = clCreateBuffer( p->context, CL_MEM_READ_WRITE, nthreads * sizeof(FPTYPE), NULL, &status );
+    p->energy = clCreateBuffer( p->context, CL_MEM_READ_WRITE, sizeof(FPTYPE), NULL, &status );
+    status |= init_reduce( p->context, device, program, &p->reduce, nthreads );
+    if( status != CL_SUCCESS ) return status;
+    status = init_force( p->context, p->queue, program, &p->force, sys, opts, epot );
+    if( status != CL_SUCCESS ) return status;
+    return bind_force( &p->sys, &p->force, localWorkSize );
+}
+
+/* split the atoms in ranges proportional to the weights of the devices
+ * and bind the new ranges to the force kernels */
+static void split_atoms(cl_multi_t *m, int natoms)
+{
+    double sum = 0.0, acc = 0.0;
+    int d, first = 0;
+
+    for( d = 0; d < m->npart; d++ ) sum += m->part[d].weight;
+    for( d = 0; d < m->npart; d++ ) {
+        acc += m->part[d].weight;
+        m->part[d].force.ifirst = first;
+        first = ( d == m->npart - 1 ) ? natoms : (int) ( natoms * acc / sum + 0.5 );
+        m->part[d].force.ilast = first;
+        CheckSuccess( bind_range( &m->part[d].force ), 3 );
+    }
+}
+
+/* add the device time of the last force kernel of a device */
+static void part_time(cl_part_t *p)
+{
+    cl_ulong start, end;
+
+    if( !p->event ) return;
+    if( clGetEventProfilingInfo( p->event, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL ) == CL_SUCCESS
+        && clGetEventProfilingInfo( p->event, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL ) == CL_SUCCESS ) {
+        p->ftime += 1.0e-9 * ( end - start );
+        p->btime += 1.0e-9 * ( end - start );
+    }
+    clReleaseEvent( p->event );
+    p->event = NULL;
+}
+
+/* force computation on all devices: the current positions are sent from
+ * the first device to the others, which compute their ranges while the
+ * first one does its own, and then their forces are copied back.
+ * With doepot their potential energy is stored at epot[nthreads]. */
+static cl_int compute_force_multi(cl_multi_t *m, size_t *globalWorkSize, size_t *localWorkSize, int doepot)
+{
+    cl_part_t *p0 = &m->part[0], *p;
+    size_t size = p0->sys.natoms * sizeof(FPTYPE), offset, count;
+    FPTYPE epot = ZERO, e;
+    cl_int status;
+    int d;
+
+    /* the read waits for the update of the positions */
+    status = clProfEnqueueReadBuffer( p0->queue, p0->sys.rx, CL_FALSE, 0, size, m->rx, 0, NULL, NULL );
+    status |= clProfEnqueueReadBuffer( p0->queue, p0->sys.ry, CL_FALSE, 0, size, m->ry, 0, NULL, NULL );
+    status |= clProfEnqueueReadBuffer( p0->queue, p0->sys.rz, CL_TRUE, 0, size, m->rz, 0, NULL, NULL );
+    part_time( p0 );
+
+    for( d = 1; d < m->npart; d++ ) {
+        p = &m->part[d];
+        offset = p->force.ifirst * sizeof(FPTYPE);
+        count = ( p->force.ilast - p->force.ifirst ) * sizeof(FPTYPE);
+
+        status |= clProfEnqueueWriteBuffer( p->queue, p->sys.rx, CL_FALSE, 0, size, m->rx, 0, NULL, NULL );
+        status |= clProfEnqueueWriteBuffer( p->queue, p->sys.ry, CL_FALSE, 0, size, m->ry, 0, NULL, NULL );
+        status |= clProfEnqueueWriteBuffer( p->queue, p->sys.rz, CL_FALSE, 0, size, m->rz, 0, NULL, NULL );
+        status |= compute_force( p->queue, &p->force, globalWorkSize, localWorkSize, &p->event );
+        if( doepot ) status |= reduce_sum( p->queue, &p->reduce, p->force.epot, m->nthreads, p->energy, 0, NULL );
+        status |= clProfEnqueueReadBuffer( p->queue, p->sys.fx, CL_FALSE, offset, count, (char *) m->fx + offset, 0, NULL, NULL );
+        status |= clProfEnqueueReadBuffer( p->queue, p->sys.fy, CL_FALSE, offset, count, (char *) m->fy + offset, 0, NULL, NULL );
+        status |= clProfEnqueueReadBuffer( p->queue, p->sys.fz, CL_FALSE, offset, count, (char *) m->fz + offset, 0, NULL, NULL );
+        status |= clFlush( p->queue );
+    }
+
+    status |= compute_force( p0->queue, &p0->force, globalWorkSize, localWorkSize, &p0->event );
+
+    /* the host copies stay untouched until the next call, whose first
+     * read waits for these writes */
+    for( d = 1; d < m->npart; d++ ) {
+        p = &m->part[d];
+        offset = p->force.ifirst * sizeof(FPTYPE);
+        count = ( p->force.ilast - p->force.ifirst ) * sizeof(FPTYPE);
+
+        status |= clFinish( p->queue );
+        part_time( p );
+        status |= clProfEnqueueWriteBuffer( p0->queue, p0->sys.fx, CL_FALSE, offset, count, (char *) m->fx + offset, 0, NULL, NULL );
+        status |= clProfEnqueueWriteBuffer( p0->queue, p0->sys.fy, CL_FALSE, offset, count, (char *) m->fy + offset, 0, NULL, NULL );
+        status |= clProfEnqueueWriteBuffer( p0->queue, p0->sys.fz, CL_FALSE, offset, count, (char *) m->fz + offset, 0, NULL, NULL );
+        if( doepot ) {
+            status |= clProfEnqueueReadBuffer( p->queue, p->energy, CL_TRUE, 0, sizeof(FPTYPE), &e, 0, NULL, NULL );
+            epot += e;
+        }
+    }
+    if( doepot )
+        status |= clProfEnqueueWriteBuffer( p0->queue, p0->force.epot, CL_TRUE, m->nthreads * sizeof(FPTYPE), sizeof(FPTYPE),
+                                            &epot, 0, NULL, NULL );
+    m->ncalls++;
+    return status;
+}
+
+/* split the atoms anew by the speed of each device since the last
+ * split, in atoms per second of its force kernel, so that they all
+ * finish at the same time. A device without atoms or time keeps its
+ * weight. The neighbor lists and cells cover all atoms on every
+ * device, so they stay valid. */
+static void rebalance(cl_multi_t *m, int natoms)
+{
+    cl_part_t *p;
+    int d, count;
+
+    clFinish( m->part[0].queue );
+    for( d = 0; d < m->npart; d++ ) {
+        p = &m->part[d];
+        part_time( p );
+        count = p->force.ilast - p->force.ifirst;
+        if( count > 0 && p->btime > 0.0 ) p->weight = count / p->btime;
+        p->btime = 0.0;
+    }
+    split_atoms( m, natoms );
+    m->nsplits++;
+}
+
+/* atoms and device time of the force kernel per call on each device */
+static void balance_report(cl_multi_t *m)
+{
+    char name[BLEN];
+    double t, tmax = 0.0, tsum = 0.0;
+    int d;
+
+    for( d = 0; d < m->npart; d++ ) {
+        clFinish( m->part[d].queue );
+        part_time( &m->part[d] );
+        tsum += m->part[d].ftime;
+        if( m->part[d].ftime > tmax ) tmax = m->part[d].ftime;
+    }
+
+    fprintf( stdout, "\nLoad balance of the force computation on %d devices:\n", m->npart );
+    fprintf( stdout, "  device      atoms   ms/step   share  name\n" );
+    for( d = 0; d < m->npart; d++ ) {
+        cl_part_t *p = &m->part[d];
+
+        if( clGetDeviceInfo( p->device, CL_DEVICE_NAME, sizeof(name), name, NULL ) != CL_SUCCESS ) strcpy( name, "unknown" );
+        t = p->ftime;
+        fprintf( stdout, "  %6d %10d %9.3f %6.1f%%  %s\n", d, p->force.ilast - p->force.ifirst,
+                 1000.0 * t / ( m->ncalls > 0 ? m->ncalls : 1 ), tsum > 0.0 ? 100.0 * t / tsum : 0.0, name );
+    }
+    if( tsum > 0.0 )
+        fprintf( stdout, "Load imbalance (slowest / average device) = %.3f\n", tmax * m->npart / tsum );
+    if( m->nsplits > 0 )
+        fprintf( stdout, "The atoms were split anew %d times from the measured kernel times.\n", m->nsplits );
+}
+
+#ifdef __PROFILING
+/* report how often the neighbor list was rebuilt and its average size
+ * (pairs are counted once with the half list) */
+static void nlist_stats(cl_command_queue queue, cl_force_t *f, int natoms, int nsteps)
+{
+    int i, rebuild[2], *count;
+    double sum = 0.0;
+
+    count = (int *) malloc( natoms * sizeof(int) );
+    CheckSuccess( clProfEnqueueReadBuffer( queue, f->rebuild, CL_TRUE, 0, 2 * sizeof(int), rebuild, 0, NULL, NULL ), 9 );
+    CheckSuccess( clProfEnqueueReadBuffer( queue, f->nlist_count, CL_TRUE, 0, natoms * sizeof(int), count, 0, NULL, NULL ), 9 );
+    for( i = 0; i < natoms; i++ ) sum += count[i];
+    free(count);
+
+    fprintf( stdout, "Neighbor list rebuilds = %d (every %.1f steps), average neighbors per atom = %.1f\n",
+             rebuild[1], (double) nsteps / ( rebuild[1] > 0 ? rebuild[1] : 1 ), sum / natoms );
+}
+#endif
+
+static cl_int init_frame(cl_context context, cl_frame_t *fr, int natoms, int zerocopy)
+{
+    cl_mem_flags flags = atom_mem_flags(zerocopy);
+    cl_int status;
+
+    fr->pending = 0;
+    fr->ready = fr->done = NULL;
+    fr->zerocopy = zerocopy;
+    fr->rx = fr->ry = fr->rz = NULL;
+    if (!zerocopy) {
+	fr->rx = (FPTYPE *) malloc( natoms * sizeof(FPTYPE) );
+	fr->ry = (FPTYPE *) malloc( natoms * sizeof(FPTYPE) );
+	fr->rz = (FPTYPE *) malloc( natoms * sizeof(FPTYPE) );
+    }
+    fr->snap_rx = clCreateBuffer( context, flags, natoms * sizeof(FPTYPE), NULL, &status );
+    fr->snap_ry = clCreateBuffer( context, flags, natoms * sizeof(FPTYPE), NULL, &status );
+    fr->snap_rz = clCreateBuffer( context, flags, natoms * sizeof(FPTYPE), NULL, &status );
+    return status;
+}
+
+/* give the snapshot buffers of a mapped frame back to the device,
+ * the writer must be done with it */
+static cl_int frame_unmap(cl_command_queue queue, cl_frame_t *fr)
+{
+    cl_int status = CL_SUCCESS;
+
+    if (!fr->zerocopy || !fr->rx) return status;
+    status = clEnqueueUnmapMemObject( queue, fr->snap_rx, fr->rx, 0, NULL, NULL );
+    status |= clEnqueueUnmapMemObject( queue, fr->snap_ry, fr->ry, 0, NULL, NULL );
+    status |= clEnqueueUnmapMemObject( queue, fr->snap_rz, fr->rz, 0, NULL, NULL );
+    fr->rx = fr->ry = fr->rz = NULL;
+    return status;
+}
+
+/* copy the current positions into the snapshot buffers of the frame,
+ * in the original order with the scatter kernel of the reordering or
+ * out of the packed layout with its unpack kernel */
+static cl_int frame_snapshot(cl_command_queue queue, cl_mdsys_t *sys, cl_frame_t *fr, cl_kernel kernel,
+                             size_t *globalWorkSize, size_t *localWorkSize)
+{
+    cl_int status;
+    size_t size = sys->natoms * sizeof(FPTYPE);
+
+    if (sys->perm || sys->layout == LAYOUT_VEC4) {
+        status = clSetMultKernelArgs( kernel, sys->perm ? 5 : 2, 3, KArg(fr->snap_rx), KArg(fr->snap_ry), KArg(fr->snap_rz) );
+        status |= clProfEnqueueNDRangeKernel( queue, kernel, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+        return status;
+    }
+    status = clProfEnqueueCopyBuffer( queue, sys->rx, fr->snap_rx, 0, 0, size, 0, NULL, NULL );
+    status |= clProfEnqueueCopyBuffer( queue, sys->ry, fr->snap_ry, 0, 0, size, 0, NULL, NULL );
+    status |= clProfEnqueueCopyBuffer( queue, sys->rz, fr->snap_rz, 0, 0, size, 0, NULL, NULL );
+    return status;
+}
+
+/* start the download of a frame once its ready event has completed.
+ * The energies are taken from energy[offset] and energy[offset+1],
+ * without a trajectory (natoms 0) they are all there is to read. */
+static cl_int frame_download(cl_command_queue queue, cl_frame_t *fr, cl_mem energy, int offset, int natoms)
+{
+    cl_int status = CL_SUCCESS, err[3];
+    size_t size = natoms * sizeof(FPTYPE);
+
+    if (natoms > 0 && fr->zerocopy) {
+	fr->rx = (FPTYPE *) clProfEnqueueMapBuffer( queue, fr->snap_rx, CL_FALSE, CL_MAP_READ, 0, size, 1, &fr->ready, NULL, &err[0] );
+	fr->ry = (FPTYPE *) clProfEnqueueMapBuffer( queue, fr->snap_ry, CL_FALSE, CL_MAP_READ, 0, size, 1, &fr->ready, NULL, &err[1] );
+	fr->rz = (FPTYPE *) clProfEnqueueMapBuffer( queue, fr->snap_rz, CL_FALSE, CL_MAP_READ, 0, size, 1, &fr->ready, NULL, &err[2] );
+	status = err[0] | err[1] | err[2];
+    } else if (natoms > 0) {
+	status = clProfEnqueueReadBuffer( queue, fr->snap_rx, CL_FALSE, 0, size, fr->rx, 1, &fr->ready, NULL );
+	status |= clProfEnqueueReadBuffer( queue, fr->snap_ry, CL_FALSE, 0, size, fr->ry, 1, &fr->ready, NULL );
+	status |= clProfEnqueueReadBuffer( queue, fr->snap_rz, CL_FALSE, 0, size, fr->rz, 1, &fr->ready, NULL );
+    }
+    status |= clProfEnqueueReadBuffer( queue, energy, CL_FALSE, offset * sizeof(FPTYPE), 2 * sizeof(FPTYPE),
+                                   fr->energy, 1, &fr->ready, &fr->done );
+    status |= clFlush( queue );
+    return status;
+}
+
+/* wait for the download of a frame and write it out */
+static void frame_write(cl_frame_t *fr, mdsys_t *sys, FILE *erg, FILE *traj, int trajformat)
+{
+    mdsys_t frame = *sys;
+
+    CheckSuccess( clWaitForEvents( 1, &fr->done ), 6 );
+    clReleaseEvent( fr->ready );
+    clReleaseEvent( fr->done );
+    fr->ready = fr->done = NULL;
+
+    frame.nfi = fr->nfi;
+    frame.rx = fr->rx;
+    frame.ry = fr->ry;
+    frame.rz = fr->rz;
+    frame.epot = fr->energy[0];
+    frame.ekin = fr->energy[1] * HALF * mvsq2e * sys->mass;
+    frame.temp = TWO * frame.ekin / ( THREE * sys->natoms - THREE ) / kboltz;
+    output(&frame, erg, traj, trajformat);
+}
+
+static void *writer_main(void *arg)
+{
+    writer_t *w = (writer_t *) arg;
+    cl_frame_t *fr;
+    int pending;
+
+    for (;;) {
+        pthread_mutex_lock(&w->lock);
+        fr = &w->frames[w->next];
+        while ((!fr->pending || fr->nfi > w->checked) && !w->stop) pthread_cond_wait(&w->cond, &w->lock);
+        pending = fr->pending;
+        pthread_mutex_unlock(&w->lock);
+        if (!pending) break;
+
+        frame_write(fr, &w->sys, w->erg, w->traj, w->trajformat);
+
+        pthread_mutex_lock(&w->lock);
+        fr->pending = 0;
+        w->next = (w->next + 1) % w->nframes;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+    }
+    return NULL;
+}
+
+static int writer_start(writer_t *w, cl_frame_t *frames, int nframes, mdsys_t *sys, FILE *erg, FILE *traj, int trajformat)
+{
+    w->frames = frames;
+    w->nframes = nframes;
+    w->next = w->stop = w->checked = 0;
+    w->sys = *sys;
+    w->erg = erg;
+    w->traj = traj;
+    w->trajformat = trajformat;
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->cond, NULL);
+    return pthread_create(&w->thread, NULL, writer_main, w);
+}
+
+/* the cell and list capacities were checked up to step nfi */
+static void writer_checked(writer_t *w, int nfi)
+{
+    pthread_mutex_lock(&w->lock);
+    if (nfi > w->checked) w->checked = nfi;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* does the writer hold a frame back until the next check */
+static int writer_unchecked(writer_t *w, cl_frame_t *fr)
+{
+    int held;
+
+    pthread_mutex_lock(&w->lock);
+    held = fr->pending && fr->nfi > w->checked;
+    pthread_mutex_unlock(&w->lock);
+    return held;
+}
+
+/* wait until the writer is done with a frame, so that it can be reused */
+static void writer_acquire(writer_t *w, cl_frame_t *fr)
+{
+    pthread_mutex_lock(&w->lock);
+    while (fr->pending) pthread_cond_wait(&w->cond, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* hand a downloading frame over to the writer */
+static void writer_push(writer_t *w, cl_frame_t *fr, int nfi)
+{
+    pthread_mutex_lock(&w->lock);
+    fr->nfi = nfi;
+    fr->pending = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+/* write the remaining frames and stop the writer */
+static void writer_finish(writer_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->cond);
+}
+
+#ifndef _USE_MPI
+/* the lattice on the device: opencl_fcc, the sum of the partial sums
+ * of its threads on the host and opencl_fcc_scale */
+static cl_int fcc_device(cl_context context, cl_command_queue queue, cl_program program, const fcc_t *g,
+                         cl_mdsys_t *sys, size_t *globalWorkSize, size_t *localWorkSize)
+{
+    int nths = globalWorkSize[0], i, k;
+    FPTYPE sd = fcc_width(g, sys), c[3], scale, *part;
+    double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+    cl_kernel gen, corr;
+    cl_int status;
+    cl_mem sums;
+
+    gen = clCreateKernel( program, "opencl_fcc", &status );
+    corr = clCreateKernel( program, "opencl_fcc_scale", &status );
+    sums = clCreateBuffer( context, CL_MEM_READ_WRITE, 4 * nths * sizeof(FPTYPE), NULL, &status );
+    if( status != CL_SUCCESS ) return status;
+    status = clSetMultKernelArgs( gen, 0, 12, KArg(sys->rx), KArg(sys->ry), KArg(sys->rz), KArg(sys->vx),
+                                  KArg(sys->vy), KArg(sys->vz), KArg(sys->natoms), KArg(g->ncell), KArg(g->a),
+                                  KArg(sd), KArg(g->seed), KArg(sums) );
+    status |= clProfEnqueueNDRangeKernel( queue, gen, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+
+    part = (FPTYPE *) malloc( 4 * nths * sizeof(FPTYPE) );
+    status |= clProfEnqueueReadBuffer( queue, sums, CL_TRUE, 0, 4 * nths * sizeof(FPTYPE), part, 0, NULL, NULL );
+    for (k = 0; k < 4; ++k)
+        for (i = 0; i < nths; ++i) sum[k] += part[k * nths + i];
+    free( part );
+    fcc_correction( g, sys, sum, c, &scale );
+
+    status |= clSetMultKernelArgs( corr, 0, 8, KArg(sys->vx), KArg(sys->vy), KArg(sys->vz), KArg(sys->natoms),
+                                   KArg(c[0]), KArg(c[1]), KArg(c[2]), KArg(scale) );
+    status |= clProfEnqueueNDRangeKernel( queue, corr, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+    status |= clFinish( queue );
+    clReleaseKernel( gen );
+    clReleaseKernel( corr );
+    clReleaseMemObject( sums );
+    return status;
+}
+#endif
+
+#ifndef _USE_MPI
+/* name of the output files of copy k of a replica: _r<k> is inserted
+ * before the extension */
+static void replica_name(char *out, const char *name, int k)
+{
+    const char *dot = strrchr(name, '.'), *slash = strrchr(name, '/');
+
+    if (!dot || (slash && dot < slash)) dot = name + strlen(name);
+    snprintf(out, BLEN, "%.*s_r%d%s", (int) (dot - name), name, k, dot);
+}
+
+/* next input of an ensemble list, one file name per line */
+static int next_replica(FILE *list, char *name)
+{
+    char line[BLEN];
+
+    while (fgets(line, BLEN, list))
+        if (sscanf(line, "%s", name) == 1 && name[0] != '#') return 1;
+    return 0;
+}
+
+/* the replicas of the ensemble mode: opts->replicas copies of the
+ * system of the input, copy k > 0 writing to files named _r<k> and
+ * starting with velocities from the seed of an fcc restart or else
+ * opts->seed, plus k, then the inputs listed in the opts->ensemble
+ * file. They all run for the steps and with the output frequency of
+ * the input, the options of the input apply to all of them. */
+static ens_rep_t *ens_replicas(mdsys_t *sys, int nprint, const char *restfile, const char *trajfile,
+                               const char *ergfile, mdopts_t *opts, int *nrep)
+{
+    ens_rep_t *reps;
+    char name[BLEN];
+    FILE *list = NULL, *fp;
+    int n = opts->replicas, k, np;
+    fcc_t fcc;
+    cl_uint seed = parse_fcc(restfile, sys->natoms, sys->box, &fcc) > 0 ? fcc.seed : opts->seed;
+
+    if (opts->ensemble[0]) {
+        list = fopen(opts->ensemble, "r");
+        if (!list) {
+            perror("cannot read ensemble list");
+            return NULL;
+        }
+        while (next_replica(list, name)) ++n;
+        rewind(list);
+    }
+
+    reps = (ens_rep_t *) calloc(n, sizeof(ens_rep_t));
+    for (k = 0; k < opts->replicas; ++k) {
+        reps[k].sys = *sys;
+        strcpy(reps[k].restfile, restfile);
+        if (k == 0) {
+            strcpy(reps[k].trajfile, trajfile);
+            strcpy(reps[k].ergfile, ergfile);
+        } else {
+            replica_name(reps[k].trajfile, trajfile, k);
+            replica_name(reps[k].ergfile, ergfile, k);
+            reps[k].copy = k;
+            reps[k].seed = seed + k;
+        }
+    }
+    for (; list && next_replica(list, name); ++k) {
+        fp = fopen(name, "r");
+        if (!fp || read_input(fp, &reps[k].sys, reps[k].restfile, reps[k].trajfile, reps[k].ergfile, &np)) {
+            fprintf(stderr, "cannot read the replica input %s\n", name);
+            return NULL;
+        }
+        fclose(fp);
+        if (reps[k].sys.nsteps != sys->nsteps || np != nprint) {
+            fprintf(stderr, "the replica %s must have the steps and output frequency of the input\n", name);
+            return NULL;
+        }
+    }
+    if (list) fclose(list);
+    *nrep = k;
+    return reps;
+}
+
+/* pack the replicas into the device buffers and bind the kernels */
+static cl_int ens_init(ens_t *e, ens_rep_t *reps, int nrep, cl_context context, cl_command_queue queue,
+                       cl_program program, cl_reduce_t *r, size_t *local)
+{
+    FPTYPE *buffers[3], *par;
+    int *rep, *first, *count;
+    int i, k, q, n, step0;
+    size_t size;
+    cl_int status = CL_SUCCESS;
+
+    e->reps = reps;
+    e->nrep = nrep;
+    e->ntotal = 0;
+    for (q = 0; q < nrep; ++q) {
+        reps[q].first = e->ntotal;
+        e->ntotal += reps[q].sys.natoms;
+    }
+
+    /* positions and velocities of all replicas, the constants of each */
+    for (k = 0; k < 3; ++k) e->pos[k] = (FPTYPE *) malloc( 2 * e->ntotal * sizeof(FPTYPE) );
+    e->energies = (FPTYPE *) malloc( 2 * nrep * sizeof(FPTYPE) );
+    par = (FPTYPE *) malloc( ENS_NPAR * nrep * sizeof(FPTYPE) );
+    first = (int *) malloc( nrep * sizeof(int) );
+    count = (int *) malloc( nrep * sizeof(int) );
+    rep = (int *) malloc( e->ntotal * sizeof(int) );
+    for (q = 0; q < nrep; ++q) {
+        mdsys_t *sys = &reps[q].sys;
+        FPTYPE *p = par + ENS_NPAR * q;
+        cl_mdsys_t tmp;
+
+        n = sys->natoms;
+        tmp.natoms = n;
+        tmp.box = sys->box;
+        tmp.mass = sys->mass;
+        for (k = 0; k < 3; ++k) buffers[k] = (FPTYPE *) malloc( 2 * n * sizeof(FPTYPE) );
+        if (read_restart( reps[q].restfile, NULL, &tmp, buffers, &step0 )) {
+            perror("cannot read restart file");
+            return -1;
+        }
+        if (reps[q].copy) {
+            /* new velocities at the temperature of the restart */
+            fcc_t g;
+            double sq = 0.0;
+
+            for (k = 0; k < 3; ++k)
+                for (i = 0; i < n; ++i) sq += buffers[k][n + i] * buffers[k][n + i];
+            g.temp = mvsq2e * tmp.mass * sq / ( 3.0 * n - 3.0 ) / kboltz;
+            g.seed = reps[q].seed;
+            fcc_velocities( &g, &tmp, buffers );
+        }
+        for (k = 0; k < 3; ++k) {
+            memcpy( e->pos[k] + reps[q].first, buffers[k], n * sizeof(FPTYPE) );
+            memcpy( e->pos[k] + e->ntotal + reps[q].first, buffers[k] + n, n * sizeof(FPTYPE) );
+            free( buffers[k] );
+        }
+
+        p[0] = sys->box;
+        p[1] = HALF * sys->box;
+        p[2] = 1.0 / sys->box;
+        p[3] = 4.0 * sys->epsilon * pow( sys->sigma, 12.0 );
+        p[4] = 4.0 * sys->epsilon * pow( sys->sigma, 6.0 );
+        p[5] = sys->rcut * sys->rcut;
+        p[6] = sys->dt;
+        p[7] = HALF * sys->dt / mvsq2e / sys->mass;
+        first[q] = reps[q].first;
+        count[q] = n;
+        for (i = 0; i < n; ++i) rep[reps[q].first + i] = q;
+    }
+
+    size = e->ntotal * sizeof(FPTYPE);
+    e->all.natoms = e->ntotal;
+    e->all.rx = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+    e->all.ry = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+    e->all.rz = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+    e->all.vx = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+    e->all.vy = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+    e->all.vz = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+    e->all.fx = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+    e->all.fy = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+    e->all.fz = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+    e->epot = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+    e->ekin_buf = clCreateBuffer( context, CL_MEM_READ_WRITE, size, NULL, &status );
+    e->energy = clCreateBuffer( context, CL_MEM_READ_WRITE, 2 * nrep * sizeof(FPTYPE), NULL, &status );
+    e->rep = clCreateBuffer( context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, e->ntotal * sizeof(int), rep, &status );
+    e->first = clCreateBuffer( context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nrep * sizeof(int), first, &status );
+    e->count = clCreateBuffer( context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, nrep * sizeof(int), count, &status );
+    e->par = clCreateBuffer( context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, ENS_NPAR * nrep * sizeof(FPTYPE), par, &status );
+    CheckSuccess(status, 1);
+    free(par);
+    free(first);
+    free(count);
+    free(rep);
+
+    status = clProfEnqueueWriteBuffer( queue, e->all.rx, CL_TRUE, 0, size, e->pos[0], 0, NULL, NULL );
+    status |= clProfEnqueueWriteBuffer( queue, e->all.ry, CL_TRUE, 0, size, e->pos[1], 0, NULL, NULL );
+    status |= clProfEnqueueWriteBuffer( queue, e->all.rz, CL_TRUE, 0, size, e->pos[2], 0, NULL, NULL );
+    status |= clProfEnqueueWriteBuffer( queue, e->all.vx, CL_TRUE, 0, size, e->pos[0] + e->ntotal, 0, NULL, NULL );
+    status |= clProfEnqueueWriteBuffer( queue, e->all.vy, CL_TRUE, 0, size, e->pos[1] + e->ntotal, 0, NULL, NULL );
+    status |= clProfEnqueueWriteBuffer( queue, e->all.vz, CL_TRUE, 0, size, e->pos[2] + e->ntotal, 0, NULL, NULL );
+    CheckSuccess(status, 0);
+
+    /* one work-item per atom of all replicas, one work-group per replica for the sums */
+    e->local = local;
+    e->global = local ? ( ( e->ntotal + local[0] - 1 ) / local[0] ) * local[0] : e->ntotal;
+    e->rwgsize = r->wgsize;
+
+    e->force = clCreateKernel( program, "opencl_force_ens", &status );
+    e->verlet_first = clCreateKernel( program, "opencl_verlet_first_ens", &status );
+    e->verlet_second = clCreateKernel( program, "opencl_verlet_second_ens", &status );
+    e->ekin = clCreateKernel( program, "opencl_ekin_ens", &status );
+    e->reduce = clCreateKernel( program, "opencl_reduce_ens", &status );
+    CheckSuccess(status, 1);
+
+    status = clSetMultKernelArgs( e->force, 0, 12, KArg(e->all.fx), KArg(e->all.fy), KArg(e->all.fz),
+                                  KArg(e->all.rx), KArg(e->all.ry), KArg(e->all.rz), KArg(e->ntotal),
+                                  KArg(e->epot), KArg(e->rep), KArg(e->first), KArg(e->count), KArg(e->par) );
+    status |= clSetMultKernelArgs( e->verlet_first, 0, 12, KArg(e->all.fx), KArg(e->all.fy), KArg(e->all.fz),
+                                   KArg(e->all.rx), KArg(e->all.ry), KArg(e->all.rz),
+                                   KArg(e->all.vx), KArg(e->all.vy), KArg(e->all.vz),
+                                   KArg(e->ntotal), KArg(e->rep), KArg(e->par) );
+    status |= clSetMultKernelArgs( e->verlet_second, 0, 9, KArg(e->all.fx), KArg(e->all.fy), KArg(e->all.fz),
+                                   KArg(e->all.vx), KArg(e->all.vy), KArg(e->all.vz),
+                                   KArg(e->ntotal), KArg(e->rep), KArg(e->par) );
+    status |= clSetMultKernelArgs( e->ekin, 0, 5, KArg(e->all.vx), KArg(e->all.vy), KArg(e->all.vz),
+                                   KArg(e->ntotal), KArg(e->ekin_buf) );
+    status |= clSetMultKernelArgs( e->reduce, 1, 3, KArg(e->first), KArg(e->count), KArg(e->energy) );
+    status |= clSetKernelArg( e->reduce, 5, e->rwgsize * sizeof(FPTYPE), NULL );
+    return status;
+}
+
+/* sum the per atom energies of in for each replica into energy[offset + r] */
+static cl_int ens_reduce(ens_t *e, cl_command_queue queue, cl_mem in, int offset)
+{
+    size_t global = e->nrep * e->rwgsize;
+    cl_int status;
+
+    status = clSetKernelArg( e->reduce, 0, sizeof(in), &in );
+    status |= clSetKernelArg( e->reduce, 4, sizeof(offset), &offset );
+    status |= clProfEnqueueNDRangeKernel( queue, e->reduce, 1, NULL, &global, &e->rwgsize, 0, NULL, NULL );
+    return status;
+}
+
+/* energies and positions of all replicas, each written to its files */
+static void ens_output(ens_t *e, cl_command_queue queue, int nfi, int trajformat)
+{
+    size_t size = e->ntotal * sizeof(FPTYPE);
+    cl_int status;
+    int q;
+
+    status = clProfEnqueueNDRangeKernel( queue, e->ekin, 1, NULL, &e->global, e->local, 0, NULL, NULL );
+    status |= ens_reduce( e, queue, e->epot, 0 );
+    status |= ens_reduce( e, queue, e->ekin_buf, e->nrep );
+    status |= clProfEnqueueReadBuffer( queue, e->all.rx, CL_FALSE, 0, size, e->pos[0], 0, NULL, NULL );
+    status |= clProfEnqueueReadBuffer( queue, e->all.ry, CL_FALSE, 0, size, e->pos[1], 0, NULL, NULL );
+    status |= clProfEnqueueReadBuffer( queue, e->all.rz, CL_FALSE, 0, size, e->pos[2], 0, NULL, NULL );
+    status |= clProfEnqueueReadBuffer( queue, e->energy, CL_TRUE, 0, 2 * e->nrep * sizeof(FPTYPE), e->energies, 0, NULL, NULL );
+    CheckSuccess(status, 8);
+
+    for (q = 0; q < e->nrep; ++q) {
+        ens_rep_t *r = &e->reps[q];
+        mdsys_t frame = r->sys;
+
+        frame.nfi = nfi;
+        frame.rx = e->pos[0] + r->first;
+        frame.ry = e->pos[1] + r->first;
+        frame.rz = e->pos[2] + r->first;
+        frame.epot = e->energies[q];
+        frame.ekin = e->energies[e->nrep + q] * HALF * mvsq2e * frame.mass;
+        frame.temp = TWO * frame.ekin / ( THREE * frame.natoms - THREE ) / kboltz;
+        printf("% 8d % 8d % 20.8f % 20.8f % 20.8f % 20.8f\n", nfi, q, frame.temp, frame.ekin, frame.epot, frame.ekin+frame.epot);
+        write_energy(r->erg, &frame);
+        output_traj(&frame, r->traj, trajformat);
+    }
+}
+
+/* ensemble mode: all replicas take their steps together, one launch
+ * of each kernel covers the atoms of all of them */
+static int ens_run(mdsys_t *sys, int nprint, const char *restfile, const char *trajfile, const char *ergfile,
+                   mdopts_t *opts, cl_context context, cl_command_queue queue, cl_program program,
+                   cl_reduce_t *r, size_t *local)
+{
+    ens_t e;
+    ens_rep_t *reps;
+    int nrep, q, nfi;
+    cl_int status;
+#ifdef __PROFILING
+    double t_loop;
+#endif
+
+    reps = ens_replicas( sys, nprint, restfile, trajfile, ergfile, opts, &nrep );
+    if (!reps) return 1;
+    if (ens_init( &e, reps, nrep, context, queue, program, r, local ) != CL_SUCCESS) return 4;
+
+    for (q = 0; q < nrep; ++q) {
+        reps[q].erg = fopen(reps[q].ergfile, "w");
+        reps[q].traj = opts->trajformat == TRAJ_NONE ? NULL : fopen(reps[q].trajfile, "wb");
+        if (!reps[q].erg || (!reps[q].traj && opts->trajformat != TRAJ_NONE)) {
+            perror("cannot open the replica output files");
+            return 1;
+        }
+        if (opts->trajformat == TRAJ_BIN) write_traj_header(&reps[q].sys, reps[q].traj);
+    }
+
+    printf("Starting simulation of %d replicas with %d atoms for %d steps.\n", nrep, e.ntotal, sys->nsteps);
+    printf("     NFI  REPLICA            TEMP            EKIN                 EPOT              ETOT\n");
+
+    status = clProfEnqueueNDRangeKernel( queue, e.force, 1, NULL, &e.global, e.local, 0, NULL, NULL );
+    CheckSuccess(status, 3);
+    ens_output( &e, queue, 0, opts->trajformat );
+
+#ifdef __PROFILING
+    t_loop = second();
+#endif
+    for (nfi = 1; nfi <= sys->nsteps; ++nfi) {
+        /* the positions after step nfi-1 are written with label nfi,
+         * as in the single system mode */
+        if ((nfi % nprint) == 0) ens_output( &e, queue, nfi, opts->trajformat );
+
+        status = clProfEnqueueNDRangeKernel( queue, e.verlet_first, 1, NULL, &e.global, e.local, 0, NULL, NULL );
+        status |= clProfEnqueueNDRangeKernel( queue, e.force, 1, NULL, &e.global, e.local, 0, NULL, NULL );
+        status |= clProfEnqueueNDRangeKernel( queue, e.verlet_second, 1, NULL, &e.global, e.local, 0, NULL, NULL );
+        CheckSuccess(status, 4);
+    }
+    clFinish( queue );
+
+#ifdef __PROFILING
+    t_loop = second() - t_loop;
+    fprintf( stdout, "\n\nTime per MD step of all %d replicas = %.3g (ms)\n", nrep, 1000.0 * t_loop / sys->nsteps );
+#endif
+
+    for (q = 0; q < nrep; ++q) {
+        fclose(reps[q].erg);
+        if (reps[q].traj) fclose(reps[q].traj);
+    }
+    free(reps);
+    printf("Simulation Done.\n");
+    return 0;
+}
+#endif
+
+#ifdef _USE_MPI
+/* wrap a coordinate into [0,box) */
+static FPTYPE wrap(FPTYPE x, FPTYPE box)
+{
+    x -= box * floor( x / box );
+    return (x < box) ? x : ZERO;
+}
+
+static int dom_owns(mpi_dom_t *dom, FPTYPE x, FPTYPE y, FPTYPE z)
+{
+    FPTYPE r[3];
+    int d;
+
+    r[0] = wrap(x, dom->box);
+    r[1] = wrap(y, dom->box);
+    r[2] = wrap(z, dom->box);
+    for (d=0; d<3; ++d)
+        if (r[d] < dom->lo[d] || r[d] >= dom->hi[d]) return 0;
+    return 1;
+}
+
+/* grow a message buffer to at least n bytes */
+static char *grow(char *buf, size_t *cap, size_t n)
+{
+    if (n <= *cap) return buf;
+    *cap = n + n / 2 + 1024;
+    buf = (char *) realloc( buf, *cap );
+    if (!buf) {
+        fprintf( stderr, "out of memory for the MPI messages\n" );
+        MPI_Abort( MPI_COMM_WORLD, 1 );
+    }
+    return buf;
+}
+
+/* make room for n own atoms and ghosts on the host and the device.
+ * The device buffers lose their contents, they are refilled by
+ * dom_upload */
+static cl_int dom_reserve(mpi_dom_t *dom, int n)
+{
+    cl_mdsys_t *sys = &dom->sys;
+    cl_int status = CL_SUCCESS;
+    size_t size;
+    int k;
+
+    if (n <= dom->cap) return CL_SUCCESS;
+    dom->cap = n + n / 2 + 16;
+    size = dom->cap * sizeof(FPTYPE);
+    dom->id = (int *) realloc( dom->id, dom->cap * sizeof(int) );
+    dom->order = (int *) realloc( dom->order, 2 * dom->cap * sizeof(int) );
+    for (k=0; k<3; ++k) {
+        dom->r[k] = (FPTYPE *) realloc( dom->r[k], size );
+        dom->v[k] = (FPTYPE *) realloc( dom->v[k], size );
+    }
+
+    if (sys->rx) {
+        clReleaseMemObject( sys->rx );
+        clReleaseMemObject( sys->ry );
+        clReleaseMemObject( sys->rz );
+        clReleaseMemObject( sys->vx );
+        clReleaseMemObject( sys->vy );
+        clReleaseMemObject( sys->vz );
+        clReleaseMemObject( sys->fx );
+        clReleaseMemObject( sys->fy );
+        clReleaseMemObject( sys->fz );
+    }
+    sys->rx = clCreateBuffer( dom->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    sys->ry = clCreateBuffer( dom->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    sys->rz = clCreateBuffer( dom->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    sys->vx = clCreateBuffer( dom->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    sys->vy = clCreateBuffer( dom->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    sys->vz = clCreateBuffer( dom->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    sys->fx = clCreateBuffer( dom->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    sys->fy = clCreateBuffer( dom->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    sys->fz = clCreateBuffer( dom->context, CL_MEM_READ_WRITE, size, NULL, &status );
+    CheckSuccess(status, 1);
+    return status;
+}
+
+/* append a record to the message for the low (side 0) or high neighbor */
+static void dom_pack(mpi_dom_t *dom, int side, int *n, const void *rec, size_t size)
+{
+    dom->sbuf[side] = grow( dom->sbuf[side], &dom->sbufcap[side], ( *n + 1 ) * size );
+    memcpy( dom->sbuf[side] + *n * size, rec, size );
+    ++*n;
+}
+
+/* send nlow records to the low and nhigh to the high neighbor in
+ * dimension d. The records of both neighbors are received in rbuf,
+ * their number is returned. */
+static int dom_exchange(mpi_dom_t *dom, int d, int nlow, int nhigh, size_t size)
+{
+    int nin[2], nout[2];
+    MPI_Status st;
+
+    nout[0] = nlow;
+    nout[1] = nhigh;
+    MPI_Sendrecv( &nout[0], 1, MPI_INT, dom->lo_rank[d], 0, &nin[0], 1, MPI_INT, dom->hi_rank[d], 0, dom->comm, &st );
+    MPI_Sendrecv( &nout[1], 1, MPI_INT, dom->hi_rank[d], 1, &nin[1], 1, MPI_INT, dom->lo_rank[d], 1, dom->comm, &st );
+
+    dom->rbuf = grow( dom->rbuf, &dom->rbufcap, ( nin[0] + nin[1] ) * size + 1 );
+    MPI_Sendrecv( dom->sbuf[0], nout[0] * size, MPI_BYTE, dom->lo_rank[d], 2,
+                  dom->rbuf, nin[0] * size, MPI_BYTE, dom->hi_rank[d], 2, dom->comm, &st );
+    MPI_Sendrecv( dom->sbuf[1], nout[1] * size, MPI_BYTE, dom->hi_rank[d], 3,
+                  dom->rbuf + nin[0] * size, nin[1] * size, MPI_BYTE, dom->lo_rank[d], 3, dom->comm, &st );
+    return nin[0] + nin[1];
+}
+
+/* hand the own atoms that left the block over to the neighbors,
+ * one dimension after the other */
+static void dom_migrate(mpi_dom_t *dom)
+{
+    mpi_atom_t a;
+    int d, i, k, n[2], nrecv;
+
+    for (d=0; d<3; ++d) {
+        if (dom->dims[d] == 1) continue;
+
+        n[0] = n[1] = 0;
+        for (i=0; i<dom->nlocal; ) {
+            FPTYPE x = wrap(dom->r[d][i], dom->box), dx;
+
+            if (x >= dom->lo[d] && x < dom->hi[d]) {
+                ++i;
+                continue;
+            }
+
+            /* the neighbor on the nearer side, across the periodic boundary */
+            dx = x - HALF * ( dom->lo[d] + dom->hi[d] );
+            dx -= dom->box * rint( dx / dom->box );
+            for (k=0; k<3; ++k) {
+                a.r[k] = dom->r[k][i];
+                a.v[k] = dom->v[k][i];
+            }
+            a.id = dom->id[i];
+            dom_pack( dom, dx < ZERO ? 0 : 1, &n[dx < ZERO ? 0 : 1], &a, sizeof(a) );
+
+            /* fill the gap with the last atom */
+            --dom->nlocal;
+            for (k=0; k<3; ++k) {
+                dom->r[k][i] = dom->r[k][dom->nlocal];
+                dom->v[k][i] = dom->v[k][dom->nlocal];
+            }
+            dom->id[i] = dom->id[dom->nlocal];
+        }
+
+        nrecv = dom_exchange( dom, d, n[0], n[1], sizeof(a) );
+        dom_reserve( dom, dom->nlocal + nrecv );
+        for (i=0; i<nrecv; ++i) {
+            memcpy( &a, dom->rbuf + i * sizeof(a), sizeof(a) );
+            for (k=0; k<3; ++k) {
+                dom->r[k][dom->nlocal] = a.r[k];
+                dom->v[k][dom->nlocal] = a.v[k];
+            }
+            dom->id[dom->nlocal++] = a.id;
+        }
+    }
+}
+
+/* collect the ghosts behind the own atoms: the positions within rghost
+ * of a face of the block are sent to the neighbor behind that face.
+ * Ghosts received in one dimension are passed on in the next ones,
+ * which covers the edge and corner neighbors. */
+static void dom_ghosts(mpi_dom_t *dom)
+{
+    FPTYPE rec[3];
+    int d, i, k, n[2], nrecv, nall;
+
+    dom->nghost = 0;
+    for (d=0; d<3; ++d) {
+        if (dom->dims[d] == 1) continue;
+
+        n[0] = n[1] = 0;
+        nall = dom->nlocal + dom->nghost;
+        for (i=0; i<nall; ++i) {
+            FPTYPE x = wrap(dom->r[d][i], dom->box);
+
+            if (x >= dom->lo[d] + dom->rghost && x < dom->hi[d] - dom->rghost) continue;
+            for (k=0; k<3; ++k) rec[k] = dom->r[k][i];
+            if (x < dom->lo[d] + dom->rghost) dom_pack( dom, 0, &n[0], rec, sizeof(rec) );
+            if (x >= dom->hi[d] - dom->rghost) dom_pack( dom, 1, &n[1], rec, sizeof(rec) );
+        }
+
+        nrecv = dom_exchange( dom, d, n[0], n[1], sizeof(rec) );
+        dom_reserve( dom, nall + nrecv );
+        for (i=0; i<nrecv; ++i) {
+            memcpy( rec, dom->rbuf + i * sizeof(rec), sizeof(rec) );
+            for (k=0; k<3; ++k) dom->r[k][nall + i] = rec[k];
+        }
+        dom->nghost += nrecv;
+    }
+}
+
+/* positions of the own atoms and ghosts and velocities of the own atoms to the device */
+static cl_int dom_upload(mpi_dom_t *dom)
+{
+    cl_mdsys_t *sys = &dom->sys;
+    size_t size = ( dom->nlocal + dom->nghost ) * sizeof(FPTYPE);
+    size_t own = dom->nlocal * sizeof(FPTYPE);
+    cl_int status = CL_SUCCESS;
+
+    sys->natoms = dom->nlocal + dom->nghost;
+    dom->force->ilast = dom->nlocal;
+    if (size > 0) {
+        status |= clProfEnqueueWriteBuffer( dom->queue, sys->rx, CL_FALSE, 0, size, dom->r[0], 0, NULL, NULL );
+        status |= clProfEnqueueWriteBuffer( dom->queue, sys->ry, CL_FALSE, 0, size, dom->r[1], 0, NULL, NULL );
+        status |= clProfEnqueueWriteBuffer( dom->queue, sys->rz, CL_FALSE, 0, size, dom->r[2], 0, NULL, NULL );
+    }
+    if (own > 0) {
+        status |= clProfEnqueueWriteBuffer( dom->queue, sys->vx, CL_FALSE, 0, own, dom->v[0], 0, NULL, NULL );
+        status |= clProfEnqueueWriteBuffer( dom->queue, sys->vy, CL_FALSE, 0, own, dom->v[1], 0, NULL, NULL );
+        status |= clProfEnqueueWriteBuffer( dom->queue, sys->vz, CL_FALSE, 0, own, dom->v[2], 0, NULL, NULL );
+    }
+    return status;
+}
+
+/* positions and velocities of the own atoms from the device */
+static cl_int dom_download(mpi_dom_t *dom)
+{
+    cl_mdsys_t *sys = &dom->sys;
+    size_t own = dom->nlocal * sizeof(FPTYPE);
+    cl_int status = CL_SUCCESS;
+
+    if (own == 0) return CL_SUCCESS;
+    status |= clProfEnqueueReadBuffer( dom->queue, sys->rx, CL_FALSE, 0, own, dom->r[0], 0, NULL, NULL );
+    status |= clProfEnqueueReadBuffer( dom->queue, sys->ry, CL_FALSE, 0, own, dom->r[1], 0, NULL, NULL );
+    status |= clProfEnqueueReadBuffer( dom->queue, sys->rz, CL_FALSE, 0, own, dom->r[2], 0, NULL, NULL );
+    status |= clProfEnqueueReadBuffer( dom->queue, sys->vx, CL_FALSE, 0, own, dom->v[0], 0, NULL, NULL );
+    status |= clProfEnqueueReadBuffer( dom->queue, sys->vy, CL_FALSE, 0, own, dom->v[1], 0, NULL, NULL );
+    status |= clProfEnqueueReadBuffer( dom->queue, sys->vz, CL_TRUE, 0, own, dom->v[2], 0, NULL, NULL );
+    return status;
+}
+
+/* potential and kinetic energy of the own atoms, summed over all ranks */
+static void dom_energy(mpi_dom_t *dom, mdsys_t *sys)
+{
+    FPTYPE energy[2], sum[2];
+    cl_int status;
+
+    status = reduce_sum( dom->queue, dom->reduce, dom->force->epot, dom->nthreads, dom->energy, 0, NULL );
+    status |= clSetMultKernelArgs( dom->kernel_ekin, 0, 5, KArg(dom->sys.vx), KArg(dom->sys.vy), KArg(dom->sys.vz),
+                                   KArg(dom->nlocal), KArg(dom->ekin) );
+    status |= clProfEnqueueNDRangeKernel( dom->queue, dom->kernel_ekin, 1, NULL, dom->global, dom->local, 0, NULL, NULL );
+    status |= reduce_sum( dom->queue, dom->reduce, dom->ekin, dom->nthreads, dom->energy, 1, NULL );
+    status |= clProfEnqueueReadBuffer( dom->queue, dom->energy, CL_TRUE, 0, 2 * sizeof(FPTYPE), energy, 0, NULL, NULL );
+    CheckSuccess(status, 7);
+
+    MPI_Allreduce( energy, sum, 2, MPI_FPTYPE, MPI_SUM, dom->comm );
+    sys->epot = sum[0];
+    sys->ekin = sum[1] * HALF * mvsq2e * sys->mass;
+    sys->temp = TWO * sys->ekin / ( THREE * sys->natoms - THREE ) / kboltz;
+}
+
+static int cmp_atom(const void *a, const void *b)
+{
+    return ((const int *) a)[0] - ((const int *) b)[0];
+}
+
+/* file view selecting the places of the own atoms, in the order of their
+ * index, in a file of natoms records of the given type. order[2i] is the
+ * index and order[2i+1] the position of the i-th own atom. */
+static MPI_Datatype dom_view(mpi_dom_t *dom, MPI_Datatype rec)
+{
+    MPI_Datatype view;
+    int i, *disp;
+
+    disp = (int *) malloc( ( dom->nlocal + 1 ) * sizeof(int) );
+    for (i=0; i<dom->nlocal; ++i) {
+        dom->order[2*i] = dom->id[i];
+        dom->order[2*i+1] = i;
+    }
+    qsort( dom->order, dom->nlocal, 2 * sizeof(int), cmp_atom );
+    for (i=0; i<dom->nlocal; ++i) disp[i] = dom->order[2*i];
+
+    MPI_Type_create_indexed_block( dom->nlocal, 1, disp, rec, &view );
+    MPI_Type_commit( &view );
+    free(disp);
+    return view;
+}
+
+/* write the blocks x[0..n-1] of natoms values each at off, every rank
+ * its own atoms, as float or FPTYPE */
+static void dom_write_blocks(mpi_dom_t *dom, MPI_File fh, MPI_Offset off, int natoms, FPTYPE **x, int n, MPI_Datatype etype)
+{
+    MPI_Datatype view = dom_view( dom, etype );
+    MPI_Status st;
+    int esize, i, k;
+    char *buf;
+
+    MPI_Type_size( etype, &esize );
+    buf = (char *) malloc( ( dom->nlocal + 1 ) * esize );
+    for (k=0; k<n; ++k) {
+        for (i=0; i<dom->nlocal; ++i) {
+            if (etype == MPI_FLOAT) ((float *) buf)[i] = x[k][dom->order[2*i+1]];
+            else ((FPTYPE *) buf)[i] = x[k][dom->order[2*i+1]];
+        }
+        MPI_File_set_view( fh, off + (MPI_Offset) k * natoms * esize, etype, view, "native", MPI_INFO_NULL );
+        MPI_File_write_all( fh, buf, dom->nlocal, etype, &st );
+    }
+    MPI_File_set_view( fh, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL );
+    MPI_Type_free( &view );
+    free(buf);
+}
+
+/* append a trajectory frame at *off in the format of output() */
+static void dom_write_frame(mpi_dom_t *dom, MPI_File fh, MPI_Offset *off, mdsys_t *sys, int trajformat)
+{
+    MPI_Datatype line, view;
+    MPI_Status st;
+    char head[BLEN], *txt;
+    int i, len;
+
+    if (trajformat == TRAJ_NONE) return;
+    if (trajformat == TRAJ_BIN) {
+        if (dom->rank == 0) MPI_File_write_at( fh, *off, &sys->nfi, 1, MPI_INT, &st );
+        dom_write_blocks( dom, fh, *off + sizeof(int), sys->natoms, dom->r, 3, MPI_FLOAT );
+        *off += sizeof(int) + 3 * (MPI_Offset) sys->natoms * sizeof(float);
+        return;
+    }
+
+    len = snprintf( head, sizeof(head), "%d\n nfi=%d etot=%20.8f\n", sys->natoms, sys->nfi, sys->ekin+sys->epot );
+    MPI_Bcast( &len, 1, MPI_INT, 0, dom->comm );
+    if (dom->rank == 0) MPI_File_write_at( fh, *off, head, len, MPI_CHAR, &st );
+
+    txt = (char *) malloc( dom->nlocal * XYZ_LINE + 1 );
+    MPI_Type_contiguous( XYZ_LINE, MPI_CHAR, &line );
+    MPI_Type_commit( &line );
+    view = dom_view( dom, line );
+    for (i=0; i<dom->nlocal; ++i) {
+        int k = dom->order[2*i+1];
+
+        if (snprintf( txt + i * XYZ_LINE, XYZ_LINE + 1, "Ar  %20.8f %20.8f %20.8f\n",
+                      dom->r[0][k], dom->r[1][k], dom->r[2][k] ) != XYZ_LINE) {
+            fprintf( stderr, "position of atom %d too large for the xyz trajectory\n", dom->id[k] );
+            MPI_Abort( MPI_COMM_WORLD, 1 );
+        }
+    }
+    MPI_File_set_view( fh, *off + len, line, view, "native", MPI_INFO_NULL );
+    MPI_File_write_all( fh, txt, dom->nlocal, line, &st );
+    MPI_File_set_view( fh, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL );
+    *off += len + (MPI_Offset) sys->natoms * XYZ_LINE;
+
+    MPI_Type_free( &view );
+    MPI_Type_free( &line );
+    free(txt);
+}
 
-/* structure to hold the complete information 
- * about the MD system */
-struct _mdsys {
-    int natoms,nfi,nsteps;
-    FPTYPE dt, mass, epsilon, sigma, box, rcut;
-    FPTYPE ekin, epot, temp;
-    FPTYPE *rx, *ry, *rz;
-    FPTYPE *vx, *vy, *vz;
-    FPTYPE *fx, *fy, *fz;
-};
-typedef struct _mdsys mdsys_t;
-
-/* structure to hold the complete information 
- * about the MD system on a OpenCL device*/
-struct _cl_mdsys {
-    int natoms,nfi,nsteps;
-    FPTYPE dt, mass, epsilon, sigma, box, rcut;
-    FPTYPE ekin, epot, temp;
-    cl_mem rx, ry, rz;
-    cl_mem vx, vy, vz;
-    cl_mem fx, fy, fz;
-};
-typedef struct _cl_mdsys cl_mdsys_t;
+/* write a binary restart with MPI-IO, like write_restart. The arrays on
+ * the host must be up to date. */
+static int dom_write_restart(mpi_dom_t *dom, const char *file, mdsys_t *sys, int step)
+{
+    resthead_t head;
+    char tmpfile[BLEN + 4];
+    MPI_File fh;
+    MPI_Status st;
+    int ok;
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, restmagic, sizeof(restmagic));
+    head.natoms = sys->natoms;
+    head.precision = sizeof(FPTYPE);
+    head.step = step;
+    head.box = sys->box;
+
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", file);
+    if (MPI_File_open( dom->comm, tmpfile, MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL, &fh ) != MPI_SUCCESS) {
+        if (dom->rank == 0) fprintf( stderr, "cannot write restart file %s\n", tmpfile );
+        return -1;
+    }
+    MPI_File_set_size( fh, 0 );
+    if (dom->rank == 0) MPI_File_write_at( fh, 0, &head, sizeof(head), MPI_BYTE, &st );
+    dom_write_blocks( dom, fh, sizeof(head), sys->natoms, dom->r, 3, MPI_FPTYPE );
+    dom_write_blocks( dom, fh, sizeof(head) + 3 * (MPI_Offset) sys->natoms * sizeof(FPTYPE), sys->natoms, dom->v, 3, MPI_FPTYPE );
+    MPI_File_close( &fh );
+
+    ok = ( dom->rank != 0 || !rename(tmpfile, file) );
+    if (!ok) perror("cannot write restart file");
+    MPI_Bcast( &ok, 1, MPI_INT, 0, dom->comm );
+    return ok ? 0 : -1;
+}
 
-/* helper function: read a line and then return
-   the first string with whitespace stripped off */
-static int get_me_a_line(FILE *fp, char *buf)
+/* rank 0 reads the input from stdin and sends it to the others,
+ * all ranks read it from the returned stream */
+static FILE *mpi_stdin(void)
 {
-    char tmp[BLEN], *ptr;
+    char *buf = NULL;
+    size_t cap = 0;
+    long n = 0;
+    int rank;
+
+    MPI_Comm_rank( MPI_COMM_WORLD, &rank );
+    if (rank == 0) {
+        size_t m;
+
+        do {
+            buf = grow( buf, &cap, n + BLEN );
+            m = fread( buf + n, 1, BLEN, stdin );
+            n += m;
+        } while (m > 0);
+    }
+    MPI_Bcast( &n, 1, MPI_LONG, 0, MPI_COMM_WORLD );
+    if (rank != 0) buf = grow( buf, &cap, n + 1 );
+    MPI_Bcast( buf, n, MPI_CHAR, 0, MPI_COMM_WORLD );
+    return fmemopen( buf, n > 0 ? n : 1, "r" );
+}
 
-    /* read a line and cut of comments and blanks */
-    if (fgets(tmp,BLEN,fp)) {
-        int i;
+/* the ranks of a node take its devices round robin */
+static void mpi_select_device(char *type, cl_device_id *device, cl_context *context, cl_command_queue *queue)
+{
+    cl_device_id devices[MAXDEV];
+    cl_uint ndev;
+    cl_int status;
+    MPI_Comm node;
+    int local;
+
+    MPI_Comm_split_type( MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node );
+    MPI_Comm_rank( node, &local );
+    MPI_Comm_free( &node );
+
+    if (FindDevices( type, devices, MAXDEV, &ndev ) != CL_SUCCESS || devices[local % ndev] == *device) return;
+    clReleaseCommandQueue( *queue );
+    clReleaseContext( *context );
+    *device = devices[local % ndev];
+    *context = clCreateContext( NULL, 1, device, NULL, NULL, &status );
+    CheckSuccess(status, 0);
+    *queue = clCreateCommandQueue( *context, *device, 0, &status );
+    CheckSuccess(status, 0);
+}
 
-        ptr=strchr(tmp,'#');
-        if (ptr) *ptr= '\0';
-        i=strlen(tmp); --i;
-        while(isspace(tmp[i])) {
-            tmp[i]='\0';
-            --i;
+/* set up the grid of ranks and the block of this one */
+static int dom_init(mpi_dom_t *dom, mdsys_t *sys, FPTYPE rghost)
+{
+    int periods[3] = { 1, 1, 1 }, d;
+
+    MPI_Comm_size( MPI_COMM_WORLD, &dom->nranks );
+    dom->dims[0] = dom->dims[1] = dom->dims[2] = 0;
+    MPI_Dims_create( dom->nranks, 3, dom->dims );
+    MPI_Cart_create( MPI_COMM_WORLD, 3, dom->dims, periods, 0, &dom->comm );
+    MPI_Comm_rank( dom->comm, &dom->rank );
+    MPI_Cart_coords( dom->comm, dom->rank, 3, dom->coords );
+
+    dom->box = sys->box;
+    dom->rghost = rghost;
+    for (d=0; d<3; ++d) {
+        FPTYPE w = sys->box / dom->dims[d];
+
+        MPI_Cart_shift( dom->comm, d, 1, &dom->lo_rank[d], &dom->hi_rank[d] );
+        dom->lo[d] = w * dom->coords[d];
+        dom->hi[d] = ( dom->coords[d] == dom->dims[d] - 1 ) ? sys->box : w * ( dom->coords[d] + 1 );
+
+        /* ghosts only come from the next blocks, and with two blocks
+         * an atom must not be a ghost on both sides */
+        if ( ( dom->dims[d] > 2 && w < rghost ) || ( dom->dims[d] == 2 && w < 2 * rghost ) ) {
+            if (dom->rank == 0)
+                fprintf( stderr, "\nToo many ranks: blocks of %g are too thin for a ghost layer of %g.\n",
+                         (double) w, (double) rghost );
+            return -1;
         }
-        ptr=tmp;
-        while(isspace(*ptr)) {++ptr;}
-        i=strlen(ptr);
-        strcpy(buf,tmp);
-        return 0;
-    } else {
-        perror("problem reading input");
-        return -1;
     }
+
+    dom->nlocal = dom->nghost = dom->cap = 0;
+    dom->id = dom->order = NULL;
+    dom->r[0] = dom->r[1] = dom->r[2] = NULL;
+    dom->v[0] = dom->v[1] = dom->v[2] = NULL;
+    dom->sbuf[0] = dom->sbuf[1] = dom->rbuf = NULL;
+    dom->sbufcap[0] = dom->sbufcap[1] = dom->rbufcap = 0;
+    dom->sys.rx = NULL;
+    dom->sys.natoms = 0;
+    dom->sys.box = sys->box;
+
+    printf( "\nMPI decomposition: %d ranks in a %dx%dx%d grid, ghost layer %.3f\n",
+            dom->nranks, dom->dims[0], dom->dims[1], dom->dims[2], (double) rghost );
     return 0;
 }
- 
-void PrintUsageAndExit() {
-    fprintf( stderr, "\nError. Run the program as follow: ");
-    fprintf( stderr, "\n./ljmd-cl.x device [thread-number] < input ");
-    fprintf( stderr, "\ndevice = cpu | gpu \n\n" );
-    exit(1);
-}
 
-/* append data to output. */
-static void output(mdsys_t *sys, FILE *erg, FILE *traj)
+/* MD loop of the MPI build, see mpi_dom_t. The force computation is
+ * set up as in the single device mode and takes the work sizes of it. */
+static int mpi_run(mdsys_t *sys, mdopts_t *opts, int nprint, const char *restfile, const char *trajfile,
+                   const char *ergfile, cl_context context, cl_command_queue queue, cl_program program,
+                   cl_force_t *f, cl_reduce_t *r, size_t *global, size_t *local, int nthreads)
 {
-    int i;
-    
-    printf("% 8d % 20.8f % 20.8f % 20.8f % 20.8f\n", sys->nfi, sys->temp, sys->ekin, sys->epot, sys->ekin+sys->epot);
-    fprintf(erg,"% 8d % 20.8f % 20.8f % 20.8f % 20.8f\n", sys->nfi, sys->temp, sys->ekin, sys->epot, sys->ekin+sys->epot);
-    fprintf(traj,"%d\n nfi=%d etot=%20.8f\n", sys->natoms, sys->nfi, sys->ekin+sys->epot);
+    mpi_dom_t dom;
+    cl_kernel kernel_verlet_first, kernel_verlet_second;
+    FPTYPE *buffers[3];
+    FPTYPE dtmf = HALF * sys->dt / mvsq2e / sys->mass;
+    FPTYPE boxinv = 1.0 / sys->box;
+    MPI_File fh;
+    MPI_Offset off = 0;
+    MPI_Status st;
+    FILE *erg = NULL;
+    cl_int status;
+    int i, k, step0, total;
+    double t_loop;
+
+    if (dom_init( &dom, sys, sys->rcut )) return 1;
+    dom.context = context;
+    dom.queue = queue;
+    dom.force = f;
+    dom.reduce = r;
+    dom.global = global;
+    dom.local = local;
+    dom.nthreads = nthreads;
+    dom.kernel_ekin = clCreateKernel( program, "opencl_ekin", &status );
+    kernel_verlet_first = clCreateKernel( program, "opencl_verlet_first", &status );
+    kernel_verlet_second = clCreateKernel( program, "opencl_verlet_second", &status );
+    dom.ekin = clCreateBuffer( context, CL_MEM_READ_WRITE, nthreads * sizeof(FPTYPE), NULL, &status );
+    dom.energy = clCreateBuffer( context, CL_MEM_READ_WRITE, 2 * sizeof(FPTYPE), NULL, &status );
+    CheckSuccess(status, 1);
+
+    /* every rank reads the restart and keeps its own atoms */
+    for (k=0; k<3; ++k) buffers[k] = (FPTYPE *) malloc( 2 * sys->natoms * sizeof(FPTYPE) );
+    dom.sys.natoms = sys->natoms;
+    dom.sys.mass = sys->mass;
+    if (read_restart( restfile, NULL, &dom.sys, buffers, &step0 )) {
+        perror("cannot read restart file");
+        return 3;
+    }
     for (i=0; i<sys->natoms; ++i) {
-      fprintf(traj, "Ar  %20.8f %20.8f %20.8f\n", sys->rx[i], sys->ry[i], sys->rz[i]);
+        if (!dom_owns( &dom, buffers[0][i], buffers[1][i], buffers[2][i] )) continue;
+        dom_reserve( &dom, dom.nlocal + 1 );
+        for (k=0; k<3; ++k) {
+            dom.r[k][dom.nlocal] = buffers[k][i];
+            dom.v[k][dom.nlocal] = buffers[k][sys->natoms + i];
+        }
+        dom.id[dom.nlocal++] = i;
+    }
+    for (k=0; k<3; ++k) free(buffers[k]);
+    MPI_Allreduce( &dom.nlocal, &total, 1, MPI_INT, MPI_SUM, dom.comm );
+    if (total != sys->natoms) {
+        if (dom.rank == 0) fprintf( stderr, "\nThe blocks hold %d of %d atoms.\n", total, sys->natoms );
+        return 1;
     }
-}
 
+    /* initial forces and energies */
+    dom_ghosts( &dom );
+    dom_reserve( &dom, dom.nlocal + dom.nghost );
+    status = dom_upload( &dom );
+    status |= bind_force( &dom.sys, f, local );
+    status |= compute_force( queue, f, global, local, NULL );
+    CheckSuccess(status, 3);
+    sys->nfi = 0;
+    dom_energy( &dom, sys );
+
+    if (dom.rank == 0) erg = fopen( ergfile, "w" );
+    fh = MPI_FILE_NULL;
+    if ((opts->trajformat != TRAJ_NONE && MPI_File_open( dom.comm, (char *) trajfile, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                                                          MPI_INFO_NULL, &fh ) != MPI_SUCCESS)
+        || (dom.rank == 0 && !erg)) {
+        if (dom.rank == 0) fprintf( stderr, "cannot open the output files\n" );
+        return 1;
+    }
+    if (fh != MPI_FILE_NULL) MPI_File_set_size( fh, 0 );
+    if (opts->trajformat == TRAJ_BIN) {
+        float fbox = sys->box;
+
+        if (dom.rank == 0) {
+            MPI_File_write_at( fh, 0, (void *) trajmagic, sizeof(trajmagic), MPI_BYTE, &st );
+            MPI_File_write_at( fh, sizeof(trajmagic), &sys->natoms, 1, MPI_INT, &st );
+            MPI_File_write_at( fh, sizeof(trajmagic) + sizeof(int), &fbox, 1, MPI_FLOAT, &st );
+        }
+        off = sizeof(trajmagic) + sizeof(int) + sizeof(float);
+    }
 
+    printf("Starting simulation with %d atoms for %d steps.\n",sys->natoms, sys->nsteps);
+    printf("     NFI            TEMP            EKIN                 EPOT              ETOT\n");
+    if (dom.rank == 0) output_energy( sys, erg );
+    dom_write_frame( &dom, fh, &off, sys, opts->trajformat );
+
+    t_loop = second();
+
+    /**************************************************/
+    /* main MD loop */
+    for (i=1; i <= sys->nsteps; ++i) {
+        int nfi_out = ( nprint == 1 ) ? i : i + 1;
+
+        /* 2) verlet_first of the own atoms */
+        status = clSetMultKernelArgs( kernel_verlet_first, 0, 14,
+          KArg(dom.sys.fx),
+          KArg(dom.sys.fy),
+          KArg(dom.sys.fz),
+          KArg(dom.sys.rx),
+          KArg(dom.sys.ry),
+          KArg(dom.sys.rz),
+          KArg(dom.sys.vx),
+          KArg(dom.sys.vy),
+          KArg(dom.sys.vz),
+          KArg(dom.nlocal),
+          KArg(sys->dt),
+          KArg(dtmf),
+          KArg(sys->box),
+          KArg(boxinv));
+        status |= clProfEnqueueNDRangeKernel( queue, kernel_verlet_first, 1, NULL, global, local, 0, NULL, NULL );
+
+        /* atoms that left the block move to the neighbors, then the ghosts are rebuilt */
+        status |= dom_download( &dom );
+        CheckSuccess(status, 2);
+        dom_migrate( &dom );
+        dom_ghosts( &dom );
+        dom_reserve( &dom, dom.nlocal + dom.nghost );
+        status = dom_upload( &dom );
+
+        /* 3) force on the own atoms, the number of atoms changes at every step */
+        status |= bind_force( &dom.sys, f, local );
+        status |= compute_force( queue, f, global, local, NULL );
+        CheckSuccess(status, 3);
+
+        /* 4) verlet_second */
+        status = clSetMultKernelArgs( kernel_verlet_second, 0, 9,
+          KArg(dom.sys.fx),
+          KArg(dom.sys.fy),
+          KArg(dom.sys.fz),
+          KArg(dom.sys.vx),
+          KArg(dom.sys.vy),
+          KArg(dom.sys.vz),
+          KArg(dom.nlocal),
+          KArg(sys->dt),
+          KArg(dtmf));
+        status |= clProfEnqueueNDRangeKernel( queue, kernel_verlet_second, 1, NULL, global, local, 0, NULL, NULL );
+        CheckSuccess(status, 4);
+
+        /* 1) output with the numbering of the single device loop: the
+         * energies and positions of this step are printed as the next
+         * multiple of nprint */
+        if ((i % nprint) == nprint-1 && nfi_out <= sys->nsteps) {
+            if (USES_CELLS(f->mode)) check_cells( queue, f );
+            sys->nfi = nfi_out;
+            dom_energy( &dom, sys );
+            if (dom.rank == 0) output_energy( sys, erg );
+            dom_write_frame( &dom, fh, &off, sys, opts->trajformat );
+        }
 
+        /* 9) restart every restfreq steps and at the end */
+        if (opts->restout[0] && ((opts->restfreq > 0 && (i % opts->restfreq) == 0) || i == sys->nsteps)) {
+            CheckSuccess( dom_download( &dom ), 9 );
+            dom_write_restart( &dom, opts->restout, sys, step0 + i );
+        }
+    }
+    /**************************************************/
 
+    if (fh != MPI_FILE_NULL) MPI_File_close( &fh );
+    printf( "\n\nTime per MD step (%d ranks) = %.3g (ms)\n", dom.nranks, 1000.0 * ( second() - t_loop ) / sys->nsteps );
+    if (dom.rank == 0) fclose( erg );
+    printf("Simulation Done.\n");
+    return 0;
+}
+#endif
 
 /* main */
 int main(int argc, char **argv) 
@@ -121,132 +2051,330 @@ int main(int argc, char **argv)
   cl_device_id device;
   cl_device_type device_type; /*to test if we are on cpu or gpu*/
   cl_context context;
-  cl_command_queue cmdQueue;
+  cl_command_queue cmdQueue, xferQueue;
 
-  FPTYPE * buffers[3];
+  FPTYPE * buffers[3], * mapped[6];
+  cl_frame_t * frames;
+  writer_t writer;
+  int cur = 0, step0, checkpoint;
   cl_mdsys_t cl_sys;
+  cl_force_t cl_force;
+  cl_multi_t multi;
+  cl_device_id devices[MAXDEV];
+  cl_uint ndevices = 1;
   cl_int status;
+  char *devtype;
+  int hybrid;
 
-  int nprint, i, nthreads = 0;
-  char restfile[BLEN], trajfile[BLEN], ergfile[BLEN], line[BLEN];
-  FILE *fp,*traj,*erg;
+  int nprint, i, nthreads = 0, first_opt;
+  char restfile[BLEN], trajfile[BLEN], ergfile[BLEN];
+  FILE *traj,*erg,*in = stdin;
   mdsys_t sys;
-
+  mdopts_t opts = default_opts;
+  int pending = 0;
 
 /* Start profiling */
 
 #ifdef __PROFILING
   
-  double t1, t2;
+  double t1, t2, t_loop;
 
   t1 = second();
 
 #endif
 
+#ifdef _USE_MPI
+  /* only rank 0 prints */
+  MPI_Init( &argc, &argv );
+  MPI_Comm_rank( MPI_COMM_WORLD, &i );
+  if( i > 0 && !freopen( "/dev/null", "w", stdout ) ) return 1;
+#endif
+
   /* handling the command line arguments */
-  switch (argc) {
-      case 2: /* only the cpu/gpu argument was passed, setting default nthreads */
-	      if( !strcmp( argv[1], "cpu" ) ) nthreads = 16;
-	      else nthreads = 1024;
-	      break;
-      case 3: /* both the device type (cpu/gpu) and the number of threads were passed */
-	      nthreads = strtol(argv[2],NULL,10);
-	      if( nthreads<0 ) {
-		      fprintf( stderr, "\n. The number of threads must be more than 1.\n");
-		      PrintUsageAndExit();
-	      }
-	      break;
-      default:
+  if( argc < 2 ) PrintUsageAndExit();
+
+  /* the hybrid mode integrates on the gpu and adds a cpu device */
+  hybrid = !strcmp( argv[1], "hybrid" );
+  devtype = hybrid ? "gpu" : argv[1];
+
+  if( argc > 2 && !strchr( argv[2], '=' ) ) {
+      /* both the device type (cpu/gpu) and the number of threads were passed */
+      nthreads = strtol(argv[2],NULL,10);
+      if( nthreads<1 ) {
+	      fprintf( stderr, "\n. The number of threads must be more than 1.\n");
 	      PrintUsageAndExit();
-	      break;
+      }
+      first_opt = 3;
+  } else {
+      /* only the cpu/gpu argument was passed, nthreads is set below */
+      first_opt = 2;
   }
+
+  /* the remaining arguments must be keyword=value pairs */
+  for( i = first_opt; i < argc; i++ )
+      if( !strchr( argv[i], '=' ) ) PrintUsageAndExit();
   
   /* Initialize the OpenCL environment */
-  if( InitOpenCLEnvironment( argv[1], &device, &context, &cmdQueue ) != CL_SUCCESS ){
+  if( InitOpenCLEnvironment( devtype, &device, &context, &cmdQueue ) != CL_SUCCESS ){
     fprintf( stderr, "Program Error! OpenCL Environment was not initialized correctly.\n" );
     return 4;
   }
 
+#ifdef _USE_MPI
+  mpi_select_device( devtype, &device, &context, &cmdQueue );
+  in = mpi_stdin();
+#endif
+
   /* read input file */
-  if(get_me_a_line(stdin,line)) return 1;
-  sys.natoms=atoi(line);
-  if(get_me_a_line(stdin,line)) return 1;
-  sys.mass=atof(line);
-  if(get_me_a_line(stdin,line)) return 1;
-  sys.epsilon=atof(line);
-  if(get_me_a_line(stdin,line)) return 1;
-  sys.sigma=atof(line);
-  if(get_me_a_line(stdin,line)) return 1;
-  sys.rcut=atof(line);
-  if(get_me_a_line(stdin,line)) return 1;
-  sys.box=atof(line);
-  if(get_me_a_line(stdin,restfile)) return 1;
-  if(get_me_a_line(stdin,trajfile)) return 1;
-  if(get_me_a_line(stdin,ergfile)) return 1;
-  if(get_me_a_line(stdin,line)) return 1;
-  sys.nsteps=atoi(line);
-  if(get_me_a_line(stdin,line)) return 1;
-  sys.dt=atof(line);
-  if(get_me_a_line(stdin,line)) return 1;
-  nprint=atoi(line);
-  
+  if(read_input(in,&sys,restfile,trajfile,ergfile,&nprint)) return 1;
 
-  
-  /* allocate memory */
+  /* optional settings: input file first, then the command line */
+  if(read_options(in,&opts)) return 4;
+  for( i = first_opt; i < argc; i++ ) {
+      char key[BLEN];
+      const char * val = strchr( argv[i], '=' );
+
+      snprintf( key, sizeof(key), "%.*s", (int) (val - argv[i]), argv[i] );
+      if( set_option( &opts, key, val + 1 ) ) return 4;
+  }
+
+#ifdef _USE_MPI
+  /* the ghosts are rebuilt at every step in the MPI build, which
+   * rules out the neighbor lists */
+  if( USES_NLIST(opts.forcemode) || opts.ndevices != 1 || hybrid || opts.replicas > 1 || opts.ensemble[0]
+      || opts.reorder > 0 || opts.layout != LAYOUT_SOA || opts.respa > 1 || opts.thermostat != THERMO_NONE
+      || opts.rdf > 0 || opts.msd > 0 ) {
+    fprintf( stderr, "\nThe MPI build supports force = brute | cell | tiled with one device per rank,\n"
+             "no ensembles, no reordering, layout=soa, respa=1, no thermostat and no rdf or msd.\n" );
+    MPI_Abort( MPI_COMM_WORLD, 1 );
+  }
+  if( opts.integrate == INTEGRATE_FUSED ) printf( "\nThe MPI build uses integrate=split.\n" );
+  opts.tune = 0;
+#else
+  /* the ensemble mode packs all replicas on one device */
+  int ensemble = opts.replicas > 1 || opts.ensemble[0];
+  if( ensemble ) {
+    if( opts.forcemode != FORCE_BRUTE || opts.ndevices != 1 || hybrid || opts.restout[0] || opts.reorder > 0
+        || opts.layout != LAYOUT_SOA || opts.respa > 1 || opts.table > 0 || opts.potential != POT_LJ
+        || opts.thermostat != THERMO_NONE ) {
+      fprintf( stderr, "\nThe ensemble mode supports force = brute on one device, no restout, no reorder,\n"
+               "layout=soa, respa=1, the analytic potential and no thermostat.\n" );
+      return 4;
+    }
+    if( opts.integrate == INTEGRATE_FUSED ) printf( "\nThe ensemble mode uses integrate=split.\n" );
+    opts.tune = 0;
+  }
+
+  /* the packed layout has the all-pairs force kernels on one device */
+  if( opts.layout == LAYOUT_VEC4 ) {
+    if( !force_kernels4[opts.forcemode] || opts.ndevices != 1 || hybrid || opts.reorder > 0 ) {
+      fprintf( stderr, "\nThe vec4 layout supports force = brute | tiled on one device and no reorder.\n" );
+      return 4;
+    }
+    opts.zerocopy = 0;
+  }
+
+  /* r-RESPA: the inner force exists for the kernels of the same
+   * signature (brute, cell, nlist) on one device */
+  if( opts.respa > 1 ) {
+    if( !force_kernels_inner[opts.forcemode] || opts.ndevices != 1 || hybrid || opts.reorder > 0
+        || opts.layout != LAYOUT_SOA ) {
+      fprintf( stderr, "\nThe respa integrator supports force = brute | cell | nlist on one device,\n"
+               "no reorder and layout=soa.\n" );
+      return 4;
+    }
+    if( opts.rinner <= 0.0 ) opts.rinner = RESPA_RINNER * sys.rcut;
+    if( opts.rswitch <= 0.0 ) opts.rswitch = RESPA_RSWITCH * sys.rcut;
+    if( opts.rinner > sys.rcut || opts.rswitch >= opts.rinner ) {
+      fprintf( stderr, "\nThe inner cutoff must be at most rcut and larger than rswitch.\n" );
+      return 4;
+    }
+    if( opts.integrate == INTEGRATE_FUSED ) printf( "\nThe respa integrator uses integrate=split.\n" );
+    opts.integrate = INTEGRATE_SPLIT;
+  }
+
+  /* the thermostats act on the velocities after the second half kick */
+  if( opts.thermostat != THERMO_NONE ) {
+    if( opts.layout != LAYOUT_SOA ) {
+      fprintf( stderr, "\nThe thermostats need layout=soa.\n" );
+      return 4;
+    }
+    if( opts.integrate == INTEGRATE_FUSED ) printf( "\nThe thermostats use integrate=split.\n" );
+    opts.integrate = INTEGRATE_SPLIT;
+  }
+
+  /* the analysis samples the positions of one device, the g(r) within
+   * the cell or neighbor list of the force kernel, the MSD follows
+   * the atoms and so cannot have them reordered */
+  if( opts.rdf > 0 || opts.msd > 0 ) {
+    FPTYPE rdfmax = opts.rdfmax > 0.0 ? opts.rdfmax : sys.rcut;
+
+    if( ensemble || opts.ndevices != 1 || hybrid || opts.layout != LAYOUT_SOA || (opts.msd > 0 && opts.reorder > 0) ) {
+      fprintf( stderr, "\nThe rdf and msd analysis needs one device, no ensembles, layout=soa\n"
+               "and for the msd no reorder.\n" );
+      return 4;
+    }
+    if( opts.rdf > 0 && ( USES_CELLS(opts.forcemode) ? rdfmax > sys.rcut : rdfmax > HALF * sys.box ) ) {
+      fprintf( stderr, "\nrdfmax must be at most %s.\n", USES_CELLS(opts.forcemode) ? "rcut" : "half the box" );
+      return 4;
+    }
+  }
+#endif
+
+  /* the analytic kernels have the plain lj potential only */
+  if( opts.potential != POT_LJ && opts.table == 0 ) opts.table = DEFAULT_TABLE;
+  if( opts.table > 0 ) {
+    if( !force_kernels_table[opts.forcemode] || opts.layout != LAYOUT_SOA ) {
+      fprintf( stderr, "\nThe tabulated potential supports force = brute | cell | nlist and layout=soa.\n" );
+      return 4;
+    }
+    if( opts.rswitch <= 0.0 ) opts.rswitch = RESPA_RSWITCH * sys.rcut;
+    if( opts.potential == POT_FSWITCH && opts.rswitch >= sys.rcut - TABLE_RMIN * sys.sigma ) {
+      fprintf( stderr, "\nThe switching region of potential=fswitch must be narrower than rcut - %g sigma.\n", TABLE_RMIN );
+      return 4;
+    }
+  }
+
+  /* initial configuration from the lattice generator */
+  fcc_t fcc;
+  int generate = parse_fcc( restfile, sys.natoms, sys.box, &fcc );
+  if( generate < 0 ) return 4;
+  if( generate )
+    printf( "\nGenerated fcc lattice: %d atoms on %d^3 cells of %.4f A (%d sites) at %g K, seed %u\n",
+            sys.natoms, fcc.ncell, (double) fcc.a, 4 * fcc.ncell * fcc.ncell * fcc.ncell, (double) fcc.temp, (unsigned) fcc.seed );
+
+  /* further devices of the same type for the multi-device mode */
+  devices[0] = device;
+  if( opts.ndevices != 1 ) {
+    if( FindDevices( devtype, devices, MAXDEV, &ndevices ) != CL_SUCCESS || devices[0] != device ) ndevices = 1;
+    if( opts.ndevices > ndevices )
+      fprintf( stderr, "\nOnly %d %s device(s) available, using all of them.\n", ndevices, devtype );
+    else if( opts.ndevices > 0 ) ndevices = opts.ndevices;
+  }
+  if( hybrid ) {
+    cl_uint ncpu;
+
+    if( ndevices == MAXDEV || FindDevices( "cpu", devices + ndevices, 1, &ncpu ) != CL_SUCCESS ) {
+      fprintf( stderr, "\nNo cpu device found for the hybrid mode.\n" );
+      return 4;
+    }
+    ndevices++;
+  }
+  if( ndevices > 1 && opts.forcemode == FORCE_NEWTON ) {
+    /* the half list adds forces to atoms of the other devices */
+    fprintf( stderr, "\nThe newton force kernel cannot be used on several devices.\n" );
+    return 4;
+  }
+
+  /* with profiling both queues record the device time of each command,
+   * with several devices the force kernels are always timed */
+  cl_command_queue_properties qprops = 0;
+  if( opts.profile[0] || ndevices > 1 ) {
+    qprops = CL_QUEUE_PROFILING_ENABLE;
+    clReleaseCommandQueue( cmdQueue );
+    cmdQueue = clCreateCommandQueue( context, device, qprops, &status );
+    CheckSuccess(status, 0);
+    if( opts.profile[0] ) ProfileEnable( 1 );
+  }
+
+  /* second queue for the trajectory downloads */
+  xferQueue = clCreateCommandQueue( context, device, qprops, &status );
+  CheckSuccess(status, 0);
+
+#ifndef _USE_MPI
+  /* allocate memory, the MPI build allocates the atoms of each rank in mpi_run */
   cl_sys.natoms = sys.natoms;
-  cl_sys.rx = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
-  cl_sys.ry = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
-  cl_sys.rz = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
-  cl_sys.vx = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
-  cl_sys.vy = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
-  cl_sys.vz = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
-  cl_sys.fx = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
-  cl_sys.fy = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
-  cl_sys.fz = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+  cl_sys.box = sys.box;
+  cl_sys.mass = sys.mass;
+  cl_sys.zerocopy = opts.zerocopy == ZEROCOPY_AUTO ? host_unified( device ) : opts.zerocopy;
+  cl_sys.perm = NULL;
+  cl_sys.layout = opts.layout;
+  cl_sys.r4 = cl_sys.v4 = cl_sys.f4 = NULL;
+  if( cl_sys.layout == LAYOUT_VEC4 ) {
+    cl_sys.r4 = clCreateBuffer( context, CL_MEM_READ_WRITE, 4 * cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+    cl_sys.v4 = clCreateBuffer( context, CL_MEM_READ_WRITE, 4 * cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+    cl_sys.f4 = clCreateBuffer( context, CL_MEM_READ_WRITE, 4 * cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+    cl_sys.rx = cl_sys.ry = cl_sys.rz = NULL;
+    cl_sys.vx = cl_sys.vy = cl_sys.vz = NULL;
+    cl_sys.fx = cl_sys.fy = cl_sys.fz = NULL;
+  } else {
+    cl_sys.rx = clCreateBuffer( context, atom_mem_flags(cl_sys.zerocopy), cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+    cl_sys.ry = clCreateBuffer( context, atom_mem_flags(cl_sys.zerocopy), cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+    cl_sys.rz = clCreateBuffer( context, atom_mem_flags(cl_sys.zerocopy), cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+    cl_sys.vx = clCreateBuffer( context, atom_mem_flags(cl_sys.zerocopy), cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+    cl_sys.vy = clCreateBuffer( context, atom_mem_flags(cl_sys.zerocopy), cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+    cl_sys.vz = clCreateBuffer( context, atom_mem_flags(cl_sys.zerocopy), cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+    cl_sys.fx = clCreateBuffer( context, atom_mem_flags(cl_sys.zerocopy), cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+    cl_sys.fy = clCreateBuffer( context, atom_mem_flags(cl_sys.zerocopy), cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+    cl_sys.fz = clCreateBuffer( context, atom_mem_flags(cl_sys.zerocopy), cl_sys.natoms * sizeof(FPTYPE), NULL, &status );
+  }
   
   buffers[0] = (FPTYPE *) malloc( 2 * cl_sys.natoms * sizeof(FPTYPE) );
   buffers[1] = (FPTYPE *) malloc( 2 * cl_sys.natoms * sizeof(FPTYPE) );
   buffers[2] = (FPTYPE *) malloc( 2 * cl_sys.natoms * sizeof(FPTYPE) );
   
-  /* read restart */
-  fp = fopen( restfile, "r" );
-  if( fp ) {
-    for( i = 0; i < 2 * cl_sys.natoms; ++i ){
-#ifdef _USE_FLOAT
-      fscanf( fp, "%f%f%f", buffers[0] + i, buffers[1] + i, buffers[2] + i);
-#else
-      fscanf( fp, "%lf%lf%lf", buffers[0] + i, buffers[1] + i, buffers[2] + i);
-#endif
-    }
-    
-    status = clEnqueueWriteBuffer( cmdQueue, cl_sys.rx, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[0], 0, NULL, NULL ); 
-    status |= clEnqueueWriteBuffer( cmdQueue, cl_sys.ry, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[1], 0, NULL, NULL ); 
-    status |= clEnqueueWriteBuffer( cmdQueue, cl_sys.rz, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[2], 0, NULL, NULL ); 
-    
-    status |= clEnqueueWriteBuffer( cmdQueue, cl_sys.vx, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[0] + cl_sys.natoms, 0, NULL, NULL ); 
-    status |= clEnqueueWriteBuffer( cmdQueue, cl_sys.vy, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[1] + cl_sys.natoms, 0, NULL, NULL ); 
-    status |= clEnqueueWriteBuffer( cmdQueue, cl_sys.vz, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[2] + cl_sys.natoms, 0, NULL, NULL ); 
-    
-    fclose(fp);
-
-  } else {
+  /* read restart, text or binary. A generated lattice of the soa layout
+   * is set up on the device once the program is built. */
+  step0 = 0;
+  if( !( generate && opts.layout == LAYOUT_SOA ) && read_restart( restfile, cmdQueue, &cl_sys, buffers, &step0 ) ) {
     perror("cannot read restart file");
     return 3;
   }
+#endif
   
   /* initialize forces and energies.*/
   sys.nfi=0;
   
-  size_t globalWorkSize[1];
+  /* work sizes: with a given work-group size the global size
+   * must be a multiple of it, otherwise OpenCL picks one */
+  size_t globalWorkSize[1], localWorkSize[1], * localSize = NULL;
+  size_t max_wgsize;
+  char tunekey[3*BLEN];
+  int tuning = 0, user_wgsize = opts.wgsize;
+
+  if( nthreads == 0 && opts.tune ) {
+    /* take the work sizes from the autotuner cache, or find them once
+     * the force computation is set up. Until then the buffers are
+     * allocated for the largest candidate. */
+    size_t global, local;
+
+    tune_key( device, sys.natoms, opts.forcemode, opts.layout, tunekey, sizeof(tunekey) );
+    if( tune_lookup( opts.tunecache, tunekey, &global, &local )
+        && ( opts.wgsize <= 0 || local == opts.wgsize ) ) {
+      nthreads = global;
+      opts.wgsize = local;
+    } else {
+      nthreads = tune_maxglobal( device, sys.natoms );
+      tuning = 1;
+    }
+  } else if( nthreads == 0 ) {
+    /* the former defaults */
+    if( !strcmp( devtype, "cpu" ) ) nthreads = 16;
+    else nthreads = 1024;
+  }
+
+  if( opts.wgsize <= 0 && opts.forcemode == FORCE_TILED ) opts.wgsize = DEFAULT_WGSIZE;
+  if( opts.wgsize > 0 ) {
+    clGetDeviceInfo( device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_wgsize), &max_wgsize, NULL );
+    if( opts.wgsize > max_wgsize ) {
+      fprintf( stderr, "\nThe work-group size %d exceeds the device maximum of %ld.\n", opts.wgsize, max_wgsize );
+      return 4;
+    }
+    nthreads = ( ( nthreads + opts.wgsize - 1 ) / opts.wgsize ) * opts.wgsize;
+    localWorkSize[0] = opts.wgsize;
+    localSize = localWorkSize;
+  }
   globalWorkSize[0] = nthreads;
   
   const char * sourcecode =
   #include <opencl_kernels_as_string.h>
   ;
 
-  cl_program program = clCreateProgramWithSource( context, 1, (const char **) &sourcecode, NULL, &status );
-  
-  status |= clBuildProgram( program, 0, NULL, kernelflags, NULL, NULL );
+  /* kernel build options, the autotuner still changes the work-group size */
+  char buildflags[4*BLEN];
+  kernel_build_flags( buildflags, sizeof(buildflags), &sys, &opts, ( localSize && !tuning ) ? opts.wgsize : 0 );
+
+  cl_program program = BuildProgramCached( context, device, sourcecode, buildflags, progcache_dir( &opts ), &status );
   
 #ifdef __DEBUG
   size_t log_size;
@@ -255,104 +2383,120 @@ int main(int argc, char **argv)
   fprintf( stderr, "\nLog: \n\n %s", log ); 
 #endif
   
-  cl_kernel kernel_force = clCreateKernel( program, "opencl_force", &status );
-  cl_kernel kernel_ekin = clCreateKernel( program, "opencl_ekin", &status );
-  cl_kernel kernel_verlet_first = clCreateKernel( program, "opencl_verlet_first", &status );
-  cl_kernel kernel_verlet_second = clCreateKernel( program, "opencl_verlet_second", &status );
-  cl_kernel kernel_azzero = clCreateKernel( program, "opencl_azzero", &status );
+  /* the packed layout has its own integration kernels */
+  int vec4 = opts.layout == LAYOUT_VEC4;
+  cl_kernel kernel_ekin = clCreateKernel( program, vec4 ? "opencl_ekin4" : "opencl_ekin", &status );
+  cl_kernel kernel_verlet_first = clCreateKernel( program, vec4 ? "opencl_verlet_first4" : "opencl_verlet_first", &status );
+  cl_kernel kernel_verlet_second = clCreateKernel( program, vec4 ? "opencl_verlet_second4" : "opencl_verlet_second", &status );
+  cl_kernel kernel_verlet_fused = clCreateKernel( program, vec4 ? "opencl_verlet_fused4" : "opencl_verlet_fused", &status );
   
-  FPTYPE * tmp_epot;
-  cl_mem epot_buffer;
-  tmp_epot = (FPTYPE *) malloc( nthreads * sizeof(FPTYPE) );
-  epot_buffer = clCreateBuffer( context, CL_MEM_READ_WRITE, nthreads * sizeof(FPTYPE), NULL, &status );
+  /* per-thread partial energies and their sums, energy[0] is the
+   * potential and energy[1] the kinetic energy. Frame k keeps its
+   * sums at energy[2k] and energy[2k+1] on the device. With several
+   * devices epot_buffer has an extra slot for the others (see cl_multi_t). */
+  cl_mem epot_buffer, ekin_buffer, energy_buffer;
+  FPTYPE energy[2];
+  cl_reduce_t cl_reduce;
+  epot_buffer = clCreateBuffer( context, CL_MEM_READ_WRITE, ( nthreads + 1 ) * sizeof(FPTYPE), NULL, &status );
+  ekin_buffer = clCreateBuffer( context, CL_MEM_READ_WRITE, nthreads * sizeof(FPTYPE), NULL, &status );
+  energy_buffer = clCreateBuffer( context, CL_MEM_READ_WRITE, 2 * opts.nframes * sizeof(FPTYPE), NULL, &status );
+  status |= init_reduce( context, device, program, &cl_reduce, nthreads + 1 );
+  CheckSuccess(status, 1);
+
+#ifndef _USE_MPI
+  if( generate && opts.layout == LAYOUT_SOA ) {
+    status = fcc_device( context, cmdQueue, program, &fcc, &cl_sys, globalWorkSize, localSize );
+    CheckSuccess(status, 1);
+  }
+#endif
   
   /* precompute some constants */
-  FPTYPE c12 = 4.0 * sys.epsilon * pow( sys.sigma, 12.0);
-  FPTYPE c6  = 4.0 * sys.epsilon * pow( sys.sigma, 6.0);
-  FPTYPE rcsq = sys.rcut * sys.rcut;
-  FPTYPE boxby2 = HALF * sys.box;  
+  FPTYPE boxinv = 1.0 / sys.box;
   FPTYPE dtmf = HALF * sys.dt / mvsq2e / sys.mass;
   sys.epot = ZERO;
   sys.ekin = ZERO;
 
-  /* Azzero force buffer */
-  status = clSetMultKernelArgs( kernel_azzero, 0, 4, KArg(cl_sys.fx), KArg(cl_sys.fy), KArg(cl_sys.fz), KArg(cl_sys.natoms));
-
-  status = clEnqueueNDRangeKernel( cmdQueue, kernel_azzero, 1, NULL, globalWorkSize, NULL, 0, NULL, NULL );
-
-  status |= clSetMultKernelArgs( kernel_force, 0, 13,
-	KArg(cl_sys.fx),
-	KArg(cl_sys.fy),
-	KArg(cl_sys.fz),
-	KArg(cl_sys.rx),
-	KArg(cl_sys.ry),
-	KArg(cl_sys.rz),
-	KArg(cl_sys.natoms),
-	KArg(epot_buffer),
-	KArg(c12),
-	KArg(c6),
-	KArg(rcsq),
-	KArg(boxby2),
-	KArg(sys.box));
-  
-  status = clEnqueueNDRangeKernel( cmdQueue, kernel_force, 1, NULL, globalWorkSize, NULL, 0, NULL, NULL );
-  
-  status |= clEnqueueReadBuffer( cmdQueue, epot_buffer, CL_TRUE, 0, nthreads * sizeof(FPTYPE), tmp_epot, 0, NULL, NULL );     
-  
-  for( i = 0; i < nthreads; i++) sys.epot += tmp_epot[i];
-  
-  FPTYPE * tmp_ekin;
-  cl_mem ekin_buffer;
-  tmp_ekin = (FPTYPE *) malloc( nthreads * sizeof(FPTYPE) );
-  ekin_buffer = clCreateBuffer( context, CL_MEM_READ_WRITE, nthreads * sizeof(FPTYPE), NULL, &status );
-  
-  status |= clSetMultKernelArgs( kernel_ekin, 0, 5, KArg(cl_sys.vx), KArg(cl_sys.vy), KArg(cl_sys.vz),
-    KArg(cl_sys.natoms), KArg(ekin_buffer));
-  
-  status = clEnqueueNDRangeKernel( cmdQueue, kernel_ekin, 1, NULL, globalWorkSize, NULL, 0, NULL, NULL );
-    
-  status |= clEnqueueReadBuffer( cmdQueue, ekin_buffer, CL_TRUE, 0, nthreads * sizeof(FPTYPE), tmp_ekin, 0, NULL, NULL );     
-
-  for( i = 0; i < nthreads; i++) sys.ekin += tmp_ekin[i];
-  sys.ekin *= HALF * mvsq2e * sys.mass;
-  sys.temp  = TWO * sys.ekin / ( THREE * sys.natoms - THREE ) / kboltz;
-
-  erg=fopen(ergfile,"w");
-  traj=fopen(trajfile,"w");
+  /* set up the force computation */
+  if( init_force( context, cmdQueue, program, &cl_force, &sys, &opts, epot_buffer ) != CL_SUCCESS ) return 4;
+  if( opts.table > 0 ) table_report( &sys, &opts );
 
-  printf("Starting simulation with %d atoms for %d steps.\n",sys.natoms, sys.nsteps);
-  printf("     NFI            TEMP            EKIN                 EPOT              ETOT\n");
-  
-  /* download data on host */
-  status = clEnqueueReadBuffer( cmdQueue, cl_sys.rx, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[0], 0, NULL, NULL ); 
-  status |= clEnqueueReadBuffer( cmdQueue, cl_sys.ry, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[1], 0, NULL, NULL ); 
-  status |= clEnqueueReadBuffer( cmdQueue, cl_sys.rz, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[2], 0, NULL, NULL ); 
-  
-  sys.rx = buffers[0];
-  sys.ry = buffers[1];
-  sys.rz = buffers[2];
-  
-  output(&sys, erg, traj);
+#ifdef _USE_MPI
+  status = mpi_run( &sys, &opts, nprint, restfile, trajfile, ergfile, context, cmdQueue, program,
+                    &cl_force, &cl_reduce, globalWorkSize, localSize, nthreads );
+  if( opts.profile[0] ) ProfileReport( stdout );
+  if( status ) MPI_Abort( MPI_COMM_WORLD, status );
+  MPI_Finalize();
+  return 0;
+#else
+  if( ensemble ) {
+    status = ens_run( &sys, nprint, restfile, trajfile, ergfile, &opts, context, cmdQueue, program,
+                      &cl_reduce, localSize );
+    if( opts.profile[0] ) ProfileReport( stdout );
+    return status;
+  }
+#endif
 
-  /**************************************************/
-  /* main MD loop */
-  for(sys.nfi=1; sys.nfi <= sys.nsteps; ++sys.nfi) {
+  if( tuning ) {
+    double t = autotune( device, cmdQueue, &cl_sys, &cl_force, user_wgsize > 0 ? user_wgsize : 0,
+                         &globalWorkSize[0], &localWorkSize[0] );
 
-    /* This is a placeholder for the barrier that will be needed
-     * once the ReadBuffer & WriteBuffer calls are transformed to
-     * non blocking ones */
+    tune_store( opts.tunecache, tunekey, globalWorkSize[0], localWorkSize[0] );
+    nthreads = globalWorkSize[0];
+    localSize = localWorkSize;
+    printf( "\nAutotuned work sizes: global %d, local %d (%.3g ms per force call)\n",
+            nthreads, (int) localWorkSize[0], 1000.0 * t );
+  }
 
-    /*
-     * if ((sys.nfi % nprint) == 0) BARRIER(event[8]);
-     */
+  /* the arguments of the force kernels are bound once, as are those of
+   * the integration kernels below */
+  CheckSuccess( bind_force( &cl_sys, &cl_force, localSize ), 3 );
 
+  /* the atoms are sorted by the cells they are in every opts.reorder steps */
+  cl_reorder_t cl_reorder;
+  cl_reorder.scatter = NULL;
+  if( opts.reorder > 0 ) {
+    status = init_reorder( context, cmdQueue, program, &cl_reorder, &cl_sys, &cl_force, sys.rcut );
+    CheckSuccess(status, 1);
+  }
 
-    /* propagate system and recompute energies */
-    /* 2) verlet_first   */
-    status |= clSetMultKernelArgs( kernel_verlet_first, 0, 12,
+  /* r-RESPA: the inner force writes the short-range part of the forces
+   * to the g buffers of cl_inner_sys, the inner verlet kernels use them
+   * with dt / respa and the kick kernel the rest of the full forces */
+  int respa = opts.respa > 1;
+  cl_force_t cl_inner;
+  cl_mdsys_t cl_inner_sys = cl_sys;
+  cl_kernel kernel_kick = NULL, kernel_inner_first = NULL, kernel_inner_second = NULL;
+  if( respa ) {
+    FPTYPE dt_inner = sys.dt / opts.respa, dtmf_inner = dtmf / opts.respa;
+    cl_int err[6];
+
+    cl_inner_sys.fx = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &err[0] );
+    cl_inner_sys.fy = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &err[1] );
+    cl_inner_sys.fz = clCreateBuffer( context, CL_MEM_READ_WRITE, cl_sys.natoms * sizeof(FPTYPE), NULL, &err[2] );
+    kernel_kick = clCreateKernel( program, "opencl_respa_kick", &err[3] );
+    kernel_inner_first = clCreateKernel( program, "opencl_verlet_first", &err[4] );
+    kernel_inner_second = clCreateKernel( program, "opencl_verlet_second", &err[5] );
+    status = err[0] | err[1] | err[2] | err[3] | err[4] | err[5];
+    CheckSuccess(status, 1);
+    if( init_inner( context, cmdQueue, program, &cl_inner, &sys, &opts, epot_buffer ) != CL_SUCCESS ) return 4;
+
+    status = bind_force( &cl_inner_sys, &cl_inner, localSize );
+    status |= clSetMultKernelArgs( kernel_kick, 0, 11,
       KArg(cl_sys.fx),
       KArg(cl_sys.fy),
       KArg(cl_sys.fz),
+      KArg(cl_inner_sys.fx),
+      KArg(cl_inner_sys.fy),
+      KArg(cl_inner_sys.fz),
+      KArg(cl_sys.vx),
+      KArg(cl_sys.vy),
+      KArg(cl_sys.vz),
+      KArg(cl_sys.natoms),
+      KArg(dtmf));
+    status |= clSetMultKernelArgs( kernel_inner_first, 0, 14,
+      KArg(cl_inner_sys.fx),
+      KArg(cl_inner_sys.fy),
+      KArg(cl_inner_sys.fz),
       KArg(cl_sys.rx),
       KArg(cl_sys.ry),
       KArg(cl_sys.rz),
@@ -360,50 +2504,172 @@ int main(int argc, char **argv)
       KArg(cl_sys.vy),
       KArg(cl_sys.vz),
       KArg(cl_sys.natoms),
-      KArg(sys.dt),
-      KArg(dtmf));
-
-    CheckSuccess(status, 2);
-    status = clEnqueueNDRangeKernel( cmdQueue, kernel_verlet_first, 1, NULL, globalWorkSize, NULL, 0, NULL, NULL );
+      KArg(dt_inner),
+      KArg(dtmf_inner),
+      KArg(sys.box),
+      KArg(boxinv));
+    status |= clSetMultKernelArgs( kernel_inner_second, 0, 9,
+      KArg(cl_inner_sys.fx),
+      KArg(cl_inner_sys.fy),
+      KArg(cl_inner_sys.fz),
+      KArg(cl_sys.vx),
+      KArg(cl_sys.vy),
+      KArg(cl_sys.vz),
+      KArg(cl_sys.natoms),
+      KArg(dt_inner),
+      KArg(dtmf_inner));
+    CheckSuccess(status, 1);
+    printf( "\nr-RESPA with %d inner steps, inner cutoff %g switched off from %g.\n",
+            opts.respa, (double) opts.rinner, (double) ( opts.rinner - opts.rswitch ) );
+  }
 
-    /* 6) download position@device to position@host */
-    if ((sys.nfi % nprint) == nprint-1) {
-	status = clEnqueueReadBuffer( cmdQueue, cl_sys.rx, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[0], 0, NULL, NULL );
-	status |= clEnqueueReadBuffer( cmdQueue, cl_sys.ry, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[1], 0, NULL, NULL );
-	status |= clEnqueueReadBuffer( cmdQueue, cl_sys.rz, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[2], 0, NULL, NULL );
+  /* multi-device mode: the other devices use the work sizes of the first
+   * one and first get a share of the atoms by their number of compute
+   * units, then every opts.rebalance steps by their measured speed */
+  multi.npart = ndevices;
+  multi.nthreads = nthreads;
+  multi.ncalls = 0;
+  multi.nsplits = 0;
+  multi.part[0].device = device;
+  multi.part[0].context = context;
+  multi.part[0].queue = cmdQueue;
+  multi.part[0].sys = cl_sys;
+  multi.part[0].force = cl_force;
+  multi.part[0].event = NULL;
+  multi.part[0].ftime = multi.part[0].btime = 0.0;
+  if( multi.npart > 1 ) {
+
+    for( i = 1; i < multi.npart; i++ ) {
+      size_t dev_wgsize;
+
+      clGetDeviceInfo( devices[i], CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(dev_wgsize), &dev_wgsize, NULL );
+      if( localSize && localSize[0] > dev_wgsize ) {
+	fprintf( stderr, "\nThe work-group size %d exceeds the maximum of device %d.\n", (int) localSize[0], i );
+	return 4;
+      }
+      status = init_part( &multi.part[i], devices[i], sourcecode, buildflags, &sys, &opts, nthreads, localSize );
+      if( status != CL_SUCCESS ) {
+	fprintf( stderr, "\nCannot set up device %d: %s\n", i, CLErrString( status ) );
+	return 4;
+      }
+    }
+    for( i = 0; i < multi.npart; i++ ) {
+      cl_uint cu = 1;
 
-	CheckSuccess(status, 6);
-	sys.rx = buffers[0];
-	sys.ry = buffers[1];
-	sys.rz = buffers[2];
+      clGetDeviceInfo( multi.part[i].device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cu), &cu, NULL );
+      multi.part[i].weight = cu;
     }
+    split_atoms( &multi, sys.natoms );
+
+    multi.rx = (FPTYPE *) malloc( sys.natoms * sizeof(FPTYPE) );
+    multi.ry = (FPTYPE *) malloc( sys.natoms * sizeof(FPTYPE) );
+    multi.rz = (FPTYPE *) malloc( sys.natoms * sizeof(FPTYPE) );
+    multi.fx = (FPTYPE *) malloc( sys.natoms * sizeof(FPTYPE) );
+    multi.fy = (FPTYPE *) malloc( sys.natoms * sizeof(FPTYPE) );
+    multi.fz = (FPTYPE *) malloc( sys.natoms * sizeof(FPTYPE) );
+    printf( "\nSplitting the atoms over %d devices.\n", multi.npart );
+  }
 
-    /* 3) force */
-    status |= clSetMultKernelArgs( kernel_force, 0, 13,
+  /* Azzero force buffer, the packed force kernels write all forces */
+  if( !vec4 ) {
+    status = clSetMultKernelArgs( cl_force.azzero, 0, 4, KArg(cl_sys.fx), KArg(cl_sys.fy), KArg(cl_sys.fz), KArg(cl_sys.natoms));
+
+    status = clProfEnqueueNDRangeKernel( cmdQueue, cl_force.azzero, 1, NULL, globalWorkSize, localSize, 0, NULL, NULL );
+  }
+
+  /* the energy of the other devices is at epot_buffer[nthreads] */
+  int nepot = nthreads + ( multi.npart > 1 );
+  if( multi.npart > 1 ) status = compute_force_multi( &multi, globalWorkSize, localSize, 1 );
+  else status = compute_force( cmdQueue, &cl_force, globalWorkSize, localSize, NULL );
+  
+  status |= reduce_sum( cmdQueue, &cl_reduce, epot_buffer, nepot, energy_buffer, 0, NULL );
+
+  /* the inner forces leave the epot buffer alone */
+  if( respa ) status |= compute_force( cmdQueue, &cl_inner, globalWorkSize, localSize, NULL );
+  
+  if( vec4 )
+    status |= clSetMultKernelArgs( kernel_ekin, 0, 3, KArg(cl_sys.v4), KArg(cl_sys.natoms), KArg(ekin_buffer));
+  else
+    status |= clSetMultKernelArgs( kernel_ekin, 0, 5, KArg(cl_sys.vx), KArg(cl_sys.vy), KArg(cl_sys.vz),
+      KArg(cl_sys.natoms), KArg(ekin_buffer));
+  
+  status = clProfEnqueueNDRangeKernel( cmdQueue, kernel_ekin, 1, NULL, globalWorkSize, localSize, 0, NULL, NULL );
+    
+  status |= reduce_sum( cmdQueue, &cl_reduce, ekin_buffer, nthreads, energy_buffer, 1, NULL );
+  status |= clProfEnqueueReadBuffer( cmdQueue, energy_buffer, CL_TRUE, 0, 2 * sizeof(FPTYPE), energy, 0, NULL, NULL );     
+
+  sys.epot = energy[0];
+  sys.ekin = energy[1];
+  sys.ekin *= HALF * mvsq2e * sys.mass;
+  sys.temp  = TWO * sys.ekin / ( THREE * sys.natoms - THREE ) / kboltz;
+
+  /* thermostat, by default at the initial temperature */
+  cl_thermo_t cl_thermo;
+  if( opts.thermostat != THERMO_NONE ) {
+    if( opts.temp <= 0.0 ) opts.temp = sys.temp;
+    status = init_thermo( context, program, &cl_thermo, &cl_sys, &sys, &opts );
+    CheckSuccess(status, 1);
+    printf( "\nThermostat %s at %g K, tau %g fs\n", thermostat_names[opts.thermostat], (double) opts.temp, (double) opts.tau );
+  }
+
+  /* g(r) and MSD samples */
+  cl_analysis_t cl_analysis;
+  cl_analysis.rdffreq = cl_analysis.msdfreq = 0;
+  if( opts.rdf > 0 || opts.msd > 0 ) {
+    status = init_analysis( context, cmdQueue, program, &cl_analysis, &cl_sys, &sys, &cl_force, &opts, nthreads );
+    CheckSuccess(status, 1);
+  }
+
+  /* arguments of the integration kernels, only doekin of the fused
+   * kernel is set in the MD loop. The snapshots of the packed layout
+   * are unpacked by a kernel. */
+  int doekin_arg = 15;
+  cl_kernel kernel_snapshot = cl_reorder.scatter;
+  if( vec4 ) {
+    doekin_arg = 9;
+    kernel_snapshot = clCreateKernel( program, "opencl_unpack4", &status );
+    status |= clSetMultKernelArgs( kernel_snapshot, 0, 2, KArg(cl_sys.r4), KArg(cl_sys.natoms));
+    status |= clSetMultKernelArgs( kernel_verlet_first, 0, 8,
+      KArg(cl_sys.f4),
+      KArg(cl_sys.r4),
+      KArg(cl_sys.v4),
+      KArg(cl_sys.natoms),
+      KArg(sys.dt),
+      KArg(dtmf),
+      KArg(sys.box),
+      KArg(boxinv));
+    status |= clSetMultKernelArgs( kernel_verlet_second, 0, 5,
+      KArg(cl_sys.f4),
+      KArg(cl_sys.v4),
+      KArg(cl_sys.natoms),
+      KArg(sys.dt),
+      KArg(dtmf));
+    status |= clSetMultKernelArgs( kernel_verlet_fused, 0, 9,
+      KArg(cl_sys.f4),
+      KArg(cl_sys.r4),
+      KArg(cl_sys.v4),
+      KArg(cl_sys.natoms),
+      KArg(sys.dt),
+      KArg(dtmf),
+      KArg(sys.box),
+      KArg(boxinv),
+      KArg(ekin_buffer));
+  } else {
+    status = clSetMultKernelArgs( kernel_verlet_first, 0, 14,
       KArg(cl_sys.fx),
       KArg(cl_sys.fy),
       KArg(cl_sys.fz),
       KArg(cl_sys.rx),
       KArg(cl_sys.ry),
       KArg(cl_sys.rz),
+      KArg(cl_sys.vx),
+      KArg(cl_sys.vy),
+      KArg(cl_sys.vz),
       KArg(cl_sys.natoms),
-      KArg(epot_buffer),
-      KArg(c12),
-      KArg(c6),
-      KArg(rcsq),
-      KArg(boxby2),
-      KArg(sys.box));
-
-    CheckSuccess(status, 3);
-    status = clEnqueueNDRangeKernel( cmdQueue, kernel_force, 1, NULL, globalWorkSize, NULL, 0, NULL, NULL );
-
-    /* 7) download E_pot[i]@device and perform reduction to E_pot@host */
-    if ((sys.nfi % nprint) == nprint-1) {
-	status |= clEnqueueReadBuffer( cmdQueue, epot_buffer, CL_TRUE, 0, nthreads * sizeof(FPTYPE), tmp_epot, 0, NULL, NULL );
-	CheckSuccess(status, 7);
-    }
-
-    /* 4) verlet_second */
+      KArg(sys.dt),
+      KArg(dtmf),
+      KArg(sys.box),
+      KArg(boxinv));
     status |= clSetMultKernelArgs( kernel_verlet_second, 0, 9,
       KArg(cl_sys.fx),
       KArg(cl_sys.fy),
@@ -414,46 +2680,249 @@ int main(int argc, char **argv)
       KArg(cl_sys.natoms),
       KArg(sys.dt),
       KArg(dtmf));
+    status |= clSetMultKernelArgs( kernel_verlet_fused, 0, 15,
+      KArg(cl_sys.fx),
+      KArg(cl_sys.fy),
+      KArg(cl_sys.fz),
+      KArg(cl_sys.rx),
+      KArg(cl_sys.ry),
+      KArg(cl_sys.rz),
+      KArg(cl_sys.vx),
+      KArg(cl_sys.vy),
+      KArg(cl_sys.vz),
+      KArg(cl_sys.natoms),
+      KArg(sys.dt),
+      KArg(dtmf),
+      KArg(sys.box),
+      KArg(boxinv),
+      KArg(ekin_buffer));
+  }
+  CheckSuccess(status, 2);
+
+  erg=fopen(ergfile,"w");
+  traj = opts.trajformat == TRAJ_NONE ? NULL : fopen(trajfile,"wb");
+  int traj_natoms = opts.trajformat == TRAJ_NONE ? 0 : sys.natoms;
+
+  printf("Starting simulation with %d atoms for %d steps.\n",sys.natoms, sys.nsteps);
+  printf("     NFI            TEMP            EKIN                 EPOT              ETOT\n");
+  
+  /* download data on host, or map it in zero-copy mode */
+  if( cl_sys.zerocopy ) {
+    status = map_system( cmdQueue, &cl_sys, CL_MAP_READ, mapped );
+    sys.rx = mapped[0];
+    sys.ry = mapped[1];
+    sys.rz = mapped[2];
+  } else if( vec4 ) {
+    FPTYPE *q = (FPTYPE *) malloc( 4 * cl_sys.natoms * sizeof(FPTYPE) );
+
+    status = clProfEnqueueReadBuffer( cmdQueue, cl_sys.r4, CL_TRUE, 0, 4 * cl_sys.natoms * sizeof(FPTYPE), q, 0, NULL, NULL );
+    unpack4( q, buffers[0], buffers[1], buffers[2], cl_sys.natoms );
+    free( q );
+    sys.rx = buffers[0];
+    sys.ry = buffers[1];
+    sys.rz = buffers[2];
+  } else {
+    status = clProfEnqueueReadBuffer( cmdQueue, cl_sys.rx, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[0], 0, NULL, NULL ); 
+    status |= clProfEnqueueReadBuffer( cmdQueue, cl_sys.ry, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[1], 0, NULL, NULL ); 
+    status |= clProfEnqueueReadBuffer( cmdQueue, cl_sys.rz, CL_TRUE, 0, cl_sys.natoms * sizeof(FPTYPE), buffers[2], 0, NULL, NULL ); 
+    sys.rx = buffers[0];
+    sys.ry = buffers[1];
+    sys.rz = buffers[2];
+  }
+  CheckSuccess(status, 1);
+  
+  if (opts.trajformat == TRAJ_BIN) write_traj_header(&sys, traj);
+  output(&sys, erg, traj, opts.trajformat);
+  if( cl_sys.zerocopy ) {
+    CheckSuccess(unmap_system( cmdQueue, &cl_sys, mapped ), 1);
+    sys.rx = buffers[0];
+    sys.ry = buffers[1];
+    sys.rz = buffers[2];
+  }
+
+  frames = (cl_frame_t *) malloc( opts.nframes * sizeof(cl_frame_t) );
+  for( i = 0; i < opts.nframes; i++ ) {
+    status = init_frame( context, &frames[i], sys.natoms, cl_sys.zerocopy );
+    CheckSuccess(status, 1);
+  }
+  if( writer_start( &writer, frames, opts.nframes, &sys, erg, traj, opts.trajformat ) ) {
+    fprintf( stderr, "cannot start the writer thread\n" );
+    return 1;
+  }
+  if( !USES_CELLS(cl_force.mode) ) writer_checked( &writer, sys.nsteps );
+
+#ifdef __PROFILING
+  t_loop = second();
+#endif
+
+  /* steps queued between host checks */
+  int batch = opts.batch > 0 ? opts.batch : nprint, batch_step = 0;
+  cl_event batch_done = NULL;
+
+  /**************************************************/
+  /* main MD loop */
+  for(sys.nfi=1; sys.nfi <= sys.nsteps; ++sys.nfi) {
+
+    /* propagate system and recompute energies */
+    if (pending) {
+	/* 2+4+5) verlet_second of the previous step, its kinetic
+	 * energy if needed and verlet_first of this step */
+	int doekin = ((sys.nfi - 1) % nprint) == nprint-1;
+
+	status |= clSetKernelArg( kernel_verlet_fused, doekin_arg, sizeof(doekin), &doekin );
 
-    CheckSuccess(status, 4);
-    status = clEnqueueNDRangeKernel( cmdQueue, kernel_verlet_second, 1, NULL, globalWorkSize, NULL, 0, NULL, NULL );
+	CheckSuccess(status, 2);
+	status = clProfEnqueueNDRangeKernel( cmdQueue, kernel_verlet_fused, 1, NULL, globalWorkSize, localSize, 0, NULL, NULL );
+
+	if (doekin) {
+	    status |= reduce_sum( cmdQueue, &cl_reduce, ekin_buffer, nthreads, energy_buffer, 2 * cur + 1, &frames[cur].ready );
+	    status |= clFlush( cmdQueue );
+	    status |= frame_download( xferQueue, &frames[cur], energy_buffer, 2 * cur, traj_natoms );
+	    CheckSuccess(status, 8);
+	}
+    } else if (respa) {
+        /* 2) half kick with the outer forces and the inner steps */
+        CheckSuccess(status, 2);
+        status = respa_inner( cmdQueue, kernel_kick, kernel_inner_first, kernel_inner_second, &cl_inner,
+                              opts.respa, globalWorkSize, localSize );
+    } else {
+        /* 2) verlet_first   */
+        CheckSuccess(status, 2);
+        status = clProfEnqueueNDRangeKernel( cmdQueue, kernel_verlet_first, 1, NULL, globalWorkSize, localSize, 0, NULL, NULL );
+    }
 
+    /* 6) snapshot of position@device for the current frame */
     if ((sys.nfi % nprint) == nprint-1) {
+	/* a full ring of frames waiting for the overflow check of the
+	 * current batch is released by a blocking check */
+	if (writer_unchecked( &writer, &frames[cur] )) {
+	    for (i = 0; i < multi.npart; i++) check_cells( multi.part[i].queue, &multi.part[i].force );
+	    if (respa) check_cells( cmdQueue, &cl_inner );
+	    writer_checked( &writer, sys.nfi - 1 );
+	}
+	writer_acquire( &writer, &frames[cur] );
+	status = frame_unmap( cmdQueue, &frames[cur] );
+	if (traj_natoms) status |= frame_snapshot( cmdQueue, &cl_sys, &frames[cur], kernel_snapshot, globalWorkSize, localSize );
+	CheckSuccess(status, 6);
+    }
 
-	/* 5) ekin */
-	status |= clSetMultKernelArgs( kernel_ekin, 0, 5, KArg(cl_sys.vx), KArg(cl_sys.vy), KArg(cl_sys.vz),
-			KArg(cl_sys.natoms), KArg(ekin_buffer));
-	CheckSuccess(status, 5);
-	status = clEnqueueNDRangeKernel( cmdQueue, kernel_ekin, 1, NULL, globalWorkSize, NULL, 0, NULL, NULL );
+    /* 3) force */
+    if (multi.npart > 1) {
+	status |= compute_force_multi( &multi, globalWorkSize, localSize, (sys.nfi % nprint) == nprint-1 );
+	if (opts.rebalance > 0 && (sys.nfi % opts.rebalance) == 0) rebalance( &multi, sys.natoms );
+    } else
+	status |= compute_force( cmdQueue, &cl_force, globalWorkSize, localSize, NULL );
 
+    CheckSuccess(status, 3);
 
-	/* 8) download E_kin[i]@device and perform reduction to E_kin@host */
-	status |= clEnqueueReadBuffer( cmdQueue, ekin_buffer, CL_TRUE, 0, nthreads * sizeof(FPTYPE), tmp_ekin, 0, NULL, NULL );
-	CheckSuccess(status, 8);
+    /* 12) g(r) and MSD samples of this step */
+    if (cl_analysis.rdffreq > 0 || cl_analysis.msdfreq > 0) {
+	status |= analysis_step( cmdQueue, &cl_analysis, &cl_reduce, sys.nfi, nthreads, globalWorkSize, localSize );
+	CheckSuccess(status, 12);
     }
 
-    /* 1) write output every nprint steps */
-    if ((sys.nfi % nprint) == 0) {
+    /* 7) reduce E_pot[i]@device to the energies of the current frame */
+    if ((sys.nfi % nprint) == nprint-1) {
+	status |= reduce_sum( cmdQueue, &cl_reduce, epot_buffer, nepot, energy_buffer, 2 * cur, NULL );
+	CheckSuccess(status, 7);
+    }
+
+    /* with the fused scheme the second part of this step is done
+     * together with the first part of the next one. Not when the
+     * energies are printed at the end of this step (nprint = 1)
+     * or a restart is written. */
+    checkpoint = opts.restout[0] && opts.restfreq > 0 && (sys.nfi % opts.restfreq) == 0 && sys.nfi < sys.nsteps;
+    pending = opts.integrate == INTEGRATE_FUSED && sys.nfi < sys.nsteps && nprint > 1 && !checkpoint;
+
+    if (!pending) {
+        /* 4) verlet_second, or the second half kick of r-RESPA */
+        CheckSuccess(status, 4);
+        status = clProfEnqueueNDRangeKernel( cmdQueue, respa ? kernel_kick : kernel_verlet_second, 1, NULL,
+                                             globalWorkSize, localSize, 0, NULL, NULL );
+        if (opts.thermostat != THERMO_NONE)
+            status |= thermostat( cmdQueue, &cl_thermo, kernel_ekin, &cl_reduce, ekin_buffer, nthreads, sys.nfi,
+                                  globalWorkSize, localSize );
+
+        if ((sys.nfi % nprint) == nprint-1) {
+
+	    /* 5) ekin */
+	    CheckSuccess(status, 5);
+	    status = clProfEnqueueNDRangeKernel( cmdQueue, kernel_ekin, 1, NULL, globalWorkSize, localSize, 0, NULL, NULL );
+
+	    /* 8) reduce E_kin[i]@device, the frame is then complete and
+	     * its download can start on the transfer queue */
+	    status |= reduce_sum( cmdQueue, &cl_reduce, ekin_buffer, nthreads, energy_buffer, 2 * cur + 1, &frames[cur].ready );
+	    status |= clFlush( cmdQueue );
+	    status |= frame_download( xferQueue, &frames[cur], energy_buffer, 2 * cur, traj_natoms );
+	    CheckSuccess(status, 8);
+        }
+    }
 
-	/* initialize the sys.epot@host and sys.ekin@host variables to ZERO */
-	sys.epot = ZERO;
-	sys.ekin = ZERO;
+    /* 9) write a restart every restfreq steps */
+    if (checkpoint) write_restart( opts.restout, cmdQueue, &cl_sys, buffers, step0 + sys.nfi );
 
-	/* reduction on the tmp_Exxx[i] buffers downloaded from the device
-	 * during parts 7 and 8 of the previous MD loop iteration */
-	for( i = 0; i < nthreads; i++) {
-		sys.epot += tmp_epot[i];
-		sys.ekin += tmp_ekin[i];
-	}
+    /* 11) sort the atoms by their cells every reorder steps */
+    if (opts.reorder > 0 && (sys.nfi % opts.reorder) == 0 && sys.nfi < sys.nsteps) {
+	status = reorder_atoms( cmdQueue, &cl_reorder, &cl_sys, &multi, globalWorkSize, localSize );
+	CheckSuccess(status, 11);
+    }
 
-	/* multiplying the kinetic energy by prefactors */
-	sys.ekin *= HALF * mvsq2e * sys.mass;
-	sys.temp  = TWO * sys.ekin / ( THREE * sys.natoms - THREE ) / kboltz;
+    /* 1) write output every nprint steps: the writer thread waits
+     * for the download of the frame and writes it out while the
+     * device goes on with the next steps */
+    if ((sys.nfi % nprint) == 0) {
+
+	writer_push( &writer, &frames[cur], sys.nfi );
+	cur = (cur + 1) % opts.nframes;
+    }
 
-	/* writing output files (positions, energies and temperature) */
-	output(&sys, erg, traj);
+    /* 10) at the end of a batch of steps the host waits for the
+     * previous one, so that one batch runs while the next is queued,
+     * and checks the cell and list capacities read at its end. The
+     * frames up to that step can then be written. The first step is
+     * checked at once, too small cells show up there. */
+    if (sys.nfi == 1 && USES_CELLS(cl_force.mode)) {
+	for (i = 0; i < multi.npart; i++) check_cells( multi.part[i].queue, &multi.part[i].force );
+	if (respa) check_cells( cmdQueue, &cl_inner );
+	writer_checked( &writer, 1 );
+    }
+    if ((sys.nfi % batch) == 0 && sys.nfi < sys.nsteps) {
+	status = clFlush( cmdQueue );
+	if (batch_done) {
+	    status |= clWaitForEvents( 1, &batch_done );
+	    clReleaseEvent( batch_done );
+	    if (USES_CELLS(cl_force.mode)) {
+		for (i = 0; i < multi.npart; i++) check_overflow( &multi.part[i].force );
+		if (respa) check_overflow( &cl_inner );
+		writer_checked( &writer, batch_step );
+	    }
+	}
+	if (USES_CELLS(cl_force.mode)) {
+	    for (i = 0; i < multi.npart; i++)
+		status |= read_overflow( multi.part[i].queue, &multi.part[i].force, CL_FALSE );
+	    if (respa) status |= read_overflow( cmdQueue, &cl_inner, CL_FALSE );
+	}
+	status |= enqueue_marker( cmdQueue, &batch_done );
+	batch_step = sys.nfi;
+	CheckSuccess(status, 10);
     }
+  }
+  if (batch_done) clReleaseEvent( batch_done );
+  if (USES_CELLS(cl_force.mode)) {
+    for (i = 0; i < multi.npart; i++) check_cells( multi.part[i].queue, &multi.part[i].force );
+    if (respa) check_cells( cmdQueue, &cl_inner );
+    writer_checked( &writer, sys.nsteps );
+  }
 
+  /* write the remaining frames and the final restart */
+  writer_finish( &writer );
+  if (opts.restout[0]) write_restart( opts.restout, cmdQueue, &cl_sys, buffers, step0 + sys.nsteps );
+  write_analysis( cmdQueue, &cl_analysis, &sys, ergfile );
+  clFinish( xferQueue );
+  for( i = 0; i < opts.nframes; i++ ) {
+    frame_unmap( cmdQueue, &frames[i] );
+    if (frames[i].ready) clReleaseEvent( frames[i].ready );
+    if (frames[i].done) clReleaseEvent( frames[i].done );
   }
   /**************************************************/
 
@@ -464,18 +2933,34 @@ int main(int argc, char **argv)
 t2 = second();
 
 fprintf( stdout, "\n\nTime of execution = %.3g (seconds)\n", (t2 - t1) );
+if (opts.respa > 1)
+  fprintf( stdout, "Time per MD step (r-RESPA integration, %d inner steps) = %.3g (ms)\n",
+	   opts.respa, 1000.0 * (t2 - t_loop) / sys.nsteps );
+else
+  fprintf( stdout, "Time per MD step (%s integration) = %.3g (ms)\n",
+	   integrate_names[opts.integrate], 1000.0 * (t2 - t_loop) / sys.nsteps );
 
-#endif
-
+if (USES_NLIST(cl_force.mode)) nlist_stats( cmdQueue, &cl_force, sys.natoms, sys.nsteps );
 
+#endif
 
+  if( multi.npart > 1 ) balance_report( &multi );
 
+  /* device times per kernel and transfer */
+  if( opts.profile[0] ) {
+    FILE * prof = fopen( opts.profile, "w" );
 
+    ProfileReport( stdout );
+    if( prof ) {
+      ProfileReportJSON( prof );
+      fclose( prof );
+    } else perror( "cannot write profile" );
+  }
 
   /* clean up: close files, free memory */
   printf("Simulation Done.\n");
   fclose(erg);
-  fclose(traj);
+  if (traj) fclose(traj);
 
   free(buffers[0]);
   free(buffers[1]);
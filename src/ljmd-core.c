@@ -0,0 +1,1421 @@
+/*
+ * settings, input, force setup, integration helpers, output and
+ * restarts of ljmd_CL, shared by the program and libljmd (see
+ * ljmd_core.h)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <math.h>
+#include <limits.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ljmd_core.h"
+
+/* OpenCL build options of the precision */
+#ifdef _USE_FLOAT
+const char kernelflags[] = "-D_USE_FLOAT -cl-denorms-are-zero -cl-unsafe-math-optimizations";
+#elif defined(_USE_MIXED)
+const char kernelflags[] = "-D_USE_MIXED -cl-denorms-are-zero -cl-unsafe-math-optimizations";
+#else
+const char kernelflags[] = "-cl-unsafe-math-optimizations";
+#endif
+
+/* a few physical constants */
+const FPTYPE kboltz=0.0019872067;     /* boltzman constant in kcal/mol/K */
+const FPTYPE mvsq2e=2390.05736153349; /* m*v^2 in kcal/mol */
+
+/* names of the settings, in the order of their values */
+const char * forcemode_names[] = { "brute", "cell", "nlist", "newton", "tiled", NULL };
+const char * force_kernels[] = { "opencl_force", "opencl_force_cell", "opencl_force_nlist", "opencl_force_newton", "opencl_force_tiled" };
+const char * force_kernels4[] = { "opencl_force4", NULL, NULL, NULL, "opencl_force_tiled4" };
+const char * force_kernels_inner[] = { "opencl_force_inner", "opencl_force_cell_inner", "opencl_force_nlist_inner", NULL, NULL };
+const char * force_kernels_table[] = { "opencl_force_table", "opencl_force_cell_table", "opencl_force_nlist_table", NULL, NULL };
+const char * potential_names[] = { "lj", "shift", "fswitch", NULL };
+const char * thermostat_names[] = { "none", "berendsen", "langevin", "nosehoover", NULL };
+const char * pbc_names[] = { "loop", "rint", NULL };
+const char * onoff_names[] = { "off", "on", NULL };
+const char * zerocopy_names[] = { "off", "on", "auto", NULL };
+const char * layout_names[] = { "soa", "vec4", NULL };
+const char * integrate_names[] = { "split", "fused", NULL };
+const char * trajformat_names[] = { "xyz", "bin", "none", NULL };
+
+const char trajmagic[8] = "LJMDTRJ1";
+const char restmagic[8] = "LJMDRST1";
+
+/* defaults of the settings */
+const mdopts_t default_opts = { FORCE_BRUTE, 0, 0, 1.0, 0, PBC_LOOP, INTEGRATE_SPLIT, TRAJ_XYZ, DEFAULT_NFRAMES, "", 0, "", 1,
+                                DEFAULT_TUNECACHE, 1, DEFAULT_REBALANCE, 1, DEFAULT_PROGCACHE, 0, ZEROCOPY_AUTO, 1, "", 0,
+                                LAYOUT_SOA, 1, 0.0, 0.0, 0, POT_LJ, THERMO_NONE, 0.0, DEFAULT_TAU, DEFAULT_SEED, 0,
+                                DEFAULT_RDFBINS, 0, 0.0 };
+
+/* helper function: read a line and then return
+   the first string with whitespace stripped off */
+static int get_me_a_line(FILE *fp, char *buf)
+{
+    char tmp[BLEN], *ptr;
+
+    /* read a line and cut of comments and blanks */
+    if (fgets(tmp,BLEN,fp)) {
+        int i;
+
+        ptr=strchr(tmp,'#');
+        if (ptr) *ptr= '\0';
+        i=strlen(tmp); --i;
+        while(isspace(tmp[i])) {
+            tmp[i]='\0';
+            --i;
+        }
+        ptr=tmp;
+        while(isspace(*ptr)) {++ptr;}
+        i=strlen(ptr);
+        strcpy(buf,tmp);
+        return 0;
+    } else {
+        perror("problem reading input");
+        return -1;
+    }
+    return 0;
+}
+ 
+/* read the mandatory part of an input file */
+int read_input(FILE *in, mdsys_t *sys, char *restfile, char *trajfile, char *ergfile, int *nprint)
+{
+    char line[BLEN];
+
+    if(get_me_a_line(in,line)) return 1;
+    sys->natoms=atoi(line);
+    if(get_me_a_line(in,line)) return 1;
+    sys->mass=atof(line);
+    if(get_me_a_line(in,line)) return 1;
+    sys->epsilon=atof(line);
+    if(get_me_a_line(in,line)) return 1;
+    sys->sigma=atof(line);
+    if(get_me_a_line(in,line)) return 1;
+    sys->rcut=atof(line);
+    if(get_me_a_line(in,line)) return 1;
+    sys->box=atof(line);
+    if(get_me_a_line(in,restfile)) return 1;
+    if(get_me_a_line(in,trajfile)) return 1;
+    if(get_me_a_line(in,ergfile)) return 1;
+    if(get_me_a_line(in,line)) return 1;
+    sys->nsteps=atoi(line);
+    if(get_me_a_line(in,line)) return 1;
+    sys->dt=atof(line);
+    if(get_me_a_line(in,line)) return 1;
+    *nprint=atoi(line);
+    return 0;
+}
+
+/* helper function: look up a keyword in a NULL terminated list */
+int find_name(const char **names, const char *val)
+{
+    int i;
+
+    for (i=0; names[i]; ++i)
+        if (!strcmp(names[i],val)) return i;
+    return -1;
+}
+
+/* helper function: read a whole number, returns -1 if val is
+   not one */
+int get_count(const char *val, int *n)
+{
+    char *end;
+    long l = strtol(val,&end,10);
+
+    if (end == val || *end != '\0' || l < INT_MIN || l > INT_MAX) return -1;
+    *n = (int) l;
+    return 0;
+}
+
+/* helper function: read a finite real number, returns -1 if val
+   is not one */
+int get_real(const char *val, FPTYPE *x)
+{
+    char *end;
+    double d = strtod(val,&end);
+
+    if (end == val || *end != '\0' || !(d > -HUGE_VAL && d < HUGE_VAL)) return -1;
+    *x = (FPTYPE) d;
+    return 0;
+}
+
+/* helper function: read a seed, returns -1 if val is not a
+   whole number that fits an unsigned int */
+static int get_seed(const char *val, unsigned int *seed)
+{
+    char *end;
+    unsigned long l = strtoul(val,&end,10);
+
+    if (end == val || *end != '\0' || !isdigit((unsigned char) val[0]) || l > UINT_MAX) return -1;
+    *seed = (unsigned int) l;
+    return 0;
+}
+
+/* set one of the optional run time settings */
+int set_option(mdopts_t *opts, const char *key, const char *val)
+{
+    if (!strcmp(key,"force")) {
+        opts->forcemode=find_name(forcemode_names,val);
+        if (opts->forcemode < 0) {
+            fprintf(stderr,"unknown force kernel '%s' (brute | cell | nlist | newton | tiled)\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"cellmax")) {
+        if (get_count(val,&opts->cellmax) || opts->cellmax < 0) {
+            fprintf(stderr,"cellmax must be 0 (default) or the atoms per cell, not '%s'\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"nlistmax")) {
+        if (get_count(val,&opts->nlistmax) || opts->nlistmax < 0) {
+            fprintf(stderr,"nlistmax must be 0 (default) or the neighbors per atom, not '%s'\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"skin")) {
+        if (get_real(val,&opts->skin) || opts->skin < 0.0) {
+            fprintf(stderr,"skin must be a distance of at least 0, not '%s'\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"wgsize")) {
+        if (get_count(val,&opts->wgsize) || opts->wgsize < 0) {
+            fprintf(stderr,"wgsize must be 0 (default) or the work-group size, not '%s'\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"pbc")) {
+        opts->pbc=find_name(pbc_names,val);
+        if (opts->pbc < 0) {
+            fprintf(stderr,"unknown pbc form '%s' (loop | rint)\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"integrate")) {
+        opts->integrate=find_name(integrate_names,val);
+        if (opts->integrate < 0) {
+            fprintf(stderr,"unknown integration scheme '%s' (split | fused)\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"trajformat")) {
+        opts->trajformat=find_name(trajformat_names,val);
+        if (opts->trajformat < 0) {
+            fprintf(stderr,"unknown trajectory format '%s' (xyz | bin | none)\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"restout")) {
+        strncpy(opts->restout,val,BLEN-1);
+    } else if (!strcmp(key,"restfreq")) {
+        if (get_count(val,&opts->restfreq) || opts->restfreq < 0) {
+            fprintf(stderr,"restfreq must be 0 (at the end only) or the steps between restarts, not '%s'\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"profile")) {
+        strncpy(opts->profile,val,BLEN-1);
+    } else if (!strcmp(key,"tune")) {
+        opts->tune=find_name(onoff_names,val);
+        if (opts->tune < 0) {
+            fprintf(stderr,"tune must be on or off\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"tunecache")) {
+        strncpy(opts->tunecache,val,BLEN-1);
+    } else if (!strcmp(key,"devices")) {
+        if (get_count(val,&opts->ndevices) || opts->ndevices < 0) {
+            fprintf(stderr,"devices must be 0 (all) or the number of devices to use\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"jit")) {
+        opts->jit=find_name(onoff_names,val);
+        if (opts->jit < 0) {
+            fprintf(stderr,"jit must be on or off\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"batch")) {
+        if (get_count(val,&opts->batch) || opts->batch < 0) {
+            fprintf(stderr,"batch must be 0 (nprint) or the steps queued between host checks\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"zerocopy")) {
+        opts->zerocopy=find_name(zerocopy_names,val);
+        if (opts->zerocopy < 0) {
+            fprintf(stderr,"zerocopy must be off, on or auto\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"replicas")) {
+        if (get_count(val,&opts->replicas) || opts->replicas < 1) {
+            fprintf(stderr,"replicas must be at least 1\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"reorder")) {
+        if (get_count(val,&opts->reorder) || opts->reorder < 0) {
+            fprintf(stderr,"reorder must be 0 (never) or the steps between reorderings of the atoms\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"layout")) {
+        opts->layout=find_name(layout_names,val);
+        if (opts->layout < 0) {
+            fprintf(stderr,"layout must be soa or vec4\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"respa")) {
+        if (get_count(val,&opts->respa) || opts->respa < 1) {
+            fprintf(stderr,"respa must be 1 (off) or the inner steps per step\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"rinner")) {
+        if (get_real(val,&opts->rinner) || opts->rinner < 0.0) {
+            fprintf(stderr,"rinner must be 0 (default) or the inner cutoff\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"rswitch")) {
+        if (get_real(val,&opts->rswitch) || opts->rswitch < 0.0) {
+            fprintf(stderr,"rswitch must be 0 (default) or the width of the switching region\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"table")) {
+        if (get_count(val,&opts->table) || opts->table < 0) {
+            fprintf(stderr,"table must be 0 (analytic) or the number of table intervals\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"potential")) {
+        opts->potential=find_name(potential_names,val);
+        if (opts->potential < 0) {
+            fprintf(stderr,"potential must be lj, shift or fswitch\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"thermostat")) {
+        opts->thermostat=find_name(thermostat_names,val);
+        if (opts->thermostat < 0) {
+            fprintf(stderr,"thermostat must be none, berendsen, langevin or nosehoover\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"temp")) {
+        if (get_real(val,&opts->temp) || opts->temp < 0.0) {
+            fprintf(stderr,"temp must be 0 (default) or a temperature in K, not '%s'\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"tau")) {
+        if (get_real(val,&opts->tau) || opts->tau <= 0.0) {
+            fprintf(stderr,"tau must be positive\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"seed")) {
+        if (get_seed(val,&opts->seed)) {
+            fprintf(stderr,"seed must be a whole number from 0 to %u, not '%s'\n",UINT_MAX,val);
+            return -1;
+        }
+    } else if (!strcmp(key,"rdf")) {
+        if (get_count(val,&opts->rdf) || opts->rdf < 0) {
+            fprintf(stderr,"rdf must be 0 (none) or the steps between g(r) samples, not '%s'\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"rdfbins")) {
+        if (get_count(val,&opts->rdfbins) || opts->rdfbins < 1 || opts->rdfbins > MAX_RDFBINS) {
+            fprintf(stderr,"rdfbins must be between 1 and %d, not '%s'\n", MAX_RDFBINS, val);
+            return -1;
+        }
+    } else if (!strcmp(key,"rdfmax")) {
+        if (get_real(val,&opts->rdfmax) || opts->rdfmax < 0.0) {
+            fprintf(stderr,"rdfmax must be 0 (rcut) or the largest g(r) distance, not '%s'\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"msd")) {
+        if (get_count(val,&opts->msd) || opts->msd < 0) {
+            fprintf(stderr,"msd must be 0 (none) or the steps between MSD samples, not '%s'\n",val);
+            return -1;
+        }
+    } else if (!strcmp(key,"ensemble")) {
+        strncpy(opts->ensemble,val,BLEN-1);
+    } else if (!strcmp(key,"progcache")) {
+        strncpy(opts->progcache,val,BLEN-1);
+    } else if (!strcmp(key,"rebalance")) {
+        if (get_count(val,&opts->rebalance) || opts->rebalance < 0) {
+            fprintf(stderr,"rebalance must be 0 (never) or the steps between new splits of the atoms\n");
+            return -1;
+        }
+    } else if (!strcmp(key,"nframes")) {
+        if (get_count(val,&opts->nframes) || opts->nframes < 2) {
+            fprintf(stderr,"nframes must be at least 2\n");
+            return -1;
+        }
+    } else {
+        fprintf(stderr,"unknown option '%s'\n",key);
+        return -1;
+    }
+    return 0;
+}
+
+/* helper function: read the optional "keyword value" lines
+   following the mandatory part of the input file */
+int read_options(FILE *fp, mdopts_t *opts)
+{
+    char tmp[BLEN], key[BLEN], val[BLEN], *ptr;
+
+    while (fgets(tmp,BLEN,fp)) {
+        ptr=strchr(tmp,'#');
+        if (ptr) *ptr= '\0';
+        switch (sscanf(tmp,"%s %s",key,val)) {
+            case 2:
+                if (set_option(opts,key,val)) return -1;
+                break;
+            case 1:
+                fprintf(stderr,"missing value for option '%s'\n",key);
+                return -1;
+            default: /* blank line */
+                break;
+        }
+    }
+    return 0;
+}
+
+/* set up the cell list used by the cell and neighbor list kernels */
+static cl_int init_cells(cl_context context, cl_command_queue queue, cl_force_t *f, int natoms, FPTYPE rcut, int cellmax)
+{
+    cl_int status;
+    int zero = 0, rebuild[2] = { 1, 0 };
+
+    /* cells must not be smaller than the cutoff */
+    f->ncell = (int) floor( f->box / rcut );
+    if (f->ncell < 1) f->ncell = 1;
+    f->ncells = f->ncell * f->ncell * f->ncell;
+    f->cellinv = f->ncell / f->box;
+
+    /* default capacity: twice the average occupation plus some margin */
+    if (cellmax > 0) f->cellmax = cellmax;
+    else f->cellmax = 2 * natoms / f->ncells + 16;
+
+    f->cell_count = clCreateBuffer( context, CL_MEM_READ_WRITE, f->ncells * sizeof(int), NULL, &status );
+    f->cell_atoms = clCreateBuffer( context, CL_MEM_READ_WRITE, f->ncells * f->cellmax * sizeof(int), NULL, &status );
+    f->cell_overflow = clCreateBuffer( context, CL_MEM_READ_WRITE, sizeof(int), NULL, &status );
+    status |= clProfEnqueueWriteBuffer( queue, f->cell_overflow, CL_TRUE, 0, sizeof(int), &zero, 0, NULL, NULL );
+
+    /* the cell kernel rebuilds at every step: the flag is never cleared */
+    f->rebuild = clCreateBuffer( context, CL_MEM_READ_WRITE, 2 * sizeof(int), NULL, &status );
+    status |= clProfEnqueueWriteBuffer( queue, f->rebuild, CL_TRUE, 0, 2 * sizeof(int), rebuild, 0, NULL, NULL );
+
+    printf("\nUsing cell list with %dx%dx%d cells, up to %d atoms per cell.\n",
+           f->ncell, f->ncell, f->ncell, f->cellmax);
+    return status;
+}
+
+/* set up the neighbor list, built from a cell list with cells >= rcut + skin */
+static cl_int init_nlist(cl_context context, cl_command_queue queue, cl_force_t *f, int natoms, FPTYPE rcut, FPTYPE skin, int nlistmax)
+{
+    cl_int status;
+    int zero = 0;
+    FPTYPE rl = rcut + skin;
+
+    f->rlsq = rl * rl;
+    f->halfskinsq = HALF * skin * HALF * skin;
+    f->half = ( f->mode == FORCE_NEWTON );
+
+    /* default capacity: 1.5 times the expected number of neighbors */
+    if (nlistmax > 0) f->nlistmax = nlistmax;
+    else f->nlistmax = (int) ( 1.5 * 4.0 / 3.0 * M_PI * rl * rl * rl * natoms / ( f->box * f->box * f->box ) ) + 16;
+    if (f->half && nlistmax <= 0) f->nlistmax = f->nlistmax / 2 + 16;
+
+    f->nlist_count = clCreateBuffer( context, CL_MEM_READ_WRITE, natoms * sizeof(int), NULL, &status );
+    f->nlist = clCreateBuffer( context, CL_MEM_READ_WRITE, (size_t) natoms * f->nlistmax * sizeof(int), NULL, &status );
+    f->nlist_overflow = clCreateBuffer( context, CL_MEM_READ_WRITE, sizeof(int), NULL, &status );
+    status |= clProfEnqueueWriteBuffer( queue, f->nlist_overflow, CL_TRUE, 0, sizeof(int), &zero, 0, NULL, NULL );
+    f->rx0 = clCreateBuffer( context, CL_MEM_READ_WRITE, natoms * sizeof(FPTYPE), NULL, &status );
+    f->ry0 = clCreateBuffer( context, CL_MEM_READ_WRITE, natoms * sizeof(FPTYPE), NULL, &status );
+    f->rz0 = clCreateBuffer( context, CL_MEM_READ_WRITE, natoms * sizeof(FPTYPE), NULL, &status );
+
+    printf("\nUsing %s neighbor list with %.3f skin, up to %d neighbors per atom.",
+           f->half ? "half" : "full", skin, f->nlistmax);
+    return status;
+}
+
+/* directory of the program binary cache, NULL if it is off */
+const char *progcache_dir(mdopts_t *opts)
+{
+    return strcmp(opts->progcache, "off") ? opts->progcache : NULL;
+}
+
+/* append -Dname=value with the exact value as a hexadecimal literal */
+static void add_define(char *flags, int len, const char *name, double value, int isfloat)
+{
+    int n = strlen(flags);
+
+    snprintf(flags + n, len - n, " -D%s=%a%s", name, value, isfloat ? "f" : "");
+}
+
+/* kernel build options: precision and pbc mode and with opts->jit the
+ * constants of init_force as -D_JIT -DJIT_C12=... and the work-group
+ * size of the tiled kernel as WGSIZE if it is known (wgsize > 0) */
+void kernel_build_flags(char *flags, int len, mdsys_t *sys, mdopts_t *opts, int wgsize)
+{
+    PAIRTYPE c12, c6, rcsq;
+    FPTYPE boxby2, box, boxinv;
+    int n;
+
+    snprintf(flags, len, "%s%s", kernelflags, opts->pbc == PBC_RINT ? " -D_PBC_RINT" : "");
+    if (!opts->jit) return;
+
+    c12 = 4.0 * sys->epsilon * pow( sys->sigma, 12.0);
+    c6  = 4.0 * sys->epsilon * pow( sys->sigma, 6.0);
+    rcsq = sys->rcut * sys->rcut;
+    boxby2 = HALF * sys->box;
+    box = sys->box;
+    boxinv = 1.0 / sys->box;
+
+    n = strlen(flags);
+    snprintf(flags + n, len - n, " -D_JIT");
+    add_define(flags, len, "JIT_C12", c12, sizeof(PAIRTYPE) == sizeof(float));
+    add_define(flags, len, "JIT_C6", c6, sizeof(PAIRTYPE) == sizeof(float));
+    add_define(flags, len, "JIT_RCSQ", rcsq, sizeof(PAIRTYPE) == sizeof(float));
+    add_define(flags, len, "JIT_BOXBY2", boxby2, sizeof(FPTYPE) == sizeof(float));
+    add_define(flags, len, "JIT_BOX", box, sizeof(FPTYPE) == sizeof(float));
+    add_define(flags, len, "JIT_BOXINV", boxinv, sizeof(FPTYPE) == sizeof(float));
+    if (wgsize > 0) {
+        n = strlen(flags);
+        snprintf(flags + n, len - n, " -DWGSIZE=%d", wgsize);
+    }
+}
+
+/* arguments bind_force sets for the force kernel of a mode, those of
+ * the inner and tabulated variants follow */
+int force_nargs(int mode)
+{
+    if (mode == FORCE_CELL) return 21;
+    if (USES_NLIST(mode)) return 18;
+    if (mode == FORCE_TILED) return 19;
+    return 16;
+}
+
+/* Lennard-Jones energy and force / r at distance r */
+static void lj_pair(double r, double c12, double c6, double *e, double *ffac)
+{
+    double r6 = pow(r, -6.0);
+
+    *e = r6 * (c12 * r6 - c6);
+    *ffac = (12.0 * c12 * r6 - 6.0 * c6) * r6 / (r * r);
+}
+
+/* switch of potential=fswitch, from 1 at ron to 0 at rc */
+static double fswitch_s(double r, double ron, double rc)
+{
+    double x = (r - ron) / (rc - ron);
+
+    if (r <= ron) return 1.0;
+    return 1.0 + x * x * (2.0 * x - 3.0);
+}
+
+/* energy and force / r of the tabulated potential at distance r. With
+ * fswitch the force is switched off between ron and rc and the energy
+ * is its integral from r to rc, by Simpson's rule over the switch. */
+void table_pair(int potential, double r, double rc, double ron, double c12, double c6, double *e, double *ffac)
+{
+    double e0, f0;
+    int i, n = 200;
+
+    lj_pair(r, c12, c6, e, ffac);
+    if (potential == POT_SHIFT) {
+        lj_pair(rc, c12, c6, &e0, &f0);
+        *e -= e0;
+    } else if (potential == POT_FSWITCH) {
+        double a = r > ron ? r : ron, h = (rc - a) / n, sum = 0.0;
+
+        for (i = 0; i <= n; i++) {
+            double x = a + i * h;
+
+            lj_pair(x, c12, c6, &e0, &f0);
+            sum += (i == 0 || i == n ? 1.0 : (i % 2 ? 4.0 : 2.0)) * fswitch_s(x, ron, rc) * f0 * x;
+        }
+        sum *= h / 3.0;
+        if (r < ron) {
+            lj_pair(ron, c12, c6, &e0, &f0);
+            *e += sum - e0;
+        } else *e = sum;
+        *ffac *= fswitch_s(r, ron, rc);
+    }
+}
+
+/* sample the tabulated potential at opts->table + 1 points of equal
+ * spacing in r^2 from (TABLE_RMIN sigma)^2 to rcut^2, as (e, de, f, df)
+ * per interval (see lj_table) */
+void build_table(mdsys_t *sys, mdopts_t *opts, PAIRTYPE *tab, double *tmin, double *tinv)
+{
+    double c12 = 4.0 * sys->epsilon * pow(sys->sigma, 12.0);
+    double c6 = 4.0 * sys->epsilon * pow(sys->sigma, 6.0);
+    double rc = sys->rcut, ron = rc - opts->rswitch, lo, dr2, e[2], f[2];
+    int k;
+
+    lo = TABLE_RMIN * sys->sigma;
+    lo *= lo;
+    dr2 = (rc * rc - lo) / opts->table;
+    table_pair(opts->potential, sqrt(lo), rc, ron, c12, c6, &e[0], &f[0]);
+    for (k = 0; k < opts->table; k++) {
+        table_pair(opts->potential, sqrt(lo + (k + 1) * dr2), rc, ron, c12, c6, &e[1], &f[1]);
+        tab[4*k] = e[0];
+        tab[4*k+1] = e[1] - e[0];
+        tab[4*k+2] = f[0];
+        tab[4*k+3] = f[1] - f[0];
+        e[0] = e[1];
+        f[0] = f[1];
+    }
+    *tmin = lo;
+    *tinv = 1.0 / dr2;
+}
+
+/* upload the table to a constant buffer and bind it to the force kernel */
+static cl_int init_table(cl_command_queue queue, cl_context context, cl_force_t *f, mdsys_t *sys, mdopts_t *opts)
+{
+    size_t size = 4 * opts->table * sizeof(PAIRTYPE);
+    cl_ulong maxsize = 0;
+    cl_device_id device;
+    double tmin, tinv;
+    PAIRTYPE *tab;
+    cl_int status;
+
+    status = clGetCommandQueueInfo( queue, CL_QUEUE_DEVICE, sizeof(device), &device, NULL );
+    status |= clGetDeviceInfo( device, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE, sizeof(maxsize), &maxsize, NULL );
+    if( status != CL_SUCCESS ) return status;
+    if( size > maxsize ) {
+        fprintf( stderr, "\nA table of %d intervals needs %lu bytes of constant memory, the device has %lu.\n",
+                 opts->table, (unsigned long) size, (unsigned long) maxsize );
+        return CL_INVALID_BUFFER_SIZE;
+    }
+
+    tab = (PAIRTYPE *) malloc( size );
+    build_table( sys, opts, tab, &tmin, &tinv );
+    f->ntable = opts->table;
+    f->tmin = tmin;
+    f->tinv = tinv;
+    f->table = clCreateBuffer( context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, size, tab, &status );
+    free( tab );
+    if( status != CL_SUCCESS ) return status;
+    return clSetMultKernelArgs( f->force, force_nargs(f->mode), 4, KArg(f->table), KArg(f->ntable), KArg(f->tmin), KArg(f->tinv) );
+}
+
+/* create the force kernel of the selected mode, precompute its constants
+ * and set up the cell or neighbor list it needs. The constants must be
+ * those of kernel_build_flags. */
+cl_int init_force(cl_context context, cl_command_queue queue, cl_program program, cl_force_t *f,
+                  mdsys_t *sys, mdopts_t *opts, cl_mem epot)
+{
+    cl_int status;
+    const char *name;
+
+    f->mode = opts->forcemode;
+    f->layout = opts->layout;
+    if( f->layout == LAYOUT_VEC4 ) name = force_kernels4[f->mode];
+    else if( opts->table > 0 ) name = force_kernels_table[f->mode];
+    else name = force_kernels[f->mode];
+    f->force = clCreateKernel( program, name, &status );
+    if( status != CL_SUCCESS ) {
+        /* opencl_force_newton needs 64 bit atomics in double precision */
+        fprintf( stderr, "\nForce kernel %s is not available on this device (%s).\n",
+                 name, CLErrString( status ) );
+        return status;
+    }
+    f->azzero = clCreateKernel( program, "opencl_azzero", &status );
+    f->epot = epot;
+    f->c12 = 4.0 * sys->epsilon * pow( sys->sigma, 12.0);
+    f->c6  = 4.0 * sys->epsilon * pow( sys->sigma, 6.0);
+    f->rcsq = sys->rcut * sys->rcut;
+    f->boxby2 = HALF * sys->box;
+    f->box = sys->box;
+    f->boxinv = 1.0 / sys->box;
+    f->ifirst = 0;
+    f->ilast = sys->natoms;
+    f->table = NULL;
+
+    if( opts->table > 0 ) {
+        status = init_table( queue, context, f, sys, opts );
+        if( status != CL_SUCCESS ) return status;
+    }
+
+    if( USES_NLIST(f->mode) ) {
+        f->nlist_check = clCreateKernel( program, "opencl_nlist_check", &status );
+        f->nlist_build = clCreateKernel( program, "opencl_nlist_build", &status );
+        f->nlist_done = clCreateKernel( program, "opencl_nlist_done", &status );
+        status |= init_nlist( context, queue, f, sys->natoms, sys->rcut, opts->skin, opts->nlistmax );
+        CheckSuccess(status, 1);
+    }
+
+    if( USES_CELLS(f->mode) ) {
+        f->cell_clear = clCreateKernel( program, "opencl_cell_clear", &status );
+        f->cell_bin = clCreateKernel( program, "opencl_cell_bin", &status );
+        status |= init_cells( context, queue, f, sys->natoms,
+                              USES_NLIST(f->mode) ? sys->rcut + opts->skin : sys->rcut, opts->cellmax );
+        CheckSuccess(status, 1);
+    }
+    return status;
+}
+
+/* read the atoms of the fullest cell and neighbor list that did not
+ * fit (0 if all did) to f->overflow */
+cl_int read_overflow(cl_command_queue queue, cl_force_t *f, cl_bool blocking)
+{
+    cl_int status;
+
+    status = clProfEnqueueReadBuffer( queue, f->cell_overflow, blocking, 0, sizeof(int), &f->overflow[0], 0, NULL, NULL );
+    if (USES_NLIST(f->mode))
+        status |= clProfEnqueueReadBuffer( queue, f->nlist_overflow, blocking, 0, sizeof(int), &f->overflow[1], 0, NULL, NULL );
+    return status;
+}
+
+/* report a cell or list too small found by the last read_overflow */
+int report_overflow(cl_force_t *f)
+{
+    if (f->overflow[0] > 0) {
+        fprintf( stderr, "\nCell list overflow: %d atoms in a cell, capacity is %d. Rerun with cellmax=%d or larger.\n",
+                 f->overflow[0], f->cellmax, f->overflow[0] + 8 );
+        return 1;
+    }
+    if (USES_NLIST(f->mode) && f->overflow[1] > 0) {
+        fprintf( stderr, "\nNeighbor list overflow: %d neighbors, capacity is %d. Rerun with nlistmax=%d or larger.\n",
+                 f->overflow[1], f->nlistmax, f->overflow[1] + 16 );
+        return 1;
+    }
+    return 0;
+}
+
+#ifndef _USE_MPI
+/* does the device work on the host memory, so that buffers allocated
+ * by the runtime can be mapped without a copy */
+int host_unified(cl_device_id device)
+{
+    cl_bool unified = CL_FALSE;
+
+#ifdef CL_DEVICE_HOST_UNIFIED_MEMORY
+    if (clGetDeviceInfo( device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, NULL ) != CL_SUCCESS)
+        unified = CL_FALSE;
+#endif
+    return unified == CL_TRUE;
+}
+#endif
+
+/* flags of the atom buffers, host memory the device accesses in place
+ * in zero-copy mode */
+cl_mem_flags atom_mem_flags(int zerocopy)
+{
+    return zerocopy ? CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR : CL_MEM_READ_WRITE;
+}
+
+/* map the positions and velocities, ptr[0..5] = rx ry rz vx vy vz */
+cl_int map_system(cl_command_queue queue, cl_mdsys_t *sys, cl_map_flags flags, FPTYPE **ptr)
+{
+    cl_mem buf[6] = { sys->rx, sys->ry, sys->rz, sys->vx, sys->vy, sys->vz };
+    cl_int status, err = CL_SUCCESS;
+    int k;
+
+    for (k = 0; k < 6; k++) {
+        ptr[k] = (FPTYPE *) clProfEnqueueMapBuffer( queue, buf[k], CL_TRUE, flags, 0, sys->natoms * sizeof(FPTYPE),
+                                                   0, NULL, NULL, &status );
+        err |= status;
+    }
+    return err;
+}
+
+cl_int unmap_system(cl_command_queue queue, cl_mdsys_t *sys, FPTYPE **ptr)
+{
+    cl_mem buf[6] = { sys->rx, sys->ry, sys->rz, sys->vx, sys->vy, sys->vz };
+    cl_int status = CL_SUCCESS;
+    int k;
+
+    for (k = 0; k < 6; k++)
+        if (ptr[k]) status |= clEnqueueUnmapMemObject( queue, buf[k], ptr[k], 0, NULL, NULL );
+    return status;
+}
+
+/* packed layout: interleave n x, y and z values to (x, y, z, 0) quads */
+static void pack4(FPTYPE *q, const FPTYPE *x, const FPTYPE *y, const FPTYPE *z, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        q[4*i] = x[i];
+        q[4*i+1] = y[i];
+        q[4*i+2] = z[i];
+        q[4*i+3] = ZERO;
+    }
+}
+
+void unpack4(const FPTYPE *q, FPTYPE *x, FPTYPE *y, FPTYPE *z, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        x[i] = q[4*i];
+        y[i] = q[4*i+1];
+        z[i] = q[4*i+2];
+    }
+}
+
+/* set the arguments of all kernels of the force computation. They stay
+ * bound until the buffers, the number of atoms, the range of atoms or
+ * the local size of the tiled kernel change. */
+cl_int bind_force(cl_mdsys_t *sys, cl_force_t *f, size_t *localWorkSize)
+{
+    cl_int status = CL_SUCCESS;
+
+    if (f->layout == LAYOUT_VEC4) {
+        /* only the all-pairs kernels have a packed variant */
+        status = clSetMultKernelArgs( f->force, 0, 12,
+          KArg(sys->f4),
+          KArg(sys->r4),
+          KArg(sys->natoms),
+          KArg(f->epot),
+          KArg(f->c12),
+          KArg(f->c6),
+          KArg(f->rcsq),
+          KArg(f->boxby2),
+          KArg(f->box),
+          KArg(f->boxinv),
+          KArg(f->ifirst),
+          KArg(f->ilast));
+        if (f->mode == FORCE_TILED)
+            status |= clSetKernelArg( f->force, 12, localWorkSize[0] * 4 * sizeof(FPTYPE), NULL );
+        return status;
+    }
+
+    if (USES_NLIST(f->mode))
+        status |= clSetMultKernelArgs( f->nlist_check, 0, 12,
+          KArg(sys->rx),
+          KArg(sys->ry),
+          KArg(sys->rz),
+          KArg(f->rx0),
+          KArg(f->ry0),
+          KArg(f->rz0),
+          KArg(sys->natoms),
+          KArg(f->halfskinsq),
+          KArg(f->boxby2),
+          KArg(f->box),
+          KArg(f->boxinv),
+          KArg(f->rebuild));
+
+    if (USES_CELLS(f->mode)) {
+        status |= clSetMultKernelArgs( f->cell_clear, 0, 3, KArg(f->cell_count), KArg(f->ncells), KArg(f->rebuild));
+        status |= clSetMultKernelArgs( f->cell_bin, 0, 12,
+          KArg(sys->rx),
+          KArg(sys->ry),
+          KArg(sys->rz),
+          KArg(sys->natoms),
+          KArg(f->cell_count),
+          KArg(f->cell_atoms),
+          KArg(f->cellmax),
+          KArg(f->ncell),
+          KArg(f->cellinv),
+          KArg(f->box),
+          KArg(f->cell_overflow),
+          KArg(f->rebuild));
+    }
+
+    if (USES_NLIST(f->mode)) {
+        status |= clSetMultKernelArgs( f->nlist_build, 0, 22,
+          KArg(sys->rx),
+          KArg(sys->ry),
+          KArg(sys->rz),
+          KArg(f->rx0),
+          KArg(f->ry0),
+          KArg(f->rz0),
+          KArg(sys->natoms),
+          KArg(f->rlsq),
+          KArg(f->boxby2),
+          KArg(f->box),
+          KArg(f->boxinv),
+          KArg(f->cell_count),
+          KArg(f->cell_atoms),
+          KArg(f->cellmax),
+          KArg(f->ncell),
+          KArg(f->cellinv),
+          KArg(f->nlist_count),
+          KArg(f->nlist),
+          KArg(f->nlistmax),
+          KArg(f->nlist_overflow),
+          KArg(f->rebuild),
+          KArg(f->half));
+        status |= clSetMultKernelArgs( f->nlist_done, 0, 1, KArg(f->rebuild));
+    }
+
+    if (f->mode == FORCE_NEWTON)
+        status |= clSetMultKernelArgs( f->azzero, 0, 4, KArg(sys->fx), KArg(sys->fy), KArg(sys->fz), KArg(sys->natoms));
+
+    status |= clSetMultKernelArgs( f->force, 0, 16,
+      KArg(sys->fx),
+      KArg(sys->fy),
+      KArg(sys->fz),
+      KArg(sys->rx),
+      KArg(sys->ry),
+      KArg(sys->rz),
+      KArg(sys->natoms),
+      KArg(f->epot),
+      KArg(f->c12),
+      KArg(f->c6),
+      KArg(f->rcsq),
+      KArg(f->boxby2),
+      KArg(f->box),
+      KArg(f->boxinv),
+      KArg(f->ifirst),
+      KArg(f->ilast));
+
+    if (f->mode == FORCE_CELL)
+        status |= clSetMultKernelArgs( f->force, 16, 5,
+          KArg(f->cell_count),
+          KArg(f->cell_atoms),
+          KArg(f->cellmax),
+          KArg(f->ncell),
+          KArg(f->cellinv));
+    else if (USES_NLIST(f->mode))
+        status |= clSetMultKernelArgs( f->force, 16, 2,
+          KArg(f->nlist_count),
+          KArg(f->nlist));
+    else if (f->mode == FORCE_TILED) {
+        /* local memory for one tile of positions */
+        size_t tile = localWorkSize[0] * sizeof(FPTYPE);
+        status |= clSetKernelArg( f->force, 16, tile, NULL );
+        status |= clSetKernelArg( f->force, 17, tile, NULL );
+        status |= clSetKernelArg( f->force, 18, tile, NULL );
+    }
+    return status;
+}
+
+/* rebind only the range of atoms of the force kernel */
+cl_int bind_range(cl_force_t *f)
+{
+    return clSetMultKernelArgs( f->force, f->layout == LAYOUT_VEC4 ? 10 : 14, 2, KArg(f->ifirst), KArg(f->ilast));
+}
+
+/* enqueue the force computation with the selected kernel, whose
+ * arguments are set by bind_force, optionally returning the event
+ * of the force kernel */
+cl_int compute_force(cl_command_queue queue, cl_force_t *f, size_t *globalWorkSize, size_t *localWorkSize,
+                     cl_event *event)
+{
+    cl_int status = CL_SUCCESS;
+    size_t one = 1;
+
+    /* flag a rebuild of the neighbor list if any atom moved by more than skin / 2 */
+    if (USES_NLIST(f->mode))
+        status |= clProfEnqueueNDRangeKernel( queue, f->nlist_check, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+
+    /* rebuild the cell list from the current positions */
+    if (USES_CELLS(f->mode)) {
+        status |= clProfEnqueueNDRangeKernel( queue, f->cell_clear, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+        status |= clProfEnqueueNDRangeKernel( queue, f->cell_bin, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+    }
+
+    /* the build and done kernels return at once if no rebuild is needed */
+    if (USES_NLIST(f->mode)) {
+        status |= clProfEnqueueNDRangeKernel( queue, f->nlist_build, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+        status |= clProfEnqueueNDRangeKernel( queue, f->nlist_done, 1, NULL, &one, NULL, 0, NULL, NULL );
+    }
+
+    /* the half list kernel only adds to the forces */
+    if (f->mode == FORCE_NEWTON)
+        status |= clProfEnqueueNDRangeKernel( queue, f->azzero, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+
+    status |= clProfEnqueueNDRangeKernel( queue, f->force, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, event );
+    return status;
+}
+
+/* set up the sum of up to n values with work-groups of a power of
+ * two size that the device supports */
+cl_int init_reduce(cl_context context, cl_device_id device, cl_program program, cl_reduce_t *r, int n)
+{
+    cl_int status;
+    size_t max_wgsize;
+
+    r->kernel = clCreateKernel( program, "opencl_reduce", &status );
+    status |= clGetDeviceInfo( device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_wgsize), &max_wgsize, NULL );
+
+    r->wgsize = 1;
+    while( 2 * r->wgsize <= REDUCE_WGSIZE && 2 * r->wgsize <= max_wgsize ) r->wgsize *= 2;
+
+    /* no more partial sums than the second pass can handle */
+    r->ngroups = ( n + r->wgsize - 1 ) / r->wgsize;
+    if( r->ngroups > r->wgsize ) r->ngroups = r->wgsize;
+    r->partial = clCreateBuffer( context, CL_MEM_READ_WRITE, r->ngroups * sizeof(FPTYPE), NULL, &status );
+    return status;
+}
+
+/* enqueue the sum of in[0..n-1] into out[offset], optionally
+ * returning the event of the last launch */
+cl_int reduce_sum(cl_command_queue queue, cl_reduce_t *r, cl_mem in, int n, cl_mem out, int offset, cl_event *event)
+{
+    cl_int status = CL_SUCCESS;
+    size_t global = r->ngroups * r->wgsize;
+    size_t scratch = r->wgsize * sizeof(FPTYPE);
+    int zero = 0, ngroups = r->ngroups;
+
+    if( r->ngroups > 1 ) {
+        status |= clSetMultKernelArgs( r->kernel, 0, 4, KArg(in), KArg(n), KArg(r->partial), KArg(zero) );
+        status |= clSetKernelArg( r->kernel, 4, scratch, NULL );
+        status |= clProfEnqueueNDRangeKernel( queue, r->kernel, 1, NULL, &global, &r->wgsize, 0, NULL, NULL );
+        in = r->partial;
+        n = ngroups;
+    }
+
+    status |= clSetMultKernelArgs( r->kernel, 0, 4, KArg(in), KArg(n), KArg(out), KArg(offset) );
+    status |= clSetKernelArg( r->kernel, 4, scratch, NULL );
+    status |= clProfEnqueueNDRangeKernel( queue, r->kernel, 1, NULL, &r->wgsize, &r->wgsize, 0, NULL, event );
+    return status;
+}
+
+/* create the thermostat kernels and bind their arguments. The target
+ * temperature and the degrees of freedom are those of the output. */
+cl_int init_thermo(cl_context context, cl_program program, cl_thermo_t *t, cl_mdsys_t *sys, mdsys_t *md, mdopts_t *opts)
+{
+    FPTYPE state[3] = { 1.0, 0.0, 0.0 };
+    FPTYPE tfac = mvsq2e * md->mass / ( THREE * md->natoms - THREE ) / kboltz;
+    cl_int status;
+
+    t->kind = opts->thermostat;
+    t->update = NULL;
+    t->state = NULL;
+    if( t->kind == THERMO_LANGEVIN ) {
+        FPTYPE c1 = exp( -md->dt / opts->tau );
+        FPTYPE c2 = sqrt( ( 1.0 - c1 * c1 ) * kboltz * opts->temp / ( mvsq2e * md->mass ) );
+        cl_uint seed = opts->seed;
+
+        t->scale = clCreateKernel( program, "opencl_langevin", &status );
+        if( status != CL_SUCCESS ) return status;
+        return clSetMultKernelArgs( t->scale, 0, 7, KArg(sys->vx), KArg(sys->vy), KArg(sys->vz), KArg(sys->natoms),
+                                    KArg(c1), KArg(c2), KArg(seed) );
+    }
+
+    t->update = clCreateKernel( program, t->kind == THERMO_BERENDSEN ? "opencl_berendsen" : "opencl_nosehoover", &status );
+    t->scale = clCreateKernel( program, "opencl_vscale", &status );
+    t->state = clCreateBuffer( context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(state), state, &status );
+    if( status != CL_SUCCESS ) return status;
+    status = clSetMultKernelArgs( t->update, 0, 5, KArg(t->state), KArg(tfac), KArg(opts->temp), KArg(md->dt), KArg(opts->tau) );
+    status |= clSetMultKernelArgs( t->scale, 0, 5, KArg(sys->vx), KArg(sys->vy), KArg(sys->vz), KArg(sys->natoms),
+                                   KArg(t->state) );
+    return status;
+}
+
+/* enqueue the thermostat of a step after the second half kick: the
+ * sum of v^2 by the ekin kernel and the reduction into state[2], the
+ * update of the scale factor and the scaling all stay on the device */
+cl_int thermostat(cl_command_queue queue, cl_thermo_t *t, cl_kernel ekin, cl_reduce_t *r, cl_mem ekin_buffer,
+                  int nthreads, int step, size_t *globalWorkSize, size_t *localWorkSize)
+{
+    size_t one = 1;
+    cl_int status;
+
+    if( t->kind == THERMO_LANGEVIN ) {
+        status = clSetKernelArg( t->scale, 7, sizeof(step), &step );
+        return status | clProfEnqueueNDRangeKernel( queue, t->scale, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+    }
+    status = clProfEnqueueNDRangeKernel( queue, ekin, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+    status |= reduce_sum( queue, r, ekin_buffer, nthreads, t->state, 2, NULL );
+    status |= clProfEnqueueNDRangeKernel( queue, t->update, 1, NULL, &one, &one, 0, NULL, NULL );
+    status |= clProfEnqueueNDRangeKernel( queue, t->scale, 1, NULL, globalWorkSize, localWorkSize, 0, NULL, NULL );
+    return status;
+}
+
+/* append data to output. */
+/* write a coordinate array as float */
+static void write_floats(FILE *fp, const FPTYPE *x, int n)
+{
+    float buf[BLEN];
+    int i, j, m;
+
+    for (i=0; i<n; i+=m) {
+        m = (n-i < BLEN) ? n-i : BLEN;
+        for (j=0; j<m; ++j) buf[j] = x[i+j];
+        fwrite(buf, sizeof(float), m, fp);
+    }
+}
+
+/* header of a binary trajectory file */
+void write_traj_header(mdsys_t *sys, FILE *traj)
+{
+    float box = sys->box;
+
+    fwrite(trajmagic, 1, sizeof(trajmagic), traj);
+    fwrite(&sys->natoms, sizeof(int), 1, traj);
+    fwrite(&box, sizeof(float), 1, traj);
+}
+
+void write_energy(FILE *fp, mdsys_t *sys)
+{
+    fprintf(fp,"% 8d % 20.8f % 20.8f % 20.8f % 20.8f\n", sys->nfi, sys->temp, sys->ekin, sys->epot, sys->ekin+sys->epot);
+}
+
+void output_energy(mdsys_t *sys, FILE *erg)
+{
+    write_energy(stdout, sys);
+    write_energy(erg, sys);
+}
+
+void output_traj(mdsys_t *sys, FILE *traj, int trajformat)
+{
+    int i;
+
+    if (trajformat == TRAJ_NONE) return;
+    if (trajformat == TRAJ_BIN) {
+        fwrite(&sys->nfi, sizeof(int), 1, traj);
+        write_floats(traj, sys->rx, sys->natoms);
+        write_floats(traj, sys->ry, sys->natoms);
+        write_floats(traj, sys->rz, sys->natoms);
+        return;
+    }
+    fprintf(traj,"%d\n nfi=%d etot=%20.8f\n", sys->natoms, sys->nfi, sys->ekin+sys->epot);
+    for (i=0; i<sys->natoms; ++i) {
+      fprintf(traj, "Ar  %20.8f %20.8f %20.8f\n", sys->rx[i], sys->ry[i], sys->rz[i]);
+    }
+}
+
+void output(mdsys_t *sys, FILE *erg, FILE *traj, int trajformat)
+{
+    output_energy(sys, erg);
+    output_traj(sys, traj, trajformat);
+}
+
+/* copy a block of a binary restart to a device buffer, converting it
+ * through tmp if it was written with the other precision. Without a
+ * queue the block is only stored in tmp. */
+static cl_int restart_block(cl_command_queue queue, cl_mem buf, const char *data, int precision, int natoms, FPTYPE *tmp)
+{
+    int i;
+
+    if (queue && precision == sizeof(FPTYPE))
+        return clProfEnqueueWriteBuffer( queue, buf, CL_TRUE, 0, natoms * sizeof(FPTYPE), data, 0, NULL, NULL );
+
+    if (precision == sizeof(FPTYPE))
+        memcpy(tmp, data, natoms * sizeof(FPTYPE));
+    else for (i=0; i<natoms; ++i) {
+        if (precision == sizeof(float)) tmp[i] = ((const float *) data)[i];
+        else tmp[i] = ((const double *) data)[i];
+    }
+    if (!queue) return CL_SUCCESS;
+    return clProfEnqueueWriteBuffer( queue, buf, CL_TRUE, 0, natoms * sizeof(FPTYPE), tmp, 0, NULL, NULL );
+}
+
+/* parse a generator restart line, returns 0 if it is a file name and
+ * -1 if it is not valid */
+int parse_fcc(const char *spec, int natoms, FPTYPE box, fcc_t *g)
+{
+    char name[BLEN], t[BLEN], s[BLEN], extra[BLEN];
+    FPTYPE temp = FCC_TEMP;
+    unsigned int seed = FCC_SEED;
+    int n = sscanf(spec, "%s %s %s %s", name, t, s, extra);
+
+    if (n < 1 || strcmp(name, "fcc")) return 0;
+    /* every field present must convert, nothing may follow the seed */
+    if (n > 3 || (n > 1 && (get_real(t, &temp) || temp < 0.0))
+        || (n > 2 && get_seed(s, &seed))) {
+        fprintf(stderr, "the restart must be a file or fcc [temperature [seed]]\n");
+        return -1;
+    }
+    g->ncell = 1;
+    while (4.0 * g->ncell * g->ncell * g->ncell < natoms) g->ncell++;
+    g->a = box / g->ncell;
+    g->temp = temp;
+    g->seed = seed;
+    return 1;
+}
+
+/* same as fcc_hash and fcc_uniform of the kernels */
+static cl_uint fcc_hash(cl_uint x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+static FPTYPE fcc_uniform(cl_uint seed, cl_uint ctr)
+{
+    return (FPTYPE) ((fcc_hash(ctr + fcc_hash(seed)) >> 8) + 1) * (FPTYPE) 5.9604644775390625e-8;
+}
+
+/* width of the velocity distribution */
+FPTYPE fcc_width(const fcc_t *g, const cl_mdsys_t *sys)
+{
+    return sqrt(kboltz * g->temp / (mvsq2e * sys->mass));
+}
+
+/* drift c[] and scale factor to the exact temperature from the sums
+ * of vx, vy, vz and v^2 (3 natoms - 3 degrees of freedom) */
+void fcc_correction(const fcc_t *g, const cl_mdsys_t *sys, const double *sum, FPTYPE *c, FPTYPE *scale)
+{
+    double n = sys->natoms, sq;
+    int k;
+
+    sq = sum[3];
+    for (k = 0; k < 3; ++k) {
+        c[k] = sum[k] / n;
+        sq -= n * c[k] * c[k];
+    }
+    *scale = sq > 0.0 ? sqrt((3.0 * n - 3.0) * kboltz * g->temp / (mvsq2e * sys->mass * sq)) : 0.0;
+}
+
+/* Maxwell-Boltzmann velocities at g->temp from g->seed to buffers[k]
+ * + natoms, without net momentum */
+void fcc_velocities(const fcc_t *g, const cl_mdsys_t *sys, FPTYPE **buffers)
+{
+    FPTYPE *v[3], sd = fcc_width(g, sys), c[3], scale;
+    FPTYPE twopi = 6.283185307179586;
+    double sum[4] = { 0.0, 0.0, 0.0, 0.0 };
+    int i, k;
+
+    for (k = 0; k < 3; ++k) v[k] = buffers[k] + sys->natoms;
+    for (i = 0; i < sys->natoms; ++i) {
+        FPTYPE u0 = fcc_uniform(g->seed, 4 * i), u1 = fcc_uniform(g->seed, 4 * i + 1);
+        FPTYPE u2 = fcc_uniform(g->seed, 4 * i + 2), u3 = fcc_uniform(g->seed, 4 * i + 3);
+        FPTYPE g0 = sd * sqrt(-TWO * log(u0)), g1 = sd * sqrt(-TWO * log(u2));
+
+        v[0][i] = g0 * cos(twopi * u1);
+        v[1][i] = g0 * sin(twopi * u1);
+        v[2][i] = g1 * cos(twopi * u3);
+        for (k = 0; k < 3; ++k) {
+            sum[k] += v[k][i];
+            sum[3] += v[k][i] * v[k][i];
+        }
+    }
+    fcc_correction(g, sys, sum, c, &scale);
+    for (i = 0; i < sys->natoms; ++i)
+        for (k = 0; k < 3; ++k) v[k][i] = (v[k][i] - c[k]) * scale;
+}
+
+/* the lattice on the host, positions to buffers[k] and velocities to
+ * buffers[k] + natoms as from a text restart */
+static void fcc_host(const fcc_t *g, const cl_mdsys_t *sys, FPTYPE **buffers)
+{
+    FPTYPE off = (0.25 - HALF * g->ncell) * g->a;
+    int i, n = g->ncell;
+
+    for (i = 0; i < sys->natoms; ++i) {
+        int cell = i >> 2, b = i & 3;
+
+        buffers[0][i] = (cell % n + (b == 1 || b == 2 ? HALF : ZERO)) * g->a + off;
+        buffers[1][i] = (cell / n % n + (b == 1 || b == 3 ? HALF : ZERO)) * g->a + off;
+        buffers[2][i] = (cell / (n * n) + (b >= 2 ? HALF : ZERO)) * g->a + off;
+    }
+    fcc_velocities(g, sys, buffers);
+}
+
+/* copy positions and velocities from the staging buffers to the device */
+static int write_system(cl_command_queue queue, cl_mdsys_t *sys, FPTYPE **buffers)
+{
+    cl_int status;
+
+    status = clProfEnqueueWriteBuffer( queue, sys->rx, CL_TRUE, 0, sys->natoms * sizeof(FPTYPE), buffers[0], 0, NULL, NULL ); 
+    status |= clProfEnqueueWriteBuffer( queue, sys->ry, CL_TRUE, 0, sys->natoms * sizeof(FPTYPE), buffers[1], 0, NULL, NULL ); 
+    status |= clProfEnqueueWriteBuffer( queue, sys->rz, CL_TRUE, 0, sys->natoms * sizeof(FPTYPE), buffers[2], 0, NULL, NULL ); 
+    
+    status |= clProfEnqueueWriteBuffer( queue, sys->vx, CL_TRUE, 0, sys->natoms * sizeof(FPTYPE), buffers[0] + sys->natoms, 0, NULL, NULL ); 
+    status |= clProfEnqueueWriteBuffer( queue, sys->vy, CL_TRUE, 0, sys->natoms * sizeof(FPTYPE), buffers[1] + sys->natoms, 0, NULL, NULL ); 
+    status |= clProfEnqueueWriteBuffer( queue, sys->vz, CL_TRUE, 0, sys->natoms * sizeof(FPTYPE), buffers[2] + sys->natoms, 0, NULL, NULL ); 
+    CheckSuccess(status, 0);
+    return 0;
+}
+
+/* read a binary restart through mmap */
+static int read_restart_bin(const char *file, cl_command_queue queue, cl_mdsys_t *sys, FPTYPE **buffers, int *step)
+{
+    resthead_t head;
+    struct stat st;
+    const char *map;
+    size_t block;
+    cl_int status;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st)) {
+        close(fd);
+        return -1;
+    }
+    map = (const char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    memcpy(&head, map, sizeof(head));
+    block = (size_t) head.natoms * head.precision;
+    if (head.natoms != sys->natoms || (head.precision != sizeof(float) && head.precision != sizeof(double))
+        || (size_t) st.st_size < sizeof(head) + 6 * block) {
+        fprintf(stderr, "restart file %s does not match %d atoms\n", file, sys->natoms);
+        munmap((void *) map, st.st_size);
+        return -1;
+    }
+    if (fabs(head.box - sys->box) > 1.0e-6 * head.box)
+        fprintf(stderr, "warning: restart file box %g differs from the input box %g\n", head.box, (double) sys->box);
+
+    status = restart_block( queue, sys->rx, map + sizeof(head), head.precision, head.natoms, buffers[0] );
+    status |= restart_block( queue, sys->ry, map + sizeof(head) + block, head.precision, head.natoms, buffers[1] );
+    status |= restart_block( queue, sys->rz, map + sizeof(head) + 2 * block, head.precision, head.natoms, buffers[2] );
+    status |= restart_block( queue, sys->vx, map + sizeof(head) + 3 * block, head.precision, head.natoms, buffers[0] + head.natoms );
+    status |= restart_block( queue, sys->vy, map + sizeof(head) + 4 * block, head.precision, head.natoms, buffers[1] + head.natoms );
+    status |= restart_block( queue, sys->vz, map + sizeof(head) + 5 * block, head.precision, head.natoms, buffers[2] + head.natoms );
+    munmap((void *) map, st.st_size);
+    CheckSuccess(status, 0);
+
+    *step = head.step;
+    return 0;
+}
+
+/* read a restart file, binary or text, into the device buffers.
+ * buffers are 2 * natoms long and used as staging area, in zero-copy
+ * mode a text restart is read into the mapped buffers instead. Without
+ * a queue the positions and velocities are left in buffers[k] and
+ * buffers[k] + natoms, from where they are packed for the vec4 layout. */
+int read_restart(const char *file, cl_command_queue queue, cl_mdsys_t *sys, FPTYPE **buffers, int *step)
+{
+    char magic[sizeof(restmagic)];
+    cl_int status;
+    fcc_t fcc;
+    FILE *fp;
+    int i;
+
+    if (queue && sys->layout == LAYOUT_VEC4) {
+        size_t size = 4 * sys->natoms * sizeof(FPTYPE);
+        FPTYPE *q;
+
+        if (read_restart(file, NULL, sys, buffers, step)) return -1;
+        q = (FPTYPE *) malloc( 2 * size );
+        pack4(q, buffers[0], buffers[1], buffers[2], sys->natoms);
+        pack4(q + 4 * sys->natoms, buffers[0] + sys->natoms, buffers[1] + sys->natoms, buffers[2] + sys->natoms, sys->natoms);
+        status = clProfEnqueueWriteBuffer( queue, sys->r4, CL_TRUE, 0, size, q, 0, NULL, NULL );
+        status |= clProfEnqueueWriteBuffer( queue, sys->v4, CL_TRUE, 0, size, q + 4 * sys->natoms, 0, NULL, NULL );
+        free(q);
+        CheckSuccess(status, 0);
+        return 0;
+    }
+
+    /* generated on the host, main generates it on the device */
+    i = parse_fcc(file, sys->natoms, sys->box, &fcc);
+    if (i < 0) return -1;
+    if (i) {
+        *step = 0;
+        fcc_host(&fcc, sys, buffers);
+        if (!queue) return 0;
+        return write_system(queue, sys, buffers);
+    }
+
+    fp = fopen(file, "r");
+    if (!fp) return -1;
+
+    *step = 0;
+    if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) && !memcmp(magic, restmagic, sizeof(magic))) {
+        fclose(fp);
+        return read_restart_bin(file, queue, sys, buffers, step);
+    }
+    rewind(fp);
+
+    if (queue && sys->zerocopy) {
+	FPTYPE *v[6];
+
+	status = map_system( queue, sys, CL_MAP_WRITE, v );
+	CheckSuccess(status, 0);
+	for( i = 0; i < 2 * sys->natoms; ++i ){
+	    int k = i < sys->natoms ? 0 : 3, j = i < sys->natoms ? i : i - sys->natoms;
+#ifdef _USE_FLOAT
+	    fscanf( fp, "%f%f%f", v[k] + j, v[k+1] + j, v[k+2] + j);
+#else
+	    fscanf( fp, "%lf%lf%lf", v[k] + j, v[k+1] + j, v[k+2] + j);
+#endif
+	}
+	fclose(fp);
+	CheckSuccess(unmap_system( queue, sys, v ), 0);
+	return 0;
+    }
+
+    for( i = 0; i < 2 * sys->natoms; ++i ){
+#ifdef _USE_FLOAT
+      fscanf( fp, "%f%f%f", buffers[0] + i, buffers[1] + i, buffers[2] + i);
+#else
+      fscanf( fp, "%lf%lf%lf", buffers[0] + i, buffers[1] + i, buffers[2] + i);
+#endif
+    }
+    fclose(fp);
+    if (!queue) return 0;
+    return write_system(queue, sys, buffers);
+}
+
+/* write a block of a restart, in the original order of the atoms if
+ * they were reordered */
+static int write_block(FILE *fp, const FPTYPE *x, const int *perm, FPTYPE *tmp, int n)
+{
+    int i;
+
+    if (perm) {
+        for (i=0; i<n; ++i) tmp[perm[i]] = x[i];
+        x = tmp;
+    }
+    return fwrite(x, sizeof(FPTYPE), n, fp) == (size_t) n;
+}
+
+/* download positions and velocities and write them as binary restart,
+ * in zero-copy mode straight from the mapped buffers. The file is
+ * written under a temporary name and then renamed, so an interrupted
+ * run leaves the previous restart intact. */
+int write_restart(const char *file, cl_command_queue queue, cl_mdsys_t *sys, FPTYPE **buffers, int step)
+{
+    resthead_t head;
+    char tmpfile[BLEN + 4];
+    size_t size = sys->natoms * sizeof(FPTYPE);
+    FPTYPE *v[6] = { NULL, NULL, NULL, NULL, NULL, NULL }, *tmp = NULL;
+    int *perm = NULL;
+    cl_int status;
+    FILE *fp;
+    int i, ok;
+
+    if (sys->zerocopy) {
+	status = map_system( queue, sys, CL_MAP_READ, v );
+    } else if (sys->layout == LAYOUT_VEC4) {
+	FPTYPE *q = (FPTYPE *) malloc( 8 * size );
+
+	for (i=0; i<3; ++i) {
+	    v[i] = buffers[i];
+	    v[i+3] = buffers[i] + sys->natoms;
+	}
+	status = clProfEnqueueReadBuffer( queue, sys->r4, CL_TRUE, 0, 4 * size, q, 0, NULL, NULL );
+	status |= clProfEnqueueReadBuffer( queue, sys->v4, CL_TRUE, 0, 4 * size, q + 4 * sys->natoms, 0, NULL, NULL );
+	unpack4(q, v[0], v[1], v[2], sys->natoms);
+	unpack4(q + 4 * sys->natoms, v[3], v[4], v[5], sys->natoms);
+	free(q);
+    } else {
+	for (i=0; i<3; ++i) {
+	    v[i] = buffers[i];
+	    v[i+3] = buffers[i] + sys->natoms;
+	}
+	status = clProfEnqueueReadBuffer( queue, sys->rx, CL_TRUE, 0, size, v[0], 0, NULL, NULL );
+	status |= clProfEnqueueReadBuffer( queue, sys->ry, CL_TRUE, 0, size, v[1], 0, NULL, NULL );
+	status |= clProfEnqueueReadBuffer( queue, sys->rz, CL_TRUE, 0, size, v[2], 0, NULL, NULL );
+	status |= clProfEnqueueReadBuffer( queue, sys->vx, CL_TRUE, 0, size, v[3], 0, NULL, NULL );
+	status |= clProfEnqueueReadBuffer( queue, sys->vy, CL_TRUE, 0, size, v[4], 0, NULL, NULL );
+	status |= clProfEnqueueReadBuffer( queue, sys->vz, CL_TRUE, 0, size, v[5], 0, NULL, NULL );
+    }
+    if (sys->perm) {
+        perm = (int *) malloc( sys->natoms * sizeof(int) );
+        tmp = (FPTYPE *) malloc( size );
+        status |= clProfEnqueueReadBuffer( queue, sys->perm, CL_TRUE, 0, sys->natoms * sizeof(int), perm, 0, NULL, NULL );
+    }
+    CheckSuccess(status, 9);
+
+    memset(&head, 0, sizeof(head));
+    memcpy(head.magic, restmagic, sizeof(restmagic));
+    head.natoms = sys->natoms;
+    head.precision = sizeof(FPTYPE);
+    head.step = step;
+    head.box = sys->box;
+
+    snprintf(tmpfile, sizeof(tmpfile), "%s.tmp", file);
+    fp = fopen(tmpfile, "wb");
+    ok = fp && fwrite(&head, sizeof(head), 1, fp) == 1;
+    for (i=0; i<6; ++i) ok = ok && write_block(fp, v[i], perm, tmp, sys->natoms);
+    if (sys->zerocopy) CheckSuccess(unmap_system( queue, sys, v ), 9);
+    free(perm);
+    free(tmp);
+    if (!fp) {
+        perror("cannot write restart file");
+        return -1;
+    }
+    if (fclose(fp) || !ok || rename(tmpfile, file)) {
+        perror("cannot write restart file");
+        return -1;
+    }
+    return 0;
+}
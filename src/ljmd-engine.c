@@ -0,0 +1,506 @@
+/*
+ * libljmd: the MD engine of ljmd_CL behind the API of ljmd.h
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "ljmd_core.h"
+#include "ljmd.h"
+
+/* the engine of libljmd (see ljmd.h): the device, program and the
+ * kernels and buffers that do not depend on the system are created
+ * once, the force setup and the atoms once per loaded system. The
+ * atom buffers hold capacity atoms and are kept for smaller systems. */
+struct _ljmd_engine {
+    cl_device_id device;
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    mdopts_t opts;
+    int nthreads;
+    size_t global[1], local[1], *localsize;
+    cl_kernel ekin, verlet_first, verlet_second;
+    cl_mem epot_buffer, ekin_buffer, energy_buffer;
+    cl_reduce_t reduce;
+    /* the loaded system and its current setup, dirty after ljmd_set */
+    mdsys_t sys;
+    cl_mdsys_t cl_sys;
+    cl_force_t force;
+    cl_thermo_t thermo;
+    int loaded, dirty, capacity, nprint, step0, trajformat;
+    char restfile[BLEN], trajfile[BLEN], ergfile[BLEN];
+    FILE *erg, *traj;
+    FPTYPE *buffers[3];
+};
+
+/* the settings a built program is tied to */
+static int engine_fixed(const mdopts_t *a, const mdopts_t *b)
+{
+    return a->pbc != b->pbc || a->wgsize != b->wgsize || a->zerocopy != b->zerocopy || strcmp(a->progcache, b->progcache);
+}
+
+/* the paths of the program the engine leaves out */
+static int engine_check(ljmd_engine_t *e, const mdopts_t *o)
+{
+    if (o->layout != LAYOUT_SOA || o->integrate != INTEGRATE_SPLIT || o->ndevices != 1 || o->replicas > 1 || o->ensemble[0]
+        || o->reorder > 0 || o->respa > 1 || o->rdf > 0 || o->msd > 0 || o->restout[0]) {
+        fprintf( stderr, "\nThe engine runs one device with layout=soa and integrate=split, no ensembles, reorder,\n"
+                 "respa, rdf, msd or restout (see ljmd_checkpoint).\n" );
+        return -1;
+    }
+    if (o->forcemode == FORCE_TILED && !e->localsize) {
+        fprintf( stderr, "\nforce=tiled needs a work-group size, give wgsize or force=tiled to ljmd_create.\n" );
+        return -1;
+    }
+    if (o->table > 0 || o->potential != POT_LJ)
+        if (!force_kernels_table[o->forcemode]) {
+            fprintf( stderr, "\nThe tabulated potential supports force = brute | cell | nlist.\n" );
+            return -1;
+        }
+    return 0;
+}
+
+static void release_force(cl_force_t *f)
+{
+    cl_kernel k[7] = { f->force, f->azzero, f->cell_clear, f->cell_bin, f->nlist_check, f->nlist_build, f->nlist_done };
+    cl_mem m[11] = { f->table, f->cell_count, f->cell_atoms, f->cell_overflow, f->rebuild, f->nlist_count, f->nlist,
+                     f->nlist_overflow, f->rx0, f->ry0, f->rz0 };
+    int i;
+
+    for (i = 0; i < 7; i++) if (k[i]) clReleaseKernel( k[i] );
+    for (i = 0; i < 11; i++) if (m[i]) clReleaseMemObject( m[i] );
+    memset( f, 0, sizeof(*f) );
+}
+
+static void release_thermo(cl_thermo_t *t)
+{
+    if (t->update) clReleaseKernel( t->update );
+    if (t->scale) clReleaseKernel( t->scale );
+    if (t->state) clReleaseMemObject( t->state );
+    memset( t, 0, sizeof(*t) );
+}
+
+static void release_atoms(cl_mdsys_t *sys)
+{
+    cl_mem m[9] = { sys->rx, sys->ry, sys->rz, sys->vx, sys->vy, sys->vz, sys->fx, sys->fy, sys->fz };
+    int i;
+
+    for (i = 0; i < 9; i++) if (m[i]) clReleaseMemObject( m[i] );
+}
+
+/* energies of the current forces and velocities */
+static cl_int engine_energies(ljmd_engine_t *e)
+{
+    FPTYPE energy[2];
+    cl_int status;
+
+    status = clProfEnqueueNDRangeKernel( e->queue, e->ekin, 1, NULL, e->global, e->localsize, 0, NULL, NULL );
+    status |= reduce_sum( e->queue, &e->reduce, e->epot_buffer, e->nthreads, e->energy_buffer, 0, NULL );
+    status |= reduce_sum( e->queue, &e->reduce, e->ekin_buffer, e->nthreads, e->energy_buffer, 1, NULL );
+    status |= clProfEnqueueReadBuffer( e->queue, e->energy_buffer, CL_TRUE, 0, 2 * sizeof(FPTYPE), energy, 0, NULL, NULL );
+    e->sys.epot = energy[0];
+    e->sys.ekin = energy[1] * HALF * mvsq2e * e->sys.mass;
+    e->sys.temp = TWO * e->sys.ekin / ( THREE * e->sys.natoms - THREE ) / kboltz;
+    return status;
+}
+
+/* set up the force, integration and thermostat kernels for the loaded
+ * system and the current settings, and compute the forces */
+static int engine_setup(ljmd_engine_t *e)
+{
+    mdsys_t *sys = &e->sys;
+    cl_mdsys_t *c = &e->cl_sys;
+    mdopts_t o = e->opts;
+    FPTYPE dtmf = HALF * sys->dt / mvsq2e / sys->mass, boxinv = 1.0 / sys->box;
+    cl_int status;
+
+    release_force( &e->force );
+    release_thermo( &e->thermo );
+    if (o.potential != POT_LJ && o.table == 0) o.table = DEFAULT_TABLE;
+    if (o.table > 0 && o.rswitch <= 0.0) o.rswitch = RESPA_RSWITCH * sys->rcut;
+    if (init_force( e->context, e->queue, e->program, &e->force, sys, &o, e->epot_buffer ) != CL_SUCCESS) return -1;
+    status = bind_force( c, &e->force, e->localsize );
+    status |= clSetMultKernelArgs( e->force.azzero, 0, 4, KArg(c->fx), KArg(c->fy), KArg(c->fz), KArg(c->natoms) );
+    status |= clProfEnqueueNDRangeKernel( e->queue, e->force.azzero, 1, NULL, e->global, e->localsize, 0, NULL, NULL );
+    status |= compute_force( e->queue, &e->force, e->global, e->localsize, NULL );
+
+    status |= clSetMultKernelArgs( e->ekin, 0, 5, KArg(c->vx), KArg(c->vy), KArg(c->vz), KArg(c->natoms),
+                                   KArg(e->ekin_buffer) );
+    status |= clSetMultKernelArgs( e->verlet_first, 0, 14, KArg(c->fx), KArg(c->fy), KArg(c->fz), KArg(c->rx),
+                                   KArg(c->ry), KArg(c->rz), KArg(c->vx), KArg(c->vy), KArg(c->vz), KArg(c->natoms),
+                                   KArg(sys->dt), KArg(dtmf), KArg(sys->box), KArg(boxinv) );
+    status |= clSetMultKernelArgs( e->verlet_second, 0, 9, KArg(c->fx), KArg(c->fy), KArg(c->fz), KArg(c->vx),
+                                   KArg(c->vy), KArg(c->vz), KArg(c->natoms), KArg(sys->dt), KArg(dtmf) );
+    status |= engine_energies( e );
+
+    /* by default the thermostat keeps the temperature of the setup */
+    if (status == CL_SUCCESS && o.thermostat != THERMO_NONE) {
+        if (o.temp <= 0.0) o.temp = sys->temp;
+        status = init_thermo( e->context, e->program, &e->thermo, c, sys, &o );
+    }
+    if (status != CL_SUCCESS) {
+        fprintf( stderr, "\nCannot set up the system: %s\n", CLErrString( status ) );
+        return -1;
+    }
+    e->dirty = 0;
+    return 0;
+}
+
+/* write the energies and the trajectory frame of the current step */
+static int engine_output(ljmd_engine_t *e)
+{
+    size_t size = e->sys.natoms * sizeof(FPTYPE);
+    cl_int status = CL_SUCCESS;
+
+    if (e->traj) {
+        status = clProfEnqueueReadBuffer( e->queue, e->cl_sys.rx, CL_FALSE, 0, size, e->buffers[0], 0, NULL, NULL );
+        status |= clProfEnqueueReadBuffer( e->queue, e->cl_sys.ry, CL_FALSE, 0, size, e->buffers[1], 0, NULL, NULL );
+        status |= clProfEnqueueReadBuffer( e->queue, e->cl_sys.rz, CL_TRUE, 0, size, e->buffers[2], 0, NULL, NULL );
+        e->sys.rx = e->buffers[0];
+        e->sys.ry = e->buffers[1];
+        e->sys.rz = e->buffers[2];
+        output_traj( &e->sys, e->traj, e->trajformat );
+    }
+    if (status != CL_SUCCESS) {
+        fprintf( stderr, "\nCannot read the positions: %s\n", CLErrString( status ) );
+        return -1;
+    }
+    if (e->erg) write_energy( e->erg, &e->sys );
+    return 0;
+}
+
+static void engine_close(ljmd_engine_t *e)
+{
+    if (e->erg) fclose( e->erg );
+    if (e->traj) fclose( e->traj );
+    e->erg = e->traj = NULL;
+}
+
+ljmd_engine_t *ljmd_create(const char *device, int nthreads, const char *options)
+{
+    ljmd_engine_t *e = (ljmd_engine_t *) calloc( 1, sizeof(ljmd_engine_t) );
+    const char *sourcecode =
+    #include <opencl_kernels_as_string.h>
+    ;
+    char devtype[BLEN], buildflags[4*BLEN], tok[2*BLEN], *val;
+    size_t max_wgsize;
+    cl_int status, err[6];
+    int n;
+
+    e->opts = default_opts;
+    for (; options && sscanf( options, "%399s%n", tok, &n ) == 1; options += n) {
+        val = strchr( tok, '=' );
+        if (!val) {
+            fprintf( stderr, "option '%s' is not keyword=value\n", tok );
+            free( e );
+            return NULL;
+        }
+        *val++ = '\0';
+        if (set_option( &e->opts, tok, val )) {
+            free( e );
+            return NULL;
+        }
+    }
+    e->opts.jit = 0;
+    if (e->opts.wgsize <= 0 && e->opts.forcemode == FORCE_TILED) e->opts.wgsize = DEFAULT_WGSIZE;
+    if (e->opts.wgsize > 0) e->localsize = e->local;
+    if (engine_check( e, &e->opts )) {
+        free( e );
+        return NULL;
+    }
+
+    snprintf( devtype, sizeof(devtype), "%s", device );
+    if (InitOpenCLEnvironment( devtype, &e->device, &e->context, &e->queue ) != CL_SUCCESS) {
+        fprintf( stderr, "Program Error! OpenCL Environment was not initialized correctly.\n" );
+        free( e );
+        return NULL;
+    }
+
+    /* the work sizes of ljmd_CL without the autotuner */
+    if (nthreads <= 0) nthreads = strcmp( devtype, "cpu" ) ? 1024 : 16;
+    if (e->localsize) {
+        clGetDeviceInfo( e->device, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_wgsize), &max_wgsize, NULL );
+        if (e->opts.wgsize > max_wgsize) {
+            fprintf( stderr, "\nThe work-group size %d exceeds the device maximum of %ld.\n", e->opts.wgsize, max_wgsize );
+            ljmd_destroy( e );
+            return NULL;
+        }
+        nthreads = ( ( nthreads + e->opts.wgsize - 1 ) / e->opts.wgsize ) * e->opts.wgsize;
+        e->local[0] = e->opts.wgsize;
+    }
+    e->nthreads = nthreads;
+    e->global[0] = nthreads;
+
+    /* without jit the program does not depend on the system */
+    kernel_build_flags( buildflags, sizeof(buildflags), &e->sys, &e->opts, 0 );
+    e->program = BuildProgramCached( e->context, e->device, sourcecode, buildflags, progcache_dir( &e->opts ), &status );
+    if (status != CL_SUCCESS) {
+        fprintf( stderr, "\nCannot build the kernels: %s\n", CLErrString( status ) );
+        ljmd_destroy( e );
+        return NULL;
+    }
+    e->ekin = clCreateKernel( e->program, "opencl_ekin", &err[0] );
+    e->verlet_first = clCreateKernel( e->program, "opencl_verlet_first", &err[1] );
+    e->verlet_second = clCreateKernel( e->program, "opencl_verlet_second", &err[2] );
+    e->epot_buffer = clCreateBuffer( e->context, CL_MEM_READ_WRITE, ( nthreads + 1 ) * sizeof(FPTYPE), NULL, &err[3] );
+    e->ekin_buffer = clCreateBuffer( e->context, CL_MEM_READ_WRITE, nthreads * sizeof(FPTYPE), NULL, &err[4] );
+    e->energy_buffer = clCreateBuffer( e->context, CL_MEM_READ_WRITE, 2 * sizeof(FPTYPE), NULL, &err[5] );
+    status = err[0] | err[1] | err[2] | err[3] | err[4] | err[5];
+    status |= init_reduce( e->context, e->device, e->program, &e->reduce, nthreads + 1 );
+    if (status != CL_SUCCESS) {
+        fprintf( stderr, "\nCannot create the kernels: %s\n", CLErrString( status ) );
+        ljmd_destroy( e );
+        return NULL;
+    }
+    if (e->opts.zerocopy == ZEROCOPY_AUTO) e->opts.zerocopy = host_unified( e->device );
+    return e;
+}
+
+void ljmd_destroy(ljmd_engine_t *e)
+{
+    int i;
+
+    if (!e) return;
+    engine_close( e );
+    release_force( &e->force );
+    release_thermo( &e->thermo );
+    release_atoms( &e->cl_sys );
+    for (i = 0; i < 3; i++) free( e->buffers[i] );
+    if (e->ekin) clReleaseKernel( e->ekin );
+    if (e->verlet_first) clReleaseKernel( e->verlet_first );
+    if (e->verlet_second) clReleaseKernel( e->verlet_second );
+    if (e->reduce.kernel) clReleaseKernel( e->reduce.kernel );
+    if (e->reduce.partial) clReleaseMemObject( e->reduce.partial );
+    if (e->epot_buffer) clReleaseMemObject( e->epot_buffer );
+    if (e->ekin_buffer) clReleaseMemObject( e->ekin_buffer );
+    if (e->energy_buffer) clReleaseMemObject( e->energy_buffer );
+    if (e->program) clReleaseProgram( e->program );
+    if (e->queue) clReleaseCommandQueue( e->queue );
+    if (e->context) clReleaseContext( e->context );
+    free( e );
+}
+
+int ljmd_load(ljmd_engine_t *e, const char *input)
+{
+    cl_mdsys_t *c = &e->cl_sys;
+    mdopts_t o = e->opts;
+    cl_int status = CL_SUCCESS;
+    FILE *in = fopen( input, "r" );
+    int i;
+
+    if (!in) {
+        perror( input );
+        return -1;
+    }
+    e->loaded = 0;
+    engine_close( e );
+    i = read_input( in, &e->sys, e->restfile, e->trajfile, e->ergfile, &e->nprint ) || read_options( in, &o );
+    fclose( in );
+    if (i || engine_check( e, &o )) return -1;
+    if (engine_fixed( &o, &e->opts ) || o.jit) {
+        fprintf( stderr, "\npbc, wgsize, progcache, zerocopy and jit are fixed by ljmd_create.\n" );
+        return -1;
+    }
+    e->opts = o;
+    e->trajformat = o.trajformat;
+
+    /* atoms, kept if the buffers of the last system are large enough */
+    if (e->sys.natoms > e->capacity) {
+        size_t size = e->sys.natoms * sizeof(FPTYPE);
+        cl_int err[9];
+
+        release_atoms( c );
+        c->rx = clCreateBuffer( e->context, atom_mem_flags(e->opts.zerocopy), size, NULL, &err[0] );
+        c->ry = clCreateBuffer( e->context, atom_mem_flags(e->opts.zerocopy), size, NULL, &err[1] );
+        c->rz = clCreateBuffer( e->context, atom_mem_flags(e->opts.zerocopy), size, NULL, &err[2] );
+        c->vx = clCreateBuffer( e->context, atom_mem_flags(e->opts.zerocopy), size, NULL, &err[3] );
+        c->vy = clCreateBuffer( e->context, atom_mem_flags(e->opts.zerocopy), size, NULL, &err[4] );
+        c->vz = clCreateBuffer( e->context, atom_mem_flags(e->opts.zerocopy), size, NULL, &err[5] );
+        c->fx = clCreateBuffer( e->context, atom_mem_flags(e->opts.zerocopy), size, NULL, &err[6] );
+        c->fy = clCreateBuffer( e->context, atom_mem_flags(e->opts.zerocopy), size, NULL, &err[7] );
+        c->fz = clCreateBuffer( e->context, atom_mem_flags(e->opts.zerocopy), size, NULL, &err[8] );
+        for (i = 0; i < 9; i++) status |= err[i];
+        for (i = 0; i < 3; i++) e->buffers[i] = (FPTYPE *) realloc( e->buffers[i], 2 * size );
+        e->capacity = status == CL_SUCCESS ? e->sys.natoms : 0;
+        if (status != CL_SUCCESS) {
+            fprintf( stderr, "\nCannot allocate %d atoms: %s\n", e->sys.natoms, CLErrString( status ) );
+            return -1;
+        }
+    }
+    c->natoms = e->sys.natoms;
+    c->box = e->sys.box;
+    c->mass = e->sys.mass;
+    c->zerocopy = e->opts.zerocopy;
+    c->perm = NULL;
+    c->layout = LAYOUT_SOA;
+    c->r4 = c->v4 = c->f4 = NULL;
+    e->sys.rx = e->buffers[0];
+    e->sys.ry = e->buffers[1];
+    e->sys.rz = e->buffers[2];
+
+    if (read_restart( e->restfile, e->queue, c, e->buffers, &e->step0 )) {
+        perror( "cannot read restart file" );
+        return -1;
+    }
+    e->sys.nfi = 0;
+    if (engine_setup( e )) return -1;
+
+    e->erg = fopen( e->ergfile, "w" );
+    if (e->trajformat != TRAJ_NONE) {
+        e->traj = fopen( e->trajfile, "wb" );
+        if (e->traj && e->trajformat == TRAJ_BIN) write_traj_header( &e->sys, e->traj );
+    }
+    if (!e->erg || ( e->trajformat != TRAJ_NONE && !e->traj )) {
+        perror( "cannot open the output files" );
+        engine_close( e );
+        return -1;
+    }
+    e->loaded = 1;
+    return engine_output( e );
+}
+
+int ljmd_set(ljmd_engine_t *e, const char *key, const char *value)
+{
+    static const char *sysparams[] = { "dt", "nsteps", "nprint", "mass", "epsilon", "sigma", "rcut", NULL };
+    mdopts_t o = e->opts;
+    int k = find_name( sysparams, key );
+
+    if (k >= 0) {
+        FPTYPE *v[7] = { &e->sys.dt, NULL, NULL, &e->sys.mass, &e->sys.epsilon, &e->sys.sigma, &e->sys.rcut };
+
+        if (!e->loaded) {
+            fprintf( stderr, "%s is a setting of the loaded system\n", key );
+            return -1;
+        }
+        if (k == 1 || k == 2) {
+            int n, least = k == 1 ? 0 : 1;
+
+            if (get_count( value, &n ) || n < least) {
+                fprintf( stderr, "%s must be a whole number of at least %d, not '%s'\n", key, least, value );
+                return -1;
+            }
+            if (k == 1) e->sys.nsteps = n;
+            else e->nprint = n;
+        } else {
+            FPTYPE x;
+
+            if (get_real( value, &x ) || x <= 0.0) {
+                fprintf( stderr, "%s must be a positive number, not '%s'\n", key, value );
+                return -1;
+            }
+            *v[k] = x;
+        }
+        e->cl_sys.mass = e->sys.mass;
+        e->dirty = 1;
+        return 0;
+    }
+    if (set_option( &o, key, value ) || engine_check( e, &o )) return -1;
+    if (engine_fixed( &o, &e->opts ) || o.jit) {
+        fprintf( stderr, "%s is fixed by ljmd_create\n", key );
+        return -1;
+    }
+    e->opts = o;
+    e->dirty = 1;
+    return 0;
+}
+
+int ljmd_run(ljmd_engine_t *e, int nsteps)
+{
+    cl_int status = CL_SUCCESS;
+    int s;
+
+    if (!e->loaded || ( e->dirty && engine_setup( e ) )) return -1;
+    if (nsteps <= 0) nsteps = e->sys.nsteps;
+    for (s = 0; s < nsteps && status == CL_SUCCESS; s++) {
+        /* the state after step nfi-1 is written with label nfi, as
+         * in the energy files of ljmd_CL */
+        ++e->sys.nfi;
+        if ((e->sys.nfi % e->nprint) == 0) {
+            status = engine_energies( e );
+            if (status == CL_SUCCESS && engine_output( e )) return -1;
+        }
+        status |= clProfEnqueueNDRangeKernel( e->queue, e->verlet_first, 1, NULL, e->global, e->localsize, 0, NULL, NULL );
+        status |= compute_force( e->queue, &e->force, e->global, e->localsize, NULL );
+        status |= clProfEnqueueNDRangeKernel( e->queue, e->verlet_second, 1, NULL, e->global, e->localsize, 0, NULL, NULL );
+        if (e->opts.thermostat != THERMO_NONE)
+            status |= thermostat( e->queue, &e->thermo, e->ekin, &e->reduce, e->ekin_buffer, e->nthreads, e->sys.nfi,
+                                  e->global, e->localsize );
+    }
+    if (status == CL_SUCCESS) status = engine_energies( e );
+    if (status == CL_SUCCESS && USES_CELLS(e->force.mode)) status = read_overflow( e->queue, &e->force, CL_TRUE );
+    if (status != CL_SUCCESS) {
+        fprintf( stderr, "\nStep %d failed: %s\n", e->sys.nfi, CLErrString( status ) );
+        return -1;
+    }
+    if (e->erg) fflush( e->erg );
+    return USES_CELLS(e->force.mode) && report_overflow( &e->force ) ? -1 : 0;
+}
+
+int ljmd_query(ljmd_engine_t *e, ljmd_state_t *state)
+{
+    if (!e->loaded) return -1;
+    state->natoms = e->sys.natoms;
+    state->nfi = e->sys.nfi;
+    state->box = e->sys.box;
+    state->temp = e->sys.temp;
+    state->ekin = e->sys.ekin;
+    state->epot = e->sys.epot;
+    state->etot = e->sys.ekin + e->sys.epot;
+    return 0;
+}
+
+/* copy three device arrays of the atoms to double arrays */
+static int engine_get(ljmd_engine_t *e, cl_mem *m, double **out)
+{
+    size_t size = e->sys.natoms * sizeof(FPTYPE);
+    cl_int status = CL_SUCCESS;
+    int i, k;
+
+    if (!e->loaded) return -1;
+    for (k = 0; k < 3; k++)
+        status |= clProfEnqueueReadBuffer( e->queue, m[k], CL_TRUE, 0, size, e->buffers[k], 0, NULL, NULL );
+    if (status != CL_SUCCESS) return -1;
+    for (k = 0; k < 3; k++)
+        for (i = 0; i < e->sys.natoms; i++) out[k][i] = e->buffers[k][i];
+    return 0;
+}
+
+int ljmd_get_positions(ljmd_engine_t *e, double *rx, double *ry, double *rz)
+{
+    cl_mem m[3] = { e->cl_sys.rx, e->cl_sys.ry, e->cl_sys.rz };
+    double *out[3] = { rx, ry, rz };
+
+    return engine_get( e, m, out );
+}
+
+int ljmd_get_velocities(ljmd_engine_t *e, double *vx, double *vy, double *vz)
+{
+    cl_mem m[3] = { e->cl_sys.vx, e->cl_sys.vy, e->cl_sys.vz };
+    double *out[3] = { vx, vy, vz };
+
+    return engine_get( e, m, out );
+}
+
+int ljmd_checkpoint(ljmd_engine_t *e, const char *file)
+{
+    if (!e->loaded) return -1;
+    return write_restart( file, e->queue, &e->cl_sys, e->buffers, e->step0 + e->sys.nfi );
+}
+
+int ljmd_restore(ljmd_engine_t *e, const char *file)
+{
+    int step;
+
+    if (!e->loaded) return -1;
+    if (read_restart( file, e->queue, &e->cl_sys, e->buffers, &step )) {
+        perror( "cannot read restart file" );
+        return -1;
+    }
+    /* continue counting from the step of the restart */
+    e->step0 = 0;
+    e->sys.nfi = step;
+    return engine_setup( e );
+}
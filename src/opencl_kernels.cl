@@ -1,17 +1,36 @@
 
 #ifdef _USE_FLOAT
 #define FPTYPE float
+#else
+#pragma OPENCL EXTENSION cl_khr_fp64: enable
+#define FPTYPE double
+#endif
+
+/* mixed precision (-D_USE_MIXED): positions, velocities, the sums of
+ * forces and energies and the integration are double, the pair terms
+ * of the force kernels are PAIRTYPE float. The differences of the
+ * positions are taken in double before they are rounded to float.
+ * The float constants are exact in double expressions as well. */
+#ifdef _USE_MIXED
+#define PAIRTYPE float
+#else
+#define PAIRTYPE FPTYPE
+#endif
+
+#if defined(_USE_FLOAT) || defined(_USE_MIXED)
 #define ZERO    0.0f
 #define HALF    0.5f
 #define ONE     1.0f
+#define TWO     2.0f
+#define THREE   3.0f
 #define SIX     6.0f
 #define TWELVE 12.0f
 #else
-#pragma OPENCL EXTENSION cl_khr_fp64: enable
-#define FPTYPE double
 #define ZERO    0.0
 #define HALF    0.5
 #define ONE     1.0
+#define TWO     2.0
+#define THREE   3.0
 #define SIX     6.0
 #define TWELVE 12.0
 #endif
@@ -38,29 +57,85 @@ __kernel void opencl_ekin(  __global FPTYPE * vx, __global FPTYPE * vy, __global
   int nths = get_global_size( 0 );
   int id_th = get_global_id( 0 );
   int loc_id = id_th;
+  FPTYPE ekin_th = ZERO;
 
-  ekin[id_th] = ZERO;
-    
   while( loc_id < natoms ) {
 
-    ekin[id_th] += vx[loc_id] * vx[loc_id] + vy[loc_id] * vy[loc_id] + vz[loc_id] * vz[loc_id];
+    ekin_th += vx[loc_id] * vx[loc_id] + vy[loc_id] * vy[loc_id] + vz[loc_id] * vz[loc_id];
 
     loc_id += nths;
   }
+
+  ekin[id_th] = ekin_th;
   //    sys->ekin *= 0.5*mvsq2e*sys->mass;
   //    sys->temp  = 2.0*sys->ekin/(3.0*sys->natoms-3.0)/kboltz;
 }
 
 
-inline FPTYPE pbc(FPTYPE x, const FPTYPE boxby2, const FPTYPE box)
+/* sum of in[0..n-1]: every work-group adds up a strided part of it,
+ * reduces it as a tree in local memory and stores the result in
+ * out[offset + group]. The local size must be a power of two. */
+__kernel void opencl_reduce( __global FPTYPE * in, const int n, __global FPTYPE * out, const int offset, __local FPTYPE * scratch ) {
+
+  int nths = get_global_size( 0 );
+  int lid = get_local_id( 0 );
+  int i;
+  FPTYPE sum = ZERO;
+
+  for( i = get_global_id( 0 ); i < n; i += nths ) sum += in[i];
+  scratch[lid] = sum;
+
+  for( i = get_local_size( 0 ) / 2; i > 0; i >>= 1 ) {
+    barrier( CLK_LOCAL_MEM_FENCE );
+    if( lid < i ) scratch[lid] += scratch[lid + i];
+  }
+
+  if( lid == 0 ) out[offset + get_group_id( 0 )] = scratch[0];
+}
+
+
+/* system constants: with _JIT the host defines them at build time
+ * (JIT_C12 ... JIT_BOXINV) so that the compiler can fold them, else
+ * they are the kernel arguments of the same name, which all kernels
+ * using them keep to have the same signature in both cases */
+#ifdef _JIT
+#define C12    JIT_C12
+#define C6     JIT_C6
+#define RCSQ   JIT_RCSQ
+#define BOXBY2 JIT_BOXBY2
+#define BOX    JIT_BOX
+#define BOXINV JIT_BOXINV
+#else
+#define C12    c12
+#define C6     c6
+#define RCSQ   rcsq
+#define BOXBY2 boxby2
+#define BOX    box
+#define BOXINV boxinv
+#endif
+
+
+/* minimum image convention. With _PBC_RINT the branch-free form is
+ * used, it needs the positions wrapped into the box (see verlet_first) */
+#ifdef _PBC_RINT
+inline FPTYPE pbc(FPTYPE x, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv)
+{
+    return x - box * rint( x * boxinv );
+}
+#else
+inline FPTYPE pbc(FPTYPE x, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv)
 {
     while (x >  boxby2) x -= box;
     while (x < -boxby2) x += box;
     return x;
 }
+#endif
 
 
-__kernel void opencl_force( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const FPTYPE c12, const FPTYPE c6, const FPTYPE rcsq, const FPTYPE boxby2, const FPTYPE box ){
+/* all force kernels compute the forces on the atoms ifirst..ilast-1
+ * (all of them, unless they are shared between several devices)
+ * from the positions of all natoms atoms */
+__kernel void opencl_force(__global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast ){
 
   int nths = get_global_size( 0 );
   int id_th = get_global_id( 0 );
@@ -69,7 +144,8 @@ __kernel void opencl_force( __global FPTYPE * fx, __global FPTYPE * fy, __global
   /* zero energy and forces */
   epot[id_th] = ZERO;
 
-  while( loc_id < natoms ){
+  loc_id = ifirst + id_th;
+  while( loc_id < ilast ){
 
     fx[ loc_id ] = ZERO;
     fy[ loc_id ] = ZERO;
@@ -77,8 +153,8 @@ __kernel void opencl_force( __global FPTYPE * fx, __global FPTYPE * fy, __global
     loc_id += nths;
   }
   
-  loc_id = id_th;
-  while( loc_id < natoms ) {
+  loc_id = ifirst + id_th;
+  while( loc_id < ilast ) {
 
     int j;
     FPTYPE rx1, ry1, rz1;
@@ -88,26 +164,26 @@ __kernel void opencl_force( __global FPTYPE * fx, __global FPTYPE * fy, __global
     
     for( j = 0; j < natoms; ++j ) {
 
-      FPTYPE loc_rx, loc_ry, loc_rz, rsq;
+      PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
       
       /* particles have no interactions with themselves */
       if ( loc_id == j) continue;
       
       /* get distance between particle i and j */
-      loc_rx = pbc(rx1 - rx[j], boxby2, box);
-      loc_ry = pbc(ry1 - ry[j], boxby2, box);
-      loc_rz = pbc(rz1 - rz[j], boxby2, box);
+      loc_rx = pbc(rx1 - rx[j], BOXBY2, BOX, BOXINV);
+      loc_ry = pbc(ry1 - ry[j], BOXBY2, BOX, BOXINV);
+      loc_rz = pbc(rz1 - rz[j], BOXBY2, BOX, BOXINV);
       rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
       
       /* compute force and energy if within cutoff */
-      if (rsq < rcsq) {
-  	FPTYPE r6, rinv, ffac;
+      if (rsq < RCSQ) {
+  	PAIRTYPE r6, rinv, ffac;
 	
   	rinv = ONE / rsq;
   	r6 = rinv * rinv * rinv;
         
-  	ffac = ( TWELVE * c12 * r6 - SIX * c6 ) * r6 * rinv;
-  	epot[id_th] += HALF * r6 * ( c12 * r6 - c6 );
+  	ffac = ( TWELVE * C12 * r6 - SIX * C6 ) * r6 * rinv;
+  	epot[id_th] += HALF * r6 * ( C12 * r6 - C6 );
 	
   	fx[loc_id] += loc_rx * ffac;
   	fy[loc_id] += loc_ry * ffac;
@@ -121,42 +197,1698 @@ __kernel void opencl_force( __global FPTYPE * fx, __global FPTYPE * fy, __global
 }
 
 
-__kernel void opencl_verlet_first( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int natoms, const FPTYPE dt, const FPTYPE dtmf) {
+/* same as opencl_force, but each work-group copies a tile of
+ * local_size j-positions to local memory and all its work-items
+ * reuse it. Needs a global size that is a multiple of the local size.
+ * If that is known at build time it is given as WGSIZE. */
+#ifdef WGSIZE
+#define TILE_ATTR __attribute__((reqd_work_group_size(WGSIZE, 1, 1)))
+#define TILE_SIZE WGSIZE
+#else
+#define TILE_ATTR
+#define TILE_SIZE get_local_size( 0 )
+#endif
+
+__kernel TILE_ATTR void opencl_force_tiled( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast, __local FPTYPE * tx, __local FPTYPE * ty, __local FPTYPE * tz ){
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int lid = get_local_id( 0 );
+  int lsize = TILE_SIZE;
+  int loc_id;
+  FPTYPE epot_th = ZERO;
+
+  /* the loop condition is the same for the whole work-group,
+   * so that all its work-items reach the barriers */
+  for( loc_id = ifirst + id_th; loc_id - lid < ilast; loc_id += nths ) {
+
+    int tile, active = ( loc_id < ilast );
+    FPTYPE rx1, ry1, rz1, fx1, fy1, fz1;
+    rx1 = active ? rx[loc_id] : ZERO;
+    ry1 = active ? ry[loc_id] : ZERO;
+    rz1 = active ? rz[loc_id] : ZERO;
+    fx1 = fy1 = fz1 = ZERO;
+
+    for( tile = 0; tile < natoms; tile += lsize ) {
+
+      int k, n = min( lsize, natoms - tile );
+
+      /* wait until the previous tile has been used */
+      barrier( CLK_LOCAL_MEM_FENCE );
+      if( lid < n ) {
+	tx[lid] = rx[tile + lid];
+	ty[lid] = ry[tile + lid];
+	tz[lid] = rz[tile + lid];
+      }
+      barrier( CLK_LOCAL_MEM_FENCE );
+
+      if( !active ) continue;
+
+      for( k = 0; k < n; ++k ) {
+
+	PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
+
+	/* particles have no interactions with themselves */
+	if ( loc_id == tile + k ) continue;
+
+	/* get distance between particle i and j */
+	loc_rx = pbc(rx1 - tx[k], BOXBY2, BOX, BOXINV);
+	loc_ry = pbc(ry1 - ty[k], BOXBY2, BOX, BOXINV);
+	loc_rz = pbc(rz1 - tz[k], BOXBY2, BOX, BOXINV);
+	rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
+
+	/* compute force and energy if within cutoff */
+	if (rsq < RCSQ) {
+	  PAIRTYPE r6, rinv, ffac;
+
+	  rinv = ONE / rsq;
+	  r6 = rinv * rinv * rinv;
+
+	  ffac = ( TWELVE * C12 * r6 - SIX * C6 ) * r6 * rinv;
+	  epot_th += HALF * r6 * ( C12 * r6 - C6 );
+
+	  fx1 += loc_rx * ffac;
+	  fy1 += loc_ry * ffac;
+	  fz1 += loc_rz * ffac;
+	}
+      }
+    }
+
+    if( active ) {
+      fx[loc_id] = fx1;
+      fy[loc_id] = fy1;
+      fz[loc_id] = fz1;
+    }
+  }
+
+  epot[id_th] = epot_th;
+}
+
+
+/* cell list: the box is divided in ncell^3 cells with side >= rcut,
+ * so all partners of an atom are found in its own and the 26
+ * neighbouring cells. Each cell holds up to cellmax atom indices.
+ * The list is only rebuilt when rebuild[0] is set. */
+inline int cell_coord(FPTYPE x, const FPTYPE box, const FPTYPE cellinv, const int ncell)
+{
+    int c;
+
+    /* positions are not wrapped into the box by the integrator */
+    x -= box * floor( x / box );
+    c = (int) ( x * cellinv );
+    return clamp( c, 0, ncell - 1 );
+}
+
+
+__kernel void opencl_cell_clear( __global int * cell_count, const int ncells, __global int * rebuild ) {
 
   int nths = get_global_size( 0 );
   int id_th = get_global_id( 0 );
   int loc_id = id_th;
 
-  /* first part: propagate velocities by half and positions by full step */
-  while( loc_id < natoms ){
-  
-    vx[loc_id] += dtmf * fx[loc_id];
-    vy[loc_id] += dtmf * fy[loc_id];
-    vz[loc_id] += dtmf * fz[loc_id];
-    rx[loc_id] += dt*vx[loc_id];
-    ry[loc_id] += dt*vy[loc_id];
-    rz[loc_id] += dt*vz[loc_id];
-  
+  if( !rebuild[0] ) return;
+
+  while( loc_id < ncells ) {
+
+    cell_count[ loc_id ] = 0;
     loc_id += nths;
   }
 }
 
 
-__kernel void opencl_verlet_second( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int natoms, const FPTYPE dt, const FPTYPE dtmf) {
+__kernel void opencl_cell_bin( __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global int * cell_count, __global int * cell_atoms, const int cellmax, const int ncell, const FPTYPE cellinv, const FPTYPE box, __global int * cell_overflow, __global int * rebuild ) {
 
   int nths = get_global_size( 0 );
   int id_th = get_global_id( 0 );
   int loc_id = id_th;
 
-  /* second part: propagate velocities by another half step */
-  while( loc_id < natoms ){
+  if( !rebuild[0] ) return;
+
+  while( loc_id < natoms ) {
+
+    int c, slot;
+
+    c = ( cell_coord( rz[loc_id], BOX, cellinv, ncell ) * ncell
+	  + cell_coord( ry[loc_id], BOX, cellinv, ncell ) ) * ncell
+	  + cell_coord( rx[loc_id], BOX, cellinv, ncell );
+
+    slot = atomic_inc( &cell_count[c] );
+    if( slot < cellmax ) cell_atoms[ c * cellmax + slot ] = loc_id;
+    /* keep track of the capacity that would have been needed */
+    else atomic_max( cell_overflow, slot + 1 );
+
+    loc_id += nths;
+  }
+}
+
+
+__kernel void opencl_force_cell( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast, __global int * cell_count, __global int * cell_atoms, const int cellmax, const int ncell, const FPTYPE cellinv ){
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id = ifirst + id_th;
+  FPTYPE epot_th = ZERO;
+
+  /* with less than three cells per side the -1 and +1 neighbours
+   * are the same cell (or the cell itself): visit each only once */
+  int lo = ( ncell > 2 ) ? -1 : 0;
+  int hi = ( ncell > 1 ) ?  1 : 0;
+
+  while( loc_id < ilast ) {
+
+    int cx, cy, cz, dx, dy, dz;
+    FPTYPE rx1, ry1, rz1, fx1, fy1, fz1;
+    rx1 = rx[loc_id];
+    ry1 = ry[loc_id];
+    rz1 = rz[loc_id];
+    fx1 = fy1 = fz1 = ZERO;
+
+    cx = cell_coord( rx1, BOX, cellinv, ncell );
+    cy = cell_coord( ry1, BOX, cellinv, ncell );
+    cz = cell_coord( rz1, BOX, cellinv, ncell );
+
+    for( dz = lo; dz <= hi; ++dz ) {
+      for( dy = lo; dy <= hi; ++dy ) {
+	for( dx = lo; dx <= hi; ++dx ) {
+
+	  int c, k, n;
+
+	  c = ( ( ( cz + dz + ncell ) % ncell ) * ncell
+		+ ( cy + dy + ncell ) % ncell ) * ncell
+		+ ( cx + dx + ncell ) % ncell;
+	  n = min( cell_count[c], cellmax );
+
+	  for( k = 0; k < n; ++k ) {
+
+	    PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
+	    int j = cell_atoms[ c * cellmax + k ];
+
+	    /* particles have no interactions with themselves */
+	    if ( loc_id == j ) continue;
+
+	    /* get distance between particle i and j */
+	    loc_rx = pbc(rx1 - rx[j], BOXBY2, BOX, BOXINV);
+	    loc_ry = pbc(ry1 - ry[j], BOXBY2, BOX, BOXINV);
+	    loc_rz = pbc(rz1 - rz[j], BOXBY2, BOX, BOXINV);
+	    rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
+
+	    /* compute force and energy if within cutoff */
+	    if (rsq < RCSQ) {
+	      PAIRTYPE r6, rinv, ffac;
+
+	      rinv = ONE / rsq;
+	      r6 = rinv * rinv * rinv;
+
+	      ffac = ( TWELVE * C12 * r6 - SIX * C6 ) * r6 * rinv;
+	      epot_th += HALF * r6 * ( C12 * r6 - C6 );
+
+	      fx1 += loc_rx * ffac;
+	      fy1 += loc_ry * ffac;
+	      fz1 += loc_rz * ffac;
+	    }
+	  }
+	}
+      }
+    }
+
+    fx[loc_id] = fx1;
+    fy[loc_id] = fy1;
+    fz[loc_id] = fz1;
+
+    loc_id += nths;
+  }
+
+  epot[id_th] = epot_th;
+}
+
+
+/* Verlet neighbor list: partners within rcut + skin (the half list
+ * used with newton's 3rd law keeps each pair once), stored
+ * with stride natoms (nlist[k * natoms + i]) for coalesced access.
+ * It stays valid until some atom has moved by more than skin / 2. */
+__kernel void opencl_nlist_check( __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, __global FPTYPE * rx0, __global FPTYPE * ry0, __global FPTYPE * rz0, const int natoms, const FPTYPE halfskinsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, __global int * rebuild ) {
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id = id_th;
+
+  /* a rebuild is already pending (the reference positions may not be set yet) */
+  if( rebuild[0] ) return;
+
+  while( loc_id < natoms ) {
+
+    FPTYPE dx, dy, dz;
+
+    dx = pbc(rx[loc_id] - rx0[loc_id], BOXBY2, BOX, BOXINV);
+    dy = pbc(ry[loc_id] - ry0[loc_id], BOXBY2, BOX, BOXINV);
+    dz = pbc(rz[loc_id] - rz0[loc_id], BOXBY2, BOX, BOXINV);
+
+    if( dx * dx + dy * dy + dz * dz > halfskinsq ) rebuild[0] = 1;
+
+    loc_id += nths;
+  }
+}
+
+
+__kernel void opencl_nlist_build( __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, __global FPTYPE * rx0, __global FPTYPE * ry0, __global FPTYPE * rz0, const int natoms, const FPTYPE rlsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, __global int * cell_count, __global int * cell_atoms, const int cellmax, const int ncell, const FPTYPE cellinv, __global int * nlist_count, __global int * nlist, const int nlistmax, __global int * nlist_overflow, __global int * rebuild, const int half ) {
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id = id_th;
+
+  int lo = ( ncell > 2 ) ? -1 : 0;
+  int hi = ( ncell > 1 ) ?  1 : 0;
+
+  if( !rebuild[0] ) return;
+
+  while( loc_id < natoms ) {
+
+    int cx, cy, cz, dx, dy, dz, nn = 0;
+    FPTYPE rx1, ry1, rz1;
+    rx1 = rx[loc_id];
+    ry1 = ry[loc_id];
+    rz1 = rz[loc_id];
+
+    cx = cell_coord( rx1, BOX, cellinv, ncell );
+    cy = cell_coord( ry1, BOX, cellinv, ncell );
+    cz = cell_coord( rz1, BOX, cellinv, ncell );
+
+    for( dz = lo; dz <= hi; ++dz ) {
+      for( dy = lo; dy <= hi; ++dy ) {
+	for( dx = lo; dx <= hi; ++dx ) {
+
+	  int c, k, n;
+
+	  c = ( ( ( cz + dz + ncell ) % ncell ) * ncell
+		+ ( cy + dy + ncell ) % ncell ) * ncell
+		+ ( cx + dx + ncell ) % ncell;
+	  n = min( cell_count[c], cellmax );
+
+	  for( k = 0; k < n; ++k ) {
+
+	    FPTYPE loc_rx, loc_ry, loc_rz;
+	    int j = cell_atoms[ c * cellmax + k ];
+
+	    if ( loc_id == j ) continue;
+
+	    /* a half list stores each pair only once: the owner of the
+	     * pair alternates with the parity of i + j, so that every atom
+	     * gets about half of its neighbors (j > i alone does not) */
+	    if ( half && ( ( j > loc_id ) == ( ( loc_id + j ) & 1 ) ) ) continue;
+
+	    loc_rx = pbc(rx1 - rx[j], BOXBY2, BOX, BOXINV);
+	    loc_ry = pbc(ry1 - ry[j], BOXBY2, BOX, BOXINV);
+	    loc_rz = pbc(rz1 - rz[j], BOXBY2, BOX, BOXINV);
+
+	    if( loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz < rlsq ) {
+	      if( nn < nlistmax ) nlist[ nn * natoms + loc_id ] = j;
+	      ++nn;
+	    }
+	  }
+	}
+      }
+    }
+
+    if( nn > nlistmax ) atomic_max( nlist_overflow, nn );
+    nlist_count[loc_id] = min( nn, nlistmax );
+
+    /* reference positions for the displacement check */
+    rx0[loc_id] = rx1;
+    ry0[loc_id] = ry1;
+    rz0[loc_id] = rz1;
+
+    loc_id += nths;
+  }
+}
+
+
+/* single work-item: clear the rebuild flag and count the rebuilds */
+__kernel void opencl_nlist_done( __global int * rebuild ) {
+
+  if( rebuild[0] ) {
+    rebuild[0] = 0;
+    rebuild[1] += 1;
+  }
+}
+
+
+__kernel void opencl_force_nlist( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast, __global int * nlist_count, __global int * nlist ){
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id = ifirst + id_th;
+  FPTYPE epot_th = ZERO;
+
+  while( loc_id < ilast ) {
+
+    int k, n;
+    FPTYPE rx1, ry1, rz1, fx1, fy1, fz1;
+    rx1 = rx[loc_id];
+    ry1 = ry[loc_id];
+    rz1 = rz[loc_id];
+    fx1 = fy1 = fz1 = ZERO;
+
+    n = nlist_count[loc_id];
+    for( k = 0; k < n; ++k ) {
+
+      PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
+      int j = nlist[ k * natoms + loc_id ];
+
+      /* get distance between particle i and j */
+      loc_rx = pbc(rx1 - rx[j], BOXBY2, BOX, BOXINV);
+      loc_ry = pbc(ry1 - ry[j], BOXBY2, BOX, BOXINV);
+      loc_rz = pbc(rz1 - rz[j], BOXBY2, BOX, BOXINV);
+      rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
+
+      /* compute force and energy if within cutoff */
+      if (rsq < RCSQ) {
+	PAIRTYPE r6, rinv, ffac;
+
+	rinv = ONE / rsq;
+	r6 = rinv * rinv * rinv;
+
+	ffac = ( TWELVE * C12 * r6 - SIX * C6 ) * r6 * rinv;
+	epot_th += HALF * r6 * ( C12 * r6 - C6 );
+
+	fx1 += loc_rx * ffac;
+	fy1 += loc_ry * ffac;
+	fz1 += loc_rz * ffac;
+      }
+    }
+
+    fx[loc_id] = fx1;
+    fy[loc_id] = fy1;
+    fz[loc_id] = fz1;
+
+    loc_id += nths;
+  }
+
+  epot[id_th] = epot_th;
+}
+
+
+/* newton's 3rd law: each pair of the half list is computed once and
+ * the force is added to both atoms. Several work-items update the
+ * same atom, so the accumulation uses a compare-and-swap loop. */
+#if defined(_USE_FLOAT) || defined(cl_khr_int64_base_atomics)
+
+#ifdef _USE_FLOAT
+inline void atomic_add_fp( volatile __global FPTYPE * p, const FPTYPE val )
+{
+    uint old, sum;
+
+    do {
+	old = as_uint( *p );
+	sum = as_uint( as_float( old ) + val );
+    } while( atomic_cmpxchg( (volatile __global uint *) p, old, sum ) != old );
+}
+#else
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics: enable
+inline void atomic_add_fp( volatile __global FPTYPE * p, const FPTYPE val )
+{
+    ulong old, sum;
+
+    do {
+	old = as_ulong( *p );
+	sum = as_ulong( as_double( old ) + val );
+    } while( atom_cmpxchg( (volatile __global ulong *) p, old, sum ) != old );
+}
+#endif
+
+
+__kernel void opencl_force_newton( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast, __global int * nlist_count, __global int * nlist ){
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id = ifirst + id_th;
+  FPTYPE epot_th = ZERO;
+
+  /* forces have been zeroed by opencl_azzero */
+  while( loc_id < ilast ) {
+
+    int k, n;
+    FPTYPE rx1, ry1, rz1, fx1, fy1, fz1;
+    rx1 = rx[loc_id];
+    ry1 = ry[loc_id];
+    rz1 = rz[loc_id];
+    fx1 = fy1 = fz1 = ZERO;
+
+    n = nlist_count[loc_id];
+    for( k = 0; k < n; ++k ) {
+
+      PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
+      int j = nlist[ k * natoms + loc_id ];
+
+      /* get distance between particle i and j */
+      loc_rx = pbc(rx1 - rx[j], BOXBY2, BOX, BOXINV);
+      loc_ry = pbc(ry1 - ry[j], BOXBY2, BOX, BOXINV);
+      loc_rz = pbc(rz1 - rz[j], BOXBY2, BOX, BOXINV);
+      rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
+
+      /* compute force and energy if within cutoff */
+      if (rsq < RCSQ) {
+	PAIRTYPE r6, rinv, ffac;
+
+	rinv = ONE / rsq;
+	r6 = rinv * rinv * rinv;
+
+	ffac = ( TWELVE * C12 * r6 - SIX * C6 ) * r6 * rinv;
+	epot_th += r6 * ( C12 * r6 - C6 );
+
+	fx1 += loc_rx * ffac;
+	fy1 += loc_ry * ffac;
+	fz1 += loc_rz * ffac;
+
+	atomic_add_fp( &fx[j], -loc_rx * ffac );
+	atomic_add_fp( &fy[j], -loc_ry * ffac );
+	atomic_add_fp( &fz[j], -loc_rz * ffac );
+      }
+    }
+
+    atomic_add_fp( &fx[loc_id], fx1 );
+    atomic_add_fp( &fy[loc_id], fy1 );
+    atomic_add_fp( &fz[loc_id], fz1 );
 
-    vx[loc_id] += dtmf * fx[loc_id];
-    vy[loc_id] += dtmf * fy[loc_id];
-    vz[loc_id] += dtmf * fz[loc_id];
-    
     loc_id += nths;
   }
+
+  epot[id_th] = epot_th;
+}
+
+#endif
+
+
+/* reordering of the atoms along a Morton curve of their cells: the
+ * atoms get the key of their cell (10 bits per axis interleaved), the
+ * (key, index) pairs are sorted with a bitonic network over n2, a power
+ * of two, and all per atom arrays are gathered in the sorted order */
+inline uint morton_spread(uint x)
+{
+    x &= 0x3ff;
+    x = ( x | ( x << 16 ) ) & 0x030000ff;
+    x = ( x | ( x <<  8 ) ) & 0x0300f00f;
+    x = ( x | ( x <<  4 ) ) & 0x030c30c3;
+    x = ( x | ( x <<  2 ) ) & 0x09249249;
+    return x;
 }
 
+__kernel void opencl_reorder_key( __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, const FPTYPE box, const FPTYPE cellinv, const int ncell, __global uint * keys, __global int * idx, const int n2 ) {
+
+  int nths = get_global_size( 0 );
+  int loc_id = get_global_id( 0 );
+
+  while( loc_id < n2 ) {
+
+    /* the padding sorts to the end */
+    uint key = 0xffffffff;
 
+    if( loc_id < natoms )
+      key = morton_spread( cell_coord( rx[loc_id], box, cellinv, ncell ) )
+	| ( morton_spread( cell_coord( ry[loc_id], box, cellinv, ncell ) ) << 1 )
+	| ( morton_spread( cell_coord( rz[loc_id], box, cellinv, ncell ) ) << 2 );
+    keys[loc_id] = key;
+    idx[loc_id] = loc_id;
+
+    loc_id += nths;
+  }
+}
+
+/* one compare and exchange pass (k, j) of the bitonic sort, the index
+ * breaks ties so that atoms of a cell keep their order */
+__kernel void opencl_reorder_sort( __global uint * keys, __global int * idx, const int j, const int k, const int n2 ) {
+
+  int nths = get_global_size( 0 );
+  int loc_id = get_global_id( 0 );
+
+  while( loc_id < n2 ) {
+
+    int l = loc_id ^ j;
+
+    if( l > loc_id ) {
+      uint ki = keys[loc_id], kl = keys[l];
+      int ii = idx[loc_id], il = idx[l];
+      int up = ( loc_id & k ) == 0;
+      int greater = ki > kl || ( ki == kl && ii > il );
+
+      if( greater == up ) {
+	keys[loc_id] = kl;
+	keys[l] = ki;
+	idx[loc_id] = il;
+	idx[l] = ii;
+      }
+    }
+
+    loc_id += nths;
+  }
+}
+
+__kernel void opencl_reorder_gather( __global FPTYPE * src, __global int * idx, const int natoms, __global FPTYPE * dst ) {
+
+  int nths = get_global_size( 0 );
+  int loc_id = get_global_id( 0 );
+
+  while( loc_id < natoms ) {
+    dst[loc_id] = src[idx[loc_id]];
+    loc_id += nths;
+  }
+}
+
+__kernel void opencl_reorder_gather_int( __global int * src, __global int * idx, const int natoms, __global int * dst ) {
+
+  int nths = get_global_size( 0 );
+  int loc_id = get_global_id( 0 );
+
+  while( loc_id < natoms ) {
+    dst[loc_id] = src[idx[loc_id]];
+    loc_id += nths;
+  }
+}
+
+/* positions back in the original order, perm[i] is the original
+ * index of the atom at i */
+__kernel void opencl_reorder_scatter( __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, __global int * perm, const int natoms, __global FPTYPE * sx, __global FPTYPE * sy, __global FPTYPE * sz ) {
+
+  int nths = get_global_size( 0 );
+  int loc_id = get_global_id( 0 );
+
+  while( loc_id < natoms ) {
+    int i = perm[loc_id];
+
+    sx[i] = rx[loc_id];
+    sy[i] = ry[loc_id];
+    sz[i] = rz[loc_id];
+    loc_id += nths;
+  }
+}
+
+
+__kernel void opencl_verlet_first( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int natoms, const FPTYPE dt, const FPTYPE dtmf, const FPTYPE box, const FPTYPE boxinv) {
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id = id_th;
+
+  /* first part: propagate velocities by half and positions by full step */
+  while( loc_id < natoms ){
+  
+    vx[loc_id] += dtmf * fx[loc_id];
+    vy[loc_id] += dtmf * fy[loc_id];
+    vz[loc_id] += dtmf * fz[loc_id];
+    rx[loc_id] += dt*vx[loc_id];
+    ry[loc_id] += dt*vy[loc_id];
+    rz[loc_id] += dt*vz[loc_id];
+#ifdef _PBC_RINT
+    /* keep the atoms in the primary cell */
+    rx[loc_id] -= BOX * floor( rx[loc_id] * BOXINV );
+    ry[loc_id] -= BOX * floor( ry[loc_id] * BOXINV );
+    rz[loc_id] -= BOX * floor( rz[loc_id] * BOXINV );
+#endif
+  
+    loc_id += nths;
+  }
+}
+
+
+__kernel void opencl_verlet_second( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int natoms, const FPTYPE dt, const FPTYPE dtmf) {
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id = id_th;
+
+  /* second part: propagate velocities by another half step */
+  while( loc_id < natoms ){
+
+    vx[loc_id] += dtmf * fx[loc_id];
+    vy[loc_id] += dtmf * fy[loc_id];
+    vz[loc_id] += dtmf * fz[loc_id];
+    
+    loc_id += nths;
+  }
+}
+
+
+/* second part of step n and first part of step n+1 in one pass,
+ * optionally with the kinetic energy of step n */
+__kernel void opencl_verlet_fused( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int natoms, const FPTYPE dt, const FPTYPE dtmf, const FPTYPE box, const FPTYPE boxinv, __global FPTYPE * ekin, const int doekin) {
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id = id_th;
+  FPTYPE ekin_th = ZERO;
+
+  while( loc_id < natoms ){
+
+    FPTYPE vx1, vy1, vz1, rx1, ry1, rz1;
+
+    vx1 = vx[loc_id] + dtmf * fx[loc_id];
+    vy1 = vy[loc_id] + dtmf * fy[loc_id];
+    vz1 = vz[loc_id] + dtmf * fz[loc_id];
+    ekin_th += vx1 * vx1 + vy1 * vy1 + vz1 * vz1;
+
+    vx1 += dtmf * fx[loc_id];
+    vy1 += dtmf * fy[loc_id];
+    vz1 += dtmf * fz[loc_id];
+    rx1 = rx[loc_id] + dt * vx1;
+    ry1 = ry[loc_id] + dt * vy1;
+    rz1 = rz[loc_id] + dt * vz1;
+#ifdef _PBC_RINT
+    rx1 -= BOX * floor( rx1 * BOXINV );
+    ry1 -= BOX * floor( ry1 * BOXINV );
+    rz1 -= BOX * floor( rz1 * BOXINV );
+#endif
+
+    vx[loc_id] = vx1;
+    vy[loc_id] = vy1;
+    vz[loc_id] = vz1;
+    rx[loc_id] = rx1;
+    ry[loc_id] = ry1;
+    rz[loc_id] = rz1;
+
+    loc_id += nths;
+  }
+
+  if( doekin ) ekin[id_th] = ekin_th;
+}
+
+
+/* r-RESPA inner forces: the pair forces within the inner cutoff rcsq,
+ * switched off between ron and that cutoff by S = 1 + x^2 (2x - 3) with
+ * x = (r - ron) * swinv. The force is the gradient of S U, so that the
+ * inner steps conserve energy; the outer part of the forces is the full
+ * force minus this one. The energy is taken from the full force, the
+ * epot buffer is not written. With _JIT RCSQ is the full cutoff, so
+ * these kernels use their rcsq argument. */
+inline PAIRTYPE lj_inner(const PAIRTYPE rsq, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE ron, const PAIRTYPE swinv)
+{
+    PAIRTYPE r6, rinv, ffac;
+
+    rinv = ONE / rsq;
+    r6 = rinv * rinv * rinv;
+    ffac = ( TWELVE * c12 * r6 - SIX * c6 ) * r6 * rinv;
+    if (rsq > ron * ron) {
+        PAIRTYPE r = sqrt( rsq ), x = ( r - ron ) * swinv;
+        PAIRTYPE s = ONE + x * x * ( TWO * x - THREE );
+        PAIRTYPE ds = SIX * x * ( x - ONE ) * swinv;
+
+        ffac = s * ffac - r6 * ( c12 * r6 - c6 ) * ds / r;
+    }
+    return ffac;
+}
+
+
+__kernel void opencl_force_inner( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast, const PAIRTYPE ron, const PAIRTYPE swinv ){
+
+  int nths = get_global_size( 0 );
+  int loc_id;
+
+  for( loc_id = ifirst + get_global_id( 0 ); loc_id < ilast; loc_id += nths ) {
+
+    int j;
+    FPTYPE rx1, ry1, rz1, fx1, fy1, fz1;
+    rx1 = rx[loc_id];
+    ry1 = ry[loc_id];
+    rz1 = rz[loc_id];
+    fx1 = fy1 = fz1 = ZERO;
+
+    for( j = 0; j < natoms; ++j ) {
+
+      PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
+
+      if ( loc_id == j ) continue;
+
+      loc_rx = pbc(rx1 - rx[j], BOXBY2, BOX, BOXINV);
+      loc_ry = pbc(ry1 - ry[j], BOXBY2, BOX, BOXINV);
+      loc_rz = pbc(rz1 - rz[j], BOXBY2, BOX, BOXINV);
+      rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
+
+      if (rsq < rcsq) {
+	PAIRTYPE ffac = lj_inner( rsq, C12, C6, ron, swinv );
+
+	fx1 += loc_rx * ffac;
+	fy1 += loc_ry * ffac;
+	fz1 += loc_rz * ffac;
+      }
+    }
+
+    fx[loc_id] = fx1;
+    fy[loc_id] = fy1;
+    fz[loc_id] = fz1;
+  }
+}
+
+
+__kernel void opencl_force_cell_inner( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast, __global int * cell_count, __global int * cell_atoms, const int cellmax, const int ncell, const FPTYPE cellinv, const PAIRTYPE ron, const PAIRTYPE swinv ){
+
+  int nths = get_global_size( 0 );
+  int loc_id;
+
+  /* see opencl_force_cell */
+  int lo = ( ncell > 2 ) ? -1 : 0;
+  int hi = ( ncell > 1 ) ?  1 : 0;
+
+  for( loc_id = ifirst + get_global_id( 0 ); loc_id < ilast; loc_id += nths ) {
+
+    int cx, cy, cz, dx, dy, dz;
+    FPTYPE rx1, ry1, rz1, fx1, fy1, fz1;
+    rx1 = rx[loc_id];
+    ry1 = ry[loc_id];
+    rz1 = rz[loc_id];
+    fx1 = fy1 = fz1 = ZERO;
+
+    cx = cell_coord( rx1, BOX, cellinv, ncell );
+    cy = cell_coord( ry1, BOX, cellinv, ncell );
+    cz = cell_coord( rz1, BOX, cellinv, ncell );
+
+    for( dz = lo; dz <= hi; ++dz ) {
+      for( dy = lo; dy <= hi; ++dy ) {
+	for( dx = lo; dx <= hi; ++dx ) {
+
+	  int c, k, n;
+
+	  c = ( ( ( cz + dz + ncell ) % ncell ) * ncell
+		+ ( cy + dy + ncell ) % ncell ) * ncell
+		+ ( cx + dx + ncell ) % ncell;
+	  n = min( cell_count[c], cellmax );
+
+	  for( k = 0; k < n; ++k ) {
+
+	    PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
+	    int j = cell_atoms[ c * cellmax + k ];
+
+	    if ( loc_id == j ) continue;
+
+	    loc_rx = pbc(rx1 - rx[j], BOXBY2, BOX, BOXINV);
+	    loc_ry = pbc(ry1 - ry[j], BOXBY2, BOX, BOXINV);
+	    loc_rz = pbc(rz1 - rz[j], BOXBY2, BOX, BOXINV);
+	    rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
+
+	    if (rsq < rcsq) {
+	      PAIRTYPE ffac = lj_inner( rsq, C12, C6, ron, swinv );
+
+	      fx1 += loc_rx * ffac;
+	      fy1 += loc_ry * ffac;
+	      fz1 += loc_rz * ffac;
+	    }
+	  }
+	}
+      }
+    }
+
+    fx[loc_id] = fx1;
+    fy[loc_id] = fy1;
+    fz[loc_id] = fz1;
+  }
+}
+
+
+__kernel void opencl_force_nlist_inner( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast, __global int * nlist_count, __global int * nlist, const PAIRTYPE ron, const PAIRTYPE swinv ){
+
+  int nths = get_global_size( 0 );
+  int loc_id;
+
+  for( loc_id = ifirst + get_global_id( 0 ); loc_id < ilast; loc_id += nths ) {
+
+    int k, n;
+    FPTYPE rx1, ry1, rz1, fx1, fy1, fz1;
+    rx1 = rx[loc_id];
+    ry1 = ry[loc_id];
+    rz1 = rz[loc_id];
+    fx1 = fy1 = fz1 = ZERO;
+
+    n = nlist_count[loc_id];
+    for( k = 0; k < n; ++k ) {
+
+      PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
+      int j = nlist[ k * natoms + loc_id ];
+
+      loc_rx = pbc(rx1 - rx[j], BOXBY2, BOX, BOXINV);
+      loc_ry = pbc(ry1 - ry[j], BOXBY2, BOX, BOXINV);
+      loc_rz = pbc(rz1 - rz[j], BOXBY2, BOX, BOXINV);
+      rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
+
+      if (rsq < rcsq) {
+	PAIRTYPE ffac = lj_inner( rsq, C12, C6, ron, swinv );
+
+	fx1 += loc_rx * ffac;
+	fy1 += loc_ry * ffac;
+	fz1 += loc_rz * ffac;
+      }
+    }
+
+    fx[loc_id] = fx1;
+    fy[loc_id] = fy1;
+    fz[loc_id] = fz1;
+  }
+}
+
+
+/* r-RESPA half kick of the velocities with the outer forces, the
+ * full forces f minus the inner forces g */
+__kernel void opencl_respa_kick( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * gx, __global FPTYPE * gy, __global FPTYPE * gz, __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int natoms, const FPTYPE dtmf ) {
+
+  int nths = get_global_size( 0 );
+  int loc_id;
+
+  for( loc_id = get_global_id( 0 ); loc_id < natoms; loc_id += nths ) {
+    vx[loc_id] += dtmf * ( fx[loc_id] - gx[loc_id] );
+    vy[loc_id] += dtmf * ( fy[loc_id] - gy[loc_id] );
+    vz[loc_id] += dtmf * ( fz[loc_id] - gz[loc_id] );
+  }
+}
+
+
+/* packed layout (layout=vec4): positions, velocities and forces of an
+ * atom in one FPTYPE4 (x, y, z and a zero w), so that the force kernels
+ * load a partner with one vector access and use the vector built-ins.
+ * The w components stay zero, which keeps dot() a 3d product. */
+#ifdef _USE_FLOAT
+#define FPTYPE4 float4
+#else
+#define FPTYPE4 double4
+#endif
+
+#ifdef _USE_MIXED
+#define PAIRTYPE4 float4
+#define TO_PAIR4(v) convert_float4(v)
+#define TO_FP4(v) convert_double4(v)
+#else
+#define PAIRTYPE4 FPTYPE4
+#define TO_PAIR4(v) (v)
+#define TO_FP4(v) (v)
+#endif
+
+#ifdef _PBC_RINT
+inline FPTYPE4 pbc4(FPTYPE4 d, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv)
+{
+    return d - box * rint( d * boxinv );
+}
+#else
+inline FPTYPE4 pbc4(FPTYPE4 d, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv)
+{
+    d.x = pbc(d.x, boxby2, box, boxinv);
+    d.y = pbc(d.y, boxby2, box, boxinv);
+    d.z = pbc(d.z, boxby2, box, boxinv);
+    return d;
+}
+#endif
+
+__kernel void opencl_force4( __global FPTYPE4 * f, __global FPTYPE4 * r, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast ){
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id;
+  FPTYPE epot_th = ZERO;
+
+  for( loc_id = ifirst + id_th; loc_id < ilast; loc_id += nths ) {
+
+    int j;
+    FPTYPE4 r1 = r[loc_id], f1 = (FPTYPE4)( ZERO, ZERO, ZERO, ZERO );
+
+    for( j = 0; j < natoms; ++j ) {
+
+      PAIRTYPE4 d;
+      PAIRTYPE rsq;
+
+      /* particles have no interactions with themselves */
+      if ( loc_id == j ) continue;
+
+      d = TO_PAIR4( pbc4( r1 - r[j], BOXBY2, BOX, BOXINV ) );
+      rsq = dot( d, d );
+
+      if (rsq < RCSQ) {
+	PAIRTYPE r6, rinv, ffac;
+
+	rinv = ONE / rsq;
+	r6 = rinv * rinv * rinv;
+
+	ffac = ( TWELVE * C12 * r6 - SIX * C6 ) * r6 * rinv;
+	epot_th += HALF * r6 * ( C12 * r6 - C6 );
+	f1 += TO_FP4( d * ffac );
+      }
+    }
+
+    f[loc_id] = f1;
+  }
+
+  epot[id_th] = epot_th;
+}
+
+
+/* opencl_force_tiled with the tiles of positions as FPTYPE4 */
+__kernel TILE_ATTR void opencl_force_tiled4( __global FPTYPE4 * f, __global FPTYPE4 * r, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast, __local FPTYPE4 * t ){
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int lid = get_local_id( 0 );
+  int lsize = TILE_SIZE;
+  int loc_id;
+  FPTYPE epot_th = ZERO;
+
+  for( loc_id = ifirst + id_th; loc_id - lid < ilast; loc_id += nths ) {
+
+    int tile, active = ( loc_id < ilast );
+    FPTYPE4 zero = (FPTYPE4)( ZERO, ZERO, ZERO, ZERO );
+    FPTYPE4 r1 = active ? r[loc_id] : zero, f1 = zero;
+
+    for( tile = 0; tile < natoms; tile += lsize ) {
+
+      int k, n = min( lsize, natoms - tile );
+
+      barrier( CLK_LOCAL_MEM_FENCE );
+      if( lid < n ) t[lid] = r[tile + lid];
+      barrier( CLK_LOCAL_MEM_FENCE );
+
+      if( !active ) continue;
+
+      for( k = 0; k < n; ++k ) {
+
+	PAIRTYPE4 d;
+	PAIRTYPE rsq;
+
+	if ( loc_id == tile + k ) continue;
+
+	d = TO_PAIR4( pbc4( r1 - t[k], BOXBY2, BOX, BOXINV ) );
+	rsq = dot( d, d );
+
+	if (rsq < RCSQ) {
+	  PAIRTYPE r6, rinv, ffac;
+
+	  rinv = ONE / rsq;
+	  r6 = rinv * rinv * rinv;
+
+	  ffac = ( TWELVE * C12 * r6 - SIX * C6 ) * r6 * rinv;
+	  epot_th += HALF * r6 * ( C12 * r6 - C6 );
+	  f1 += TO_FP4( d * ffac );
+	}
+      }
+    }
+
+    if( active ) f[loc_id] = f1;
+  }
+
+  epot[id_th] = epot_th;
+}
+
+
+__kernel void opencl_verlet_first4( __global FPTYPE4 * f, __global FPTYPE4 * r, __global FPTYPE4 * v, const int natoms, const FPTYPE dt, const FPTYPE dtmf, const FPTYPE box, const FPTYPE boxinv) {
+
+  int nths = get_global_size( 0 );
+  int loc_id;
+
+  for( loc_id = get_global_id( 0 ); loc_id < natoms; loc_id += nths ) {
+
+    FPTYPE4 v1 = v[loc_id] + dtmf * f[loc_id];
+    FPTYPE4 r1 = r[loc_id] + dt * v1;
+#ifdef _PBC_RINT
+    r1 -= BOX * floor( r1 * BOXINV );
+#endif
+    v[loc_id] = v1;
+    r[loc_id] = r1;
+  }
+}
+
+
+__kernel void opencl_verlet_second4( __global FPTYPE4 * f, __global FPTYPE4 * v, const int natoms, const FPTYPE dt, const FPTYPE dtmf) {
+
+  int nths = get_global_size( 0 );
+  int loc_id;
+
+  for( loc_id = get_global_id( 0 ); loc_id < natoms; loc_id += nths )
+    v[loc_id] += dtmf * f[loc_id];
+}
+
+
+__kernel void opencl_verlet_fused4( __global FPTYPE4 * f, __global FPTYPE4 * r, __global FPTYPE4 * v, const int natoms, const FPTYPE dt, const FPTYPE dtmf, const FPTYPE box, const FPTYPE boxinv, __global FPTYPE * ekin, const int doekin) {
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id;
+  FPTYPE ekin_th = ZERO;
+
+  for( loc_id = id_th; loc_id < natoms; loc_id += nths ) {
+
+    FPTYPE4 f1 = f[loc_id], v1, r1;
+
+    v1 = v[loc_id] + dtmf * f1;
+    ekin_th += dot( v1, v1 );
+
+    v1 += dtmf * f1;
+    r1 = r[loc_id] + dt * v1;
+#ifdef _PBC_RINT
+    r1 -= BOX * floor( r1 * BOXINV );
+#endif
+    v[loc_id] = v1;
+    r[loc_id] = r1;
+  }
+
+  if( doekin ) ekin[id_th] = ekin_th;
+}
+
+
+__kernel void opencl_ekin4( __global FPTYPE4 * v, const int natoms, __global FPTYPE * ekin ) {
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id;
+  FPTYPE ekin_th = ZERO;
+
+  for( loc_id = id_th; loc_id < natoms; loc_id += nths ) ekin_th += dot( v[loc_id], v[loc_id] );
+
+  ekin[id_th] = ekin_th;
+}
+
+
+/* positions as separate arrays for the output */
+__kernel void opencl_unpack4( __global FPTYPE4 * r, const int natoms, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz ) {
+
+  int nths = get_global_size( 0 );
+  int loc_id;
+
+  for( loc_id = get_global_id( 0 ); loc_id < natoms; loc_id += nths ) {
+    FPTYPE4 r1 = r[loc_id];
+
+    rx[loc_id] = r1.x;
+    ry[loc_id] = r1.y;
+    rz[loc_id] = r1.z;
+  }
+}
+
+
+/* tabulated potential: the host samples the energy and force / r of
+ * the pair potential at ntable + 1 points of equal spacing 1 / tinv in
+ * r^2 from tmin to rcsq. Interval k holds (e, de, f, df), the values at
+ * its start and their increments to the next point, for a linear
+ * interpolation in r^2. Shorter distances extrapolate the first one. */
+inline PAIRTYPE lj_table(const PAIRTYPE rsq, __constant PAIRTYPE4 * table, const int ntable, const PAIRTYPE tmin,
+                         const PAIRTYPE tinv, PAIRTYPE * epair)
+{
+    PAIRTYPE x = ( rsq - tmin ) * tinv;
+    int k = clamp( (int) x, 0, ntable - 1 );
+    PAIRTYPE4 c = table[k];
+
+    x -= k;
+    *epair = c.x + x * c.y;
+    return c.z + x * c.w;
+}
+
+
+__kernel void opencl_force_table( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast, __constant PAIRTYPE4 * table, const int ntable, const PAIRTYPE tmin, const PAIRTYPE tinv ){
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id;
+  FPTYPE epot_th = ZERO;
+
+  for( loc_id = ifirst + id_th; loc_id < ilast; loc_id += nths ) {
+
+    int j;
+    FPTYPE rx1, ry1, rz1, fx1, fy1, fz1;
+    rx1 = rx[loc_id];
+    ry1 = ry[loc_id];
+    rz1 = rz[loc_id];
+    fx1 = fy1 = fz1 = ZERO;
+
+    for( j = 0; j < natoms; ++j ) {
+
+      PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
+
+      if ( loc_id == j ) continue;
+
+      loc_rx = pbc(rx1 - rx[j], BOXBY2, BOX, BOXINV);
+      loc_ry = pbc(ry1 - ry[j], BOXBY2, BOX, BOXINV);
+      loc_rz = pbc(rz1 - rz[j], BOXBY2, BOX, BOXINV);
+      rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
+
+      if (rsq < RCSQ) {
+	PAIRTYPE e, ffac = lj_table( rsq, table, ntable, tmin, tinv, &e );
+
+	epot_th += HALF * e;
+	fx1 += loc_rx * ffac;
+	fy1 += loc_ry * ffac;
+	fz1 += loc_rz * ffac;
+      }
+    }
+
+    fx[loc_id] = fx1;
+    fy[loc_id] = fy1;
+    fz[loc_id] = fz1;
+  }
+
+  epot[id_th] = epot_th;
+}
+
+
+__kernel void opencl_force_cell_table( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast, __global int * cell_count, __global int * cell_atoms, const int cellmax, const int ncell, const FPTYPE cellinv, __constant PAIRTYPE4 * table, const int ntable, const PAIRTYPE tmin, const PAIRTYPE tinv ){
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id;
+  FPTYPE epot_th = ZERO;
+
+  /* see opencl_force_cell */
+  int lo = ( ncell > 2 ) ? -1 : 0;
+  int hi = ( ncell > 1 ) ?  1 : 0;
+
+  for( loc_id = ifirst + id_th; loc_id < ilast; loc_id += nths ) {
+
+    int cx, cy, cz, dx, dy, dz;
+    FPTYPE rx1, ry1, rz1, fx1, fy1, fz1;
+    rx1 = rx[loc_id];
+    ry1 = ry[loc_id];
+    rz1 = rz[loc_id];
+    fx1 = fy1 = fz1 = ZERO;
+
+    cx = cell_coord( rx1, BOX, cellinv, ncell );
+    cy = cell_coord( ry1, BOX, cellinv, ncell );
+    cz = cell_coord( rz1, BOX, cellinv, ncell );
+
+    for( dz = lo; dz <= hi; ++dz ) {
+      for( dy = lo; dy <= hi; ++dy ) {
+	for( dx = lo; dx <= hi; ++dx ) {
+
+	  int c, k, n;
+
+	  c = ( ( ( cz + dz + ncell ) % ncell ) * ncell
+		+ ( cy + dy + ncell ) % ncell ) * ncell
+		+ ( cx + dx + ncell ) % ncell;
+	  n = min( cell_count[c], cellmax );
+
+	  for( k = 0; k < n; ++k ) {
+
+	    PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
+	    int j = cell_atoms[ c * cellmax + k ];
+
+	    if ( loc_id == j ) continue;
+
+	    loc_rx = pbc(rx1 - rx[j], BOXBY2, BOX, BOXINV);
+	    loc_ry = pbc(ry1 - ry[j], BOXBY2, BOX, BOXINV);
+	    loc_rz = pbc(rz1 - rz[j], BOXBY2, BOX, BOXINV);
+	    rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
+
+	    if (rsq < RCSQ) {
+	      PAIRTYPE e, ffac = lj_table( rsq, table, ntable, tmin, tinv, &e );
+
+	      epot_th += HALF * e;
+	      fx1 += loc_rx * ffac;
+	      fy1 += loc_ry * ffac;
+	      fz1 += loc_rz * ffac;
+	    }
+	  }
+	}
+      }
+    }
+
+    fx[loc_id] = fx1;
+    fy[loc_id] = fy1;
+    fz[loc_id] = fz1;
+  }
+
+  epot[id_th] = epot_th;
+}
+
+
+__kernel void opencl_force_nlist_table( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, __global FPTYPE * epot, const PAIRTYPE c12, const PAIRTYPE c6, const PAIRTYPE rcsq, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, const int ifirst, const int ilast, __global int * nlist_count, __global int * nlist, __constant PAIRTYPE4 * table, const int ntable, const PAIRTYPE tmin, const PAIRTYPE tinv ){
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int loc_id;
+  FPTYPE epot_th = ZERO;
+
+  for( loc_id = ifirst + id_th; loc_id < ilast; loc_id += nths ) {
+
+    int k, n;
+    FPTYPE rx1, ry1, rz1, fx1, fy1, fz1;
+    rx1 = rx[loc_id];
+    ry1 = ry[loc_id];
+    rz1 = rz[loc_id];
+    fx1 = fy1 = fz1 = ZERO;
+
+    n = nlist_count[loc_id];
+    for( k = 0; k < n; ++k ) {
+
+      PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
+      int j = nlist[ k * natoms + loc_id ];
+
+      loc_rx = pbc(rx1 - rx[j], BOXBY2, BOX, BOXINV);
+      loc_ry = pbc(ry1 - ry[j], BOXBY2, BOX, BOXINV);
+      loc_rz = pbc(rz1 - rz[j], BOXBY2, BOX, BOXINV);
+      rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
+
+      if (rsq < RCSQ) {
+	PAIRTYPE e, ffac = lj_table( rsq, table, ntable, tmin, tinv, &e );
+
+	epot_th += HALF * e;
+	fx1 += loc_rx * ffac;
+	fy1 += loc_ry * ffac;
+	fz1 += loc_rz * ffac;
+      }
+    }
+
+    fx[loc_id] = fx1;
+    fy[loc_id] = fy1;
+    fz[loc_id] = fz1;
+  }
+
+  epot[id_th] = epot_th;
+}
+
+
+/* generated initial configuration (restart fcc in the input): the
+ * site i of a lattice of ncell^3 fcc cells of size a, centred on the
+ * origin and shifted by a / 4 off the box faces, and velocities from
+ * a Maxwell-Boltzmann distribution of width sd. The gaussians come from
+ * the Box-Muller transform of uniforms hashed from the seed and 4 i + k,
+ * so that they do not depend on the work sizes and the host (fcc_host)
+ * gets the same. */
+inline uint fcc_hash( uint x ) {
+  x ^= x >> 16;
+  x *= 0x7feb352du;
+  x ^= x >> 15;
+  x *= 0x846ca68bu;
+  x ^= x >> 16;
+  return x;
+}
+
+/* uniform in (0,1] with 24 bits, exact in float and double */
+inline FPTYPE fcc_uniform( uint seed, uint ctr ) {
+  return (FPTYPE) ( ( fcc_hash( ctr + fcc_hash( seed ) ) >> 8 ) + 1 ) * (FPTYPE) 5.9604644775390625e-8;
+}
+
+/* every thread also leaves the sums of its vx, vy, vz and v^2 in
+ * sums[k * nths + id], from which the host takes the drift and the
+ * temperature */
+__kernel void opencl_fcc( __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int natoms, const int ncell, const FPTYPE a, const FPTYPE sd, const uint seed, __global FPTYPE * sums ) {
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  int i;
+  FPTYPE sx = ZERO, sy = ZERO, sz = ZERO, sq = ZERO;
+  FPTYPE off = ( (FPTYPE) 0.25 - HALF * ncell ) * a;
+  FPTYPE twopi = (FPTYPE) 6.283185307179586;
+
+  for( i = id_th; i < natoms; i += nths ) {
+    int c = i >> 2, b = i & 3;
+    FPTYPE u0 = fcc_uniform( seed, 4 * i ), u1 = fcc_uniform( seed, 4 * i + 1 );
+    FPTYPE u2 = fcc_uniform( seed, 4 * i + 2 ), u3 = fcc_uniform( seed, 4 * i + 3 );
+    FPTYPE g0 = sd * sqrt( -TWO * log( u0 ) ), g1 = sd * sqrt( -TWO * log( u2 ) );
+
+    rx[i] = ( c % ncell + ( b == 1 || b == 2 ? HALF : ZERO ) ) * a + off;
+    ry[i] = ( c / ncell % ncell + ( b == 1 || b == 3 ? HALF : ZERO ) ) * a + off;
+    rz[i] = ( c / ( ncell * ncell ) + ( b >= 2 ? HALF : ZERO ) ) * a + off;
+    vx[i] = g0 * cos( twopi * u1 );
+    vy[i] = g0 * sin( twopi * u1 );
+    vz[i] = g1 * cos( twopi * u3 );
+    sx += vx[i];
+    sy += vy[i];
+    sz += vz[i];
+    sq += vx[i] * vx[i] + vy[i] * vy[i] + vz[i] * vz[i];
+  }
+
+  sums[id_th] = sx;
+  sums[nths + id_th] = sy;
+  sums[2 * nths + id_th] = sz;
+  sums[3 * nths + id_th] = sq;
+}
+
+/* remove the drift (cx, cy, cz) and scale to the target temperature */
+__kernel void opencl_fcc_scale( __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int natoms, const FPTYPE cx, const FPTYPE cy, const FPTYPE cz, const FPTYPE scale ) {
+
+  int nths = get_global_size( 0 );
+  int i;
+
+  for( i = get_global_id( 0 ); i < natoms; i += nths ) {
+    vx[i] = ( vx[i] - cx ) * scale;
+    vy[i] = ( vy[i] - cy ) * scale;
+    vz[i] = ( vz[i] - cz ) * scale;
+  }
+}
+
+
+/* thermostats, applied to the velocities at the end of every step.
+ * Berendsen and Nose-Hoover take the temperature tfac * sum v^2 from
+ * state[2], where the host reduces the opencl_ekin sums, update the
+ * scale factor state[0] in a single work-item and opencl_vscale
+ * applies it; state[1] is the Nose-Hoover friction in 1/fs. */
+__kernel void opencl_berendsen( __global FPTYPE * state, const FPTYPE tfac, const FPTYPE temp, const FPTYPE dt, const FPTYPE tau ) {
+
+  FPTYPE t = tfac * state[2];
+
+  state[0] = t > ZERO ? sqrt( fmax( ONE + dt / tau * ( temp / t - ONE ), ZERO ) ) : ONE;
+}
+
+__kernel void opencl_nosehoover( __global FPTYPE * state, const FPTYPE tfac, const FPTYPE temp, const FPTYPE dt, const FPTYPE tau ) {
+
+  state[1] += dt * ( tfac * state[2] / temp - ONE ) / ( tau * tau );
+  state[0] = exp( -state[1] * dt );
+}
+
+__kernel void opencl_vscale( __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int natoms, __global FPTYPE * state ) {
+
+  int nths = get_global_size( 0 );
+  FPTYPE scale = state[0];
+  int i;
+
+  for( i = get_global_id( 0 ); i < natoms; i += nths ) {
+    vx[i] *= scale;
+    vy[i] *= scale;
+    vz[i] *= scale;
+  }
+}
+
+/* Philox4x32-10 counter based generator: 4 random words for the
+ * counter c and the key (k0, k1), in place */
+inline void philox4x32( uint * c, uint k0, uint k1 ) {
+  int r;
+
+  for( r = 0; r < 10; r++ ) {
+    ulong p0 = (ulong) 0xD2511F53u * c[0];
+    ulong p1 = (ulong) 0xCD9E8D57u * c[2];
+    uint x = (uint) ( p1 >> 32 ) ^ c[1] ^ k0;
+    uint z = (uint) ( p0 >> 32 ) ^ c[3] ^ k1;
+
+    c[1] = (uint) p1;
+    c[3] = (uint) p0;
+    c[0] = x;
+    c[2] = z;
+    k0 += 0x9E3779B9u;
+    k1 += 0xBB67AE85u;
+  }
+}
+
+/* Langevin thermostat: the exact Ornstein-Uhlenbeck step v = c1 v + c2 g
+ * with c1 = exp(-dt / tau) and c2 = sqrt((1 - c1^2) kT / m). The gaussians
+ * g come from Philox of the counter (atom, step) and the seed, so every
+ * atom and step gets its own numbers on any work size. */
+__kernel void opencl_langevin( __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int natoms, const FPTYPE c1, const FPTYPE c2, const uint seed, const int step ) {
+
+  int nths = get_global_size( 0 );
+  FPTYPE twopi = (FPTYPE) 6.283185307179586;
+  FPTYPE eps = (FPTYPE) 5.9604644775390625e-8;
+  int i;
+
+  for( i = get_global_id( 0 ); i < natoms; i += nths ) {
+    uint c[4];
+    FPTYPE u[4], g0, g1;
+    int k;
+
+    c[0] = i;
+    c[1] = step;
+    c[2] = 0;
+    c[3] = 0;
+    philox4x32( c, seed, 0x4c4a4d44u );
+    for( k = 0; k < 4; k++ ) u[k] = (FPTYPE) ( ( c[k] >> 8 ) + 1 ) * eps;
+    g0 = c2 * sqrt( -TWO * log( u[0] ) );
+    g1 = c2 * sqrt( -TWO * log( u[2] ) );
+    vx[i] = c1 * vx[i] + g0 * cos( twopi * u[1] );
+    vy[i] = c1 * vy[i] + g0 * sin( twopi * u[1] );
+    vz[i] = c1 * vz[i] + g1 * cos( twopi * u[3] );
+  }
+}
+
+
+/* on-the-fly analysis. The radial distribution function counts the
+ * pairs closer than rmax in nbins bins of width 1 / binv: for every
+ * atom over all others (opencl_rdf), the atoms of the 27 cells around
+ * it or its neighbor list, where the pairs of a half list count twice
+ * (weight). A work-group counts into lhist first and then adds that to
+ * hist, which opencl_rdf_add adds to the sums over all samples. */
+inline void rdf_clear( __local int * lhist, const int nbins ) {
+  int b;
+
+  for( b = get_local_id( 0 ); b < nbins; b += get_local_size( 0 ) ) lhist[b] = 0;
+  barrier( CLK_LOCAL_MEM_FENCE );
+}
+
+inline void rdf_count( FPTYPE dx, FPTYPE dy, FPTYPE dz, const FPTYPE rmaxsq, const FPTYPE binv, const int nbins, __local int * lhist, const int weight ) {
+  FPTYPE rsq = dx * dx + dy * dy + dz * dz;
+
+  if( rsq < rmaxsq ) {
+    int b = (int) ( sqrt( rsq ) * binv );
+
+    if( b < nbins ) atomic_add( &lhist[b], weight );
+  }
+}
+
+inline void rdf_flush( __local int * lhist, __global int * hist, const int nbins ) {
+  int b;
+
+  barrier( CLK_LOCAL_MEM_FENCE );
+  for( b = get_local_id( 0 ); b < nbins; b += get_local_size( 0 ) )
+    if( lhist[b] ) atomic_add( &hist[b], lhist[b] );
+}
+
+__kernel void opencl_rdf( __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, __global int * hist, const int nbins, const FPTYPE rmaxsq, const FPTYPE binv, __local int * lhist ) {
+
+  int nths = get_global_size( 0 );
+  int i, j;
+
+  rdf_clear( lhist, nbins );
+  for( i = get_global_id( 0 ); i < natoms; i += nths ) {
+    FPTYPE rx1 = rx[i], ry1 = ry[i], rz1 = rz[i];
+
+    for( j = 0; j < natoms; ++j ) {
+      if( j == i ) continue;
+      rdf_count( pbc( rx1 - rx[j], BOXBY2, BOX, BOXINV ), pbc( ry1 - ry[j], BOXBY2, BOX, BOXINV ),
+                 pbc( rz1 - rz[j], BOXBY2, BOX, BOXINV ), rmaxsq, binv, nbins, lhist, 1 );
+    }
+  }
+  rdf_flush( lhist, hist, nbins );
+}
+
+__kernel void opencl_rdf_cell( __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, __global int * hist, const int nbins, const FPTYPE rmaxsq, const FPTYPE binv, __local int * lhist, __global int * cell_count, __global int * cell_atoms, const int cellmax, const int ncell, const FPTYPE cellinv ) {
+
+  int nths = get_global_size( 0 );
+  int lo = ( ncell > 2 ) ? -1 : 0;
+  int hi = ( ncell > 1 ) ?  1 : 0;
+  int i;
+
+  rdf_clear( lhist, nbins );
+  for( i = get_global_id( 0 ); i < natoms; i += nths ) {
+    FPTYPE rx1 = rx[i], ry1 = ry[i], rz1 = rz[i];
+    int cx, cy, cz, dx, dy, dz;
+
+    cx = cell_coord( rx1, BOX, cellinv, ncell );
+    cy = cell_coord( ry1, BOX, cellinv, ncell );
+    cz = cell_coord( rz1, BOX, cellinv, ncell );
+    for( dz = lo; dz <= hi; ++dz )
+      for( dy = lo; dy <= hi; ++dy )
+        for( dx = lo; dx <= hi; ++dx ) {
+          int c, k, n;
+
+          c = ( ( ( cz + dz + ncell ) % ncell ) * ncell
+                + ( cy + dy + ncell ) % ncell ) * ncell
+                + ( cx + dx + ncell ) % ncell;
+          n = min( cell_count[c], cellmax );
+          for( k = 0; k < n; ++k ) {
+            int j = cell_atoms[ c * cellmax + k ];
+
+            if( j == i ) continue;
+            rdf_count( pbc( rx1 - rx[j], BOXBY2, BOX, BOXINV ), pbc( ry1 - ry[j], BOXBY2, BOX, BOXINV ),
+                       pbc( rz1 - rz[j], BOXBY2, BOX, BOXINV ), rmaxsq, binv, nbins, lhist, 1 );
+          }
+        }
+  }
+  rdf_flush( lhist, hist, nbins );
+}
+
+__kernel void opencl_rdf_nlist( __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int natoms, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, __global int * hist, const int nbins, const FPTYPE rmaxsq, const FPTYPE binv, __local int * lhist, __global int * nlist_count, __global int * nlist, const int weight ) {
+
+  int nths = get_global_size( 0 );
+  int i, k;
+
+  rdf_clear( lhist, nbins );
+  for( i = get_global_id( 0 ); i < natoms; i += nths ) {
+    FPTYPE rx1 = rx[i], ry1 = ry[i], rz1 = rz[i];
+    int n = nlist_count[i];
+
+    for( k = 0; k < n; ++k ) {
+      int j = nlist[ k * natoms + i ];
+
+      rdf_count( pbc( rx1 - rx[j], BOXBY2, BOX, BOXINV ), pbc( ry1 - ry[j], BOXBY2, BOX, BOXINV ),
+                 pbc( rz1 - rz[j], BOXBY2, BOX, BOXINV ), rmaxsq, binv, nbins, lhist, weight );
+    }
+  }
+  rdf_flush( lhist, hist, nbins );
+}
+
+/* add the counts of a sample to the sums and clear them */
+__kernel void opencl_rdf_add( __global int * hist, const int nbins, __global FPTYPE * acc ) {
+
+  int b;
+
+  for( b = get_global_id( 0 ); b < nbins; b += get_global_size( 0 ) ) {
+    acc[b] += hist[b];
+    hist[b] = 0;
+  }
+}
+
+/* mean square displacement: d sums up the displacements from the
+ * positions p of the previous sample, which therefore must be less
+ * than half a box apart, and sums gets the partial sums of |d|^2 */
+__kernel void opencl_msd( __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, __global FPTYPE * px, __global FPTYPE * py, __global FPTYPE * pz, __global FPTYPE * dx, __global FPTYPE * dy, __global FPTYPE * dz, const int natoms, const FPTYPE boxby2, const FPTYPE box, const FPTYPE boxinv, __global FPTYPE * sums ) {
+
+  int nths = get_global_size( 0 );
+  int id_th = get_global_id( 0 );
+  FPTYPE sum = ZERO;
+  int i;
+
+  for( i = id_th; i < natoms; i += nths ) {
+    dx[i] += pbc( rx[i] - px[i], BOXBY2, BOX, BOXINV );
+    dy[i] += pbc( ry[i] - py[i], BOXBY2, BOX, BOXINV );
+    dz[i] += pbc( rz[i] - pz[i], BOXBY2, BOX, BOXINV );
+    px[i] = rx[i];
+    py[i] = ry[i];
+    pz[i] = rz[i];
+    sum += dx[i] * dx[i] + dy[i] * dy[i] + dz[i] * dz[i];
+  }
+  sums[id_th] = sum;
+}
+
+
+/* replica ensembles: the atoms of all replicas are packed into the
+ * same buffers, replica r owns the atoms first[r] .. first[r]+count[r]-1
+ * and rep[i] is the replica of atom i. Each replica has its own
+ * constants par[ENS_NPAR*r + ENS_*], so one launch covers the atoms of
+ * all of them. The energies are kept per atom and summed per replica
+ * by opencl_reduce_ens. */
+#define ENS_BOX    0
+#define ENS_BOXBY2 1
+#define ENS_BOXINV 2
+#define ENS_C12    3
+#define ENS_C6     4
+#define ENS_RCSQ   5
+#define ENS_DT     6
+#define ENS_DTMF   7
+#define ENS_NPAR   8
+
+__kernel void opencl_force_ens( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, const int ntotal, __global FPTYPE * epot, __global int * rep, __global int * first, __global int * count, __global FPTYPE * par ) {
+
+  int nths = get_global_size( 0 );
+  int loc_id = get_global_id( 0 );
+
+  while( loc_id < ntotal ) {
+
+    int r = rep[loc_id], j, j0 = first[r], j1 = first[r] + count[r];
+    __global FPTYPE * p = par + ENS_NPAR * r;
+    const FPTYPE box = p[ENS_BOX], boxby2 = p[ENS_BOXBY2], boxinv = p[ENS_BOXINV];
+    const PAIRTYPE c12 = p[ENS_C12], c6 = p[ENS_C6], rcsq = p[ENS_RCSQ];
+    FPTYPE rx1, ry1, rz1, fx1 = ZERO, fy1 = ZERO, fz1 = ZERO, epot1 = ZERO;
+
+    rx1 = rx[loc_id];
+    ry1 = ry[loc_id];
+    rz1 = rz[loc_id];
+
+    for( j = j0; j < j1; ++j ) {
+
+      PAIRTYPE loc_rx, loc_ry, loc_rz, rsq;
+
+      if ( loc_id == j ) continue;
+
+      loc_rx = pbc(rx1 - rx[j], boxby2, box, boxinv);
+      loc_ry = pbc(ry1 - ry[j], boxby2, box, boxinv);
+      loc_rz = pbc(rz1 - rz[j], boxby2, box, boxinv);
+      rsq = loc_rx * loc_rx + loc_ry * loc_ry + loc_rz * loc_rz;
+
+      if (rsq < rcsq) {
+	PAIRTYPE r6, rinv, ffac;
+
+	rinv = ONE / rsq;
+	r6 = rinv * rinv * rinv;
+
+	ffac = ( TWELVE * c12 * r6 - SIX * c6 ) * r6 * rinv;
+	epot1 += HALF * r6 * ( c12 * r6 - c6 );
+
+	fx1 += loc_rx * ffac;
+	fy1 += loc_ry * ffac;
+	fz1 += loc_rz * ffac;
+      }
+    }
+
+    fx[loc_id] = fx1;
+    fy[loc_id] = fy1;
+    fz[loc_id] = fz1;
+    epot[loc_id] = epot1;
+
+    loc_id += nths;
+  }
+}
+
+
+__kernel void opencl_verlet_first_ens( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * rx, __global FPTYPE * ry, __global FPTYPE * rz, __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int ntotal, __global int * rep, __global FPTYPE * par ) {
+
+  int nths = get_global_size( 0 );
+  int loc_id = get_global_id( 0 );
+
+  while( loc_id < ntotal ){
+
+    __global FPTYPE * p = par + ENS_NPAR * rep[loc_id];
+    const FPTYPE dt = p[ENS_DT], dtmf = p[ENS_DTMF];
+
+    vx[loc_id] += dtmf * fx[loc_id];
+    vy[loc_id] += dtmf * fy[loc_id];
+    vz[loc_id] += dtmf * fz[loc_id];
+    rx[loc_id] += dt*vx[loc_id];
+    ry[loc_id] += dt*vy[loc_id];
+    rz[loc_id] += dt*vz[loc_id];
+#ifdef _PBC_RINT
+    rx[loc_id] -= p[ENS_BOX] * floor( rx[loc_id] * p[ENS_BOXINV] );
+    ry[loc_id] -= p[ENS_BOX] * floor( ry[loc_id] * p[ENS_BOXINV] );
+    rz[loc_id] -= p[ENS_BOX] * floor( rz[loc_id] * p[ENS_BOXINV] );
+#endif
+
+    loc_id += nths;
+  }
+}
+
+
+__kernel void opencl_verlet_second_ens( __global FPTYPE * fx, __global FPTYPE * fy, __global FPTYPE * fz, __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int ntotal, __global int * rep, __global FPTYPE * par ) {
+
+  int nths = get_global_size( 0 );
+  int loc_id = get_global_id( 0 );
+
+  while( loc_id < ntotal ){
+
+    const FPTYPE dtmf = par[ENS_NPAR * rep[loc_id] + ENS_DTMF];
+
+    vx[loc_id] += dtmf * fx[loc_id];
+    vy[loc_id] += dtmf * fy[loc_id];
+    vz[loc_id] += dtmf * fz[loc_id];
+
+    loc_id += nths;
+  }
+}
+
+
+__kernel void opencl_ekin_ens( __global FPTYPE * vx, __global FPTYPE * vy, __global FPTYPE * vz, const int ntotal, __global FPTYPE * ekin ) {
+
+  int nths = get_global_size( 0 );
+  int loc_id = get_global_id( 0 );
+
+  while( loc_id < ntotal ) {
+
+    ekin[loc_id] = vx[loc_id] * vx[loc_id] + vy[loc_id] * vy[loc_id] + vz[loc_id] * vz[loc_id];
+
+    loc_id += nths;
+  }
+}
+
+
+/* per replica sums: work-group r adds up in[first[r] .. first[r]+count[r]-1]
+ * and stores it in out[offset + r]. The local size must be a power of two. */
+__kernel void opencl_reduce_ens( __global FPTYPE * in, __global int * first, __global int * count, __global FPTYPE * out, const int offset, __local FPTYPE * scratch ) {
+
+  int r = get_group_id( 0 );
+  int lid = get_local_id( 0 );
+  int i, i1 = first[r] + count[r];
+  FPTYPE sum = ZERO;
+
+  for( i = first[r] + lid; i < i1; i += get_local_size( 0 ) ) sum += in[i];
+  scratch[lid] = sum;
+
+  for( i = get_local_size( 0 ) / 2; i > 0; i >>= 1 ) {
+    barrier( CLK_LOCAL_MEM_FENCE );
+    if( lid < i ) scratch[lid] += scratch[lid + i];
+  }
+
+  if( lid == 0 ) out[offset + r] = scratch[0];
+}
@@ -0,0 +1,222 @@
+import argparse
+import csv
+import json
+import os
+import re
+import socket
+import subprocess
+import sys
+import time
+
+from drift import drift
+
+
+# benchmark driver of make bench: runs every combination of executable
+# (one per precision), input, device, thread number and force kernel,
+# and writes ns/day, steps/s, the device time per step of each kernel,
+# the energy drift and the largest deviation from the serial reference
+# energies to CSV and JSON. With --ranks every case runs under mpirun
+# for strong (--boxes, --natoms) or weak (--weak) scaling. Old JSON
+# results can be compared against to catch performance regressions.
+
+# fcc lattice constant of the examples (argon_2916 is 9^3 cells in 51.474 A)
+LATTICE = 51.474 / 9
+
+
+def read_input(name):
+  lines = [line.split('#')[0].strip() for line in open(name)]
+  return [l for l in lines if l]
+
+
+def write_input(name, values):
+  labels = ['natoms', 'mass in AMU', 'epsilon in kcal/mol', 'sigma in angstrom',
+            'rcut in angstrom', 'box length (in angstrom)', 'restart', 'trajectory',
+            'energies', 'nr MD steps', 'MD time step (in fs)', 'output print frequency']
+  with open(name, 'w') as f:
+    for v, l in zip(values, labels):
+      f.write('%-18s # %s\n' % (v, l))
+
+
+# input of natoms at the density of the examples, whose atoms come from
+# the fcc generator of ljmd_CL (restart fcc temp seed)
+def generate_input(natoms, temp, seed):
+  name = 'bench_fcc%d' % natoms
+  box = LATTICE * (natoms / 4.0) ** (1.0 / 3.0)
+  write_input(name + '.inp', [natoms, 39.948, 0.2379, 3.405, 12.0, '%.4f' % box,
+                              'fcc %g %d' % (temp, seed), name + '.xyz', name + '.dat', 20, 5.0, 5])
+  return name
+
+
+def read_energies(name):
+  rows = [line.split() for line in open(name) if line.strip()]
+  return dict((int(r[0]), [float(x) for x in r[1:5]]) for r in rows)
+
+
+# largest |epot| and |etot| deviation from the reference at common steps
+def reference_error(name, ref):
+  new, old = read_energies(name), read_energies(ref)
+  steps = [n for n in new if n in old]
+  if not steps:
+    return None, None
+  return (max(abs(new[n][2] - old[n][2]) for n in steps),
+          max(abs(new[n][3] - old[n][3]) for n in steps))
+
+
+def run_case(exe, inp, kind, ranks, device, threads, force, args):
+  values = read_input(inp + '.inp')
+  tag = '%s_%s_%s_%s_%s' % (exe[0], inp, device, threads, force)
+  if ranks:
+    tag += '_np%d' % ranks + ('_weak' if kind == 'weak' else '')
+  steps = args.steps or int(values[9])
+  values[7:10] = ['bench.xyz', 'bench.dat', steps]
+  write_input('bench.inp', values)
+  for f in ('bench.dat', 'bench.xyz', 'bench_prof.json'):
+    if os.path.exists(f):
+      os.remove(f)
+  cmd = args.mpirun.split() + [str(ranks)] if ranks else []
+  cmd += [exe[1], device] + ([] if threads == 'auto' else [threads])
+  cmd += ['force=' + force, 'profile=bench_prof.json'] + args.opts.split()
+  res = {'case': tag, 'exe': exe[0], 'input': inp, 'natoms': int(values[0]), 'ranks': ranks or 1,
+         'scaling': kind, 'device': device, 'threads': threads, 'force': force, 'steps': steps}
+  t0 = time.time()
+  try:
+    p = subprocess.run(cmd, stdin=open('bench.inp'), stdout=subprocess.PIPE,
+                       stderr=subprocess.STDOUT, timeout=args.timeout,
+                       universal_newlines=True)
+    out, status = p.stdout, 'ok' if p.returncode == 0 else 'failed (%d)' % p.returncode
+  except subprocess.TimeoutExpired:
+    out, status = '', 'timeout'
+  res['wall_s'] = time.time() - t0
+  res['status'] = status
+  open('bench_%s.log' % tag, 'w').write(out)
+  m = re.search(r'Time per MD step.*= *([0-9.eE+-]+) \(ms\)', out)
+  if status != 'ok' or not m:
+    if status == 'ok':
+      res['status'] = 'no timing (build with -D__PROFILING)'
+    return res
+  ms = float(m.group(1))
+  res['ms_per_step'] = ms
+  res['steps_per_s'] = 1000.0 / ms
+  res['ns_per_day'] = float(values[10]) * res['steps_per_s'] * 86400.0 * 1.0e-6
+  if os.path.exists('bench_prof.json'):
+    prof = json.load(open('bench_prof.json'))
+    res['kernels_ms_per_step'] = dict((k['name'], k['total_ms'] / steps) for k in prof['kernels'])
+    res['transfers_ms_per_step'] = dict((k['name'], k['total_ms'] / steps) for k in prof['transfers'])
+  if os.path.exists('bench.dat'):
+    res['drift'], res['rms'], res['etot_change'] = drift('bench.dat')
+    ref = os.path.join(args.refdir, inp + '.dat')
+    if os.path.exists(ref):
+      res['epot_error'], res['etot_error'] = reference_error('bench.dat', ref)
+  return res
+
+
+# parallel efficiency against the run with the fewest ranks of the same
+# case: t0 r0 / (t r) for a fixed size, t0 / t for weak scaling
+def scaling(results):
+  groups = {}
+  for r in results:
+    if 'ms_per_step' in r:
+      key = (r['exe'], r['scaling'] == 'weak' or r['input'], r['device'], r['threads'], r['force'])
+      groups.setdefault(key, []).append(r)
+  for runs in groups.values():
+    base = min(runs, key=lambda r: r['ranks'])
+    for r in runs:
+      work = 1.0 if r['scaling'] == 'weak' else float(r['ranks']) / base['ranks']
+      r['efficiency'] = base['ms_per_step'] / (r['ms_per_step'] * work)
+
+
+def write_csv(name, results):
+  kernels = sorted(set(k for r in results for k in r.get('kernels_ms_per_step', {})))
+  cols = ['commit', 'case', 'exe', 'input', 'natoms', 'ranks', 'device', 'threads', 'force', 'steps',
+          'status', 'wall_s', 'ms_per_step', 'steps_per_s', 'ns_per_day', 'scaling', 'efficiency', 'drift', 'rms',
+          'etot_change', 'epot_error', 'etot_error']
+  with open(name, 'w') as f:
+    w = csv.writer(f)
+    w.writerow(cols + ['kernel ' + k + ' (ms/step)' for k in kernels])
+    for r in results:
+      w.writerow([r.get(c, '') for c in cols] +
+                 [r.get('kernels_ms_per_step', {}).get(k, '') for k in kernels])
+
+
+# cases that got slower than in the old results by more than tol percent
+def compare(old, results, tol):
+  before = dict((r['case'], r) for r in json.load(open(old))['results'] if 'steps_per_s' in r)
+  slower = []
+  for r in results:
+    b = before.get(r['case'])
+    if b and 'steps_per_s' in r and r['steps_per_s'] < b['steps_per_s'] * (1.0 - 0.01 * tol):
+      slower.append((r['case'], b['steps_per_s'], r['steps_per_s']))
+  return slower
+
+
+def commit():
+  try:
+    return subprocess.check_output(['git', 'rev-parse', '--short', 'HEAD'], stderr=subprocess.DEVNULL,
+                                   universal_newlines=True).strip()
+  except (OSError, subprocess.CalledProcessError):
+    return ''
+
+
+def main():
+  ap = argparse.ArgumentParser(description='ljmd_CL benchmark suite')
+  ap.add_argument('--exe', action='append', default=[],
+                  help='label=path of an executable, e.g. double=./ljmd_CL_double (default ljmd_CL)')
+  ap.add_argument('--inputs', default='argon_108,argon_2916,argon_78732')
+  ap.add_argument('--boxes', default='', help='generated fcc boxes of n^3 cells, e.g. 36,48')
+  ap.add_argument('--natoms', default='', help='generated boxes of these sizes, e.g. 1000000,4000000')
+  ap.add_argument('--ranks', default='', help='MPI rank numbers, e.g. 1,2,4,8 (with an ljmd_CL_mpi --exe)')
+  ap.add_argument('--mpirun', default='mpirun -np', help='command that takes the rank number')
+  ap.add_argument('--weak', type=int, default=0, help='weak scaling with this many atoms per rank')
+  ap.add_argument('--devices', default='cpu,gpu')
+  ap.add_argument('--threads', default='auto', help='thread numbers, auto = autotuned')
+  ap.add_argument('--force', default='brute,cell,nlist,newton,tiled')
+  ap.add_argument('--steps', type=int, default=0, help='MD steps (default those of the input)')
+  ap.add_argument('--opts', default='', help='extra keyword=value options of every run')
+  ap.add_argument('--refdir', default='../references')
+  ap.add_argument('--timeout', type=float, default=3600.0)
+  ap.add_argument('--temp', type=float, default=80.0, help='temperature of the generated boxes')
+  ap.add_argument('--seed', type=int, default=12345)
+  ap.add_argument('--csv', default='bench.csv')
+  ap.add_argument('--json', default='bench.json')
+  ap.add_argument('--compare', default='', help='old JSON results to check for regressions')
+  ap.add_argument('--tolerance', type=float, default=10.0, help='allowed slowdown in percent')
+  args = ap.parse_args()
+
+  exes = [e.split('=', 1) if '=' in e else [os.path.basename(e), e] for e in args.exe]
+  exes = [[l, p if os.sep in p else './' + p] for l, p in exes or [['ljmd_CL', 'ljmd_CL']]]
+  inputs = [i for i in args.inputs.split(',') if i]
+  inputs += [generate_input(4 * int(n) ** 3, args.temp, args.seed) for n in args.boxes.split(',') if n]
+  inputs += [generate_input(int(n), args.temp, args.seed) for n in args.natoms.split(',') if n]
+  rev = commit()
+  results = []
+  print('%-52s %10s %12s %12s %12s' % ('case', 'status', 'steps/s', 'ns/day', 'drift'))
+  for exe in exes:
+    for ranks in [int(n) for n in args.ranks.split(',') if n] or [0]:
+      cases = [(inp, 'strong') for inp in inputs]
+      if args.weak:
+        cases.append((generate_input(args.weak * max(ranks, 1), args.temp, args.seed), 'weak'))
+      for inp, kind in cases:
+        for device in args.devices.split(','):
+          for threads in args.threads.split(','):
+            for force in args.force.split(','):
+              r = run_case(exe, inp, kind, ranks, device, threads, force, args)
+              r['commit'] = rev
+              results.append(r)
+              print('%-52s %10s %12.4g %12.4g %12.3e' % (r['case'], r['status'][:10], r.get('steps_per_s', 0.0),
+                                                        r.get('ns_per_day', 0.0), r.get('drift', 0.0)))
+              sys.stdout.flush()
+  scaling(results)
+  meta = {'commit': rev, 'host': socket.gethostname(), 'date': time.strftime('%Y-%m-%d %H:%M:%S')}
+  json.dump({'meta': meta, 'results': results}, open(args.json, 'w'), indent=1)
+  write_csv(args.csv, results)
+  print('results in %s and %s' % (args.csv, args.json))
+  if args.compare:
+    slower = compare(args.compare, results, args.tolerance)
+    for case, old, new in slower:
+      print('slower: %-52s %12.4g -> %12.4g steps/s' % (case, old, new))
+    if slower:
+      sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,28 @@
+import sys
+
+
+# energy drift of an energy file (nfi temp ekin epot etot): slope of
+# a linear fit of etot per 1000 steps and the rms deviation from that
+# fit, both relative to the mean |etot|, and the change of etot
+def drift(name):
+  rows = [line.split() for line in open(name) if line.strip()]
+  nfi = [float(r[0]) for r in rows]
+  etot = [float(r[4]) for r in rows]
+  n = len(rows)
+  mx = sum(nfi) / n
+  my = sum(etot) / n
+  sxx = sum((x - mx) ** 2 for x in nfi)
+  slope = sum((x - mx) * (y - my) for x, y in zip(nfi, etot)) / sxx
+  rms = (sum((y - my - slope * (x - mx)) ** 2 for x, y in zip(nfi, etot)) / n) ** 0.5
+  scale = sum(abs(y) for y in etot) / n
+  return 1000.0 * slope / scale, rms / scale, etot[-1] - etot[0]
+
+
+def main():
+  print('%-30s %16s %12s %14s' % ('file', 'drift/1000 steps', 'rms', 'etot change'))
+  for name in sys.argv[1:]:
+    print('%-30s %16.3e %12.3e %14.6f' % ((name,) + drift(name)))
+
+
+if __name__ == "__main__":
+    main()
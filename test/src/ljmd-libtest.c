@@ -0,0 +1,78 @@
+/*
+ * test of the libljmd engine (include/ljmd.h): run a system, write a
+ * checkpoint, run on, restore the checkpoint and run the same steps
+ * again, which must give the same atoms bit for bit. Then load a
+ * second system into the same engine and run it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include "ljmd.h"
+
+#define NSTEPS 50
+#define CHECKPOINT "ljmd-libtest.rest"
+
+/* positions and velocities of all atoms */
+struct snapshot {
+    ljmd_state_t state;
+    double *r, *v;
+};
+
+static int take(ljmd_engine_t *e, struct snapshot *s)
+{
+    int n;
+
+    if (ljmd_query(e, &s->state)) return -1;
+    n = s->state.natoms;
+    s->r = (double *) malloc(6 * n * sizeof(double));
+    if (!s->r) return -1;
+    s->v = s->r + 3 * n;
+    return ljmd_get_positions(e, s->r, s->r + n, s->r + 2 * n)
+        || ljmd_get_velocities(e, s->v, s->v + n, s->v + 2 * n) ? -1 : 0;
+}
+
+static int fail(const char *what)
+{
+    fprintf(stderr, "ljmd-libtest: %s\n", what);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = argc > 1 ? argv[1] : "cpu";
+    struct snapshot first, again;
+    ljmd_state_t state;
+    ljmd_engine_t *e;
+
+    e = ljmd_create(device, 0, "force=cell trajformat=none");
+    if (!e) return fail("cannot create the engine");
+
+    if (ljmd_load(e, "argon_108.inp") || ljmd_run(e, NSTEPS)) return fail("cannot run argon_108.inp");
+    if (ljmd_checkpoint(e, CHECKPOINT)) return fail("cannot write the checkpoint");
+    if (ljmd_run(e, NSTEPS) || take(e, &first)) return fail("cannot run on from the checkpoint");
+    if (ljmd_restore(e, CHECKPOINT) || ljmd_query(e, &state)) return fail("cannot restore the checkpoint");
+    if (state.nfi != NSTEPS) return fail("the restored step is not the one of the checkpoint");
+    if (ljmd_run(e, NSTEPS) || take(e, &again)) return fail("cannot run on from the restored checkpoint");
+
+    if (again.state.nfi != first.state.nfi || again.state.etot != first.state.etot
+        || memcmp(again.r, first.r, 6 * first.state.natoms * sizeof(double)))
+        return fail("the run from the restored checkpoint differs");
+    printf("restored run of %d atoms matches at step %d, etot %.8f\n",
+           first.state.natoms, first.state.nfi, first.state.etot);
+
+    /* settings of the loaded system are parsed strictly */
+    if (!ljmd_set(e, "nsteps", "abc") || !ljmd_set(e, "dt", "5x")) return fail("bad settings were accepted");
+
+    if (ljmd_load(e, "argon_2916.inp") || ljmd_run(e, 10) || ljmd_query(e, &state))
+        return fail("cannot run argon_2916.inp");
+    if (state.natoms != 2916 || state.nfi != 10 || !(state.etot < 0.0))
+        return fail("the second system has a wrong state");
+    printf("second system of %d atoms at step %d, etot %.8f\n", state.natoms, state.nfi, state.etot);
+
+    ljmd_destroy(e);
+    free(first.r);
+    free(again.r);
+    remove(CHECKPOINT);
+    return 0;
+}